@@ -0,0 +1,434 @@
+#include <cstdint>
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+
+namespace chip8 {
+namespace analysis {
+
+// What a byte of the address space has been classified as. Bytes that
+// are never reached and never referenced stay unknown.
+enum class byte_kind : std::uint8_t {
+  unknown,
+  code,
+  sprite,
+  data
+};
+
+// How control leaves a basic block.
+enum class exit_kind : std::uint8_t {
+  fallthrough,  // next instruction is a leader
+  jump,         // 1NNN
+  call,         // 2NNN, continues at the return site
+  ret,          // 00EE
+  skip,         // 3XNN 4XNN 5XY0 9XY0 EX9E EXA1
+  indirect,     // BNNN, target depends on V0
+  key_wait,     // FX0A, runs again until a key is down
+  end           // ran off the end of the loaded image
+};
+
+struct basic_block {
+  std::uint16_t start;
+  // one past the last byte of the block
+  std::uint16_t end;
+  exit_kind exit;
+  std::vector<std::uint16_t> successors;
+  // subroutine entered by a call block
+  std::uint16_t callee;
+
+  std::uint16_t last() const { return end - 2; }
+  std::size_t instructions() const { return (end - start) / 2; }
+};
+
+struct rom_analysis {
+  std::uint16_t entry;
+  // first byte of the program
+  std::uint16_t base;
+  std::uint16_t limit;
+  std::map<std::uint16_t, basic_block> blocks;
+  // subroutine entry -> subroutines it calls. The program entry point
+  // is treated as a subroutine as well.
+  std::map<std::uint16_t, std::set<std::uint16_t>> call_graph;
+  // addresses of BNNN instructions
+  std::vector<std::uint16_t> indirect_jumps;
+  byte_kind kind[4096];
+
+  bool is_code(std::uint16_t addr) const {
+    return addr < 4096 && kind[addr] == byte_kind::code;
+  }
+
+  // Block containing addr, or nullptr if addr is not reachable code.
+  const basic_block* block_at(std::uint16_t addr) const {
+    auto it = blocks.upper_bound(addr);
+    if (it == blocks.begin()) return nullptr;
+    --it;
+    if (addr >= it->second.end) return nullptr;
+    return &it->second;
+  }
+
+  std::string to_dot() const;
+  std::string to_json() const;
+};
+
+inline const char* to_string(exit_kind e) {
+  switch (e) {
+    case exit_kind::fallthrough: return "fallthrough";
+    case exit_kind::jump:        return "jump";
+    case exit_kind::call:        return "call";
+    case exit_kind::ret:         return "ret";
+    case exit_kind::skip:        return "skip";
+    case exit_kind::indirect:    return "indirect";
+    case exit_kind::key_wait:    return "key_wait";
+    case exit_kind::end:         return "end";
+  }
+  return "unknown";
+}
+
+inline const char* to_string(byte_kind k) {
+  switch (k) {
+    case byte_kind::unknown: return "unknown";
+    case byte_kind::code:    return "code";
+    case byte_kind::sprite:  return "sprite";
+    case byte_kind::data:    return "data";
+  }
+  return "unknown";
+}
+
+inline bool is_skip(std::uint16_t opcode) {
+  return (opcode & 0xF000) == 0x3000 ||
+         (opcode & 0xF000) == 0x4000 ||
+         (opcode & 0xF00F) == 0x5000 ||
+         (opcode & 0xF00F) == 0x9000 ||
+         (opcode & 0xF0FF) == 0xE09E ||
+         (opcode & 0xF0FF) == 0xE0A1;
+}
+
+// True if the instruction ends a basic block.
+inline bool is_terminator(std::uint16_t opcode) {
+  return (opcode & 0xF000) == 0x1000 ||
+         (opcode & 0xF000) == 0x2000 ||
+         (opcode & 0xF000) == 0xB000 ||
+         (opcode & 0xFFFF) == 0x00EE ||
+         (opcode & 0xF0FF) == 0xF00A ||
+         is_skip(opcode);
+}
+
+// Walks the image from entry following 1NNN/2NNN/skip edges and returns
+// the recovered basic blocks, call graph and byte classification. Only
+// memory[base, limit) is considered part of the program; jumps out of it,
+// e.g. into the font below 0x200, leave the program like jumps past the
+// end.
+inline rom_analysis analyze(const std::uint8_t* memory, std::uint16_t limit,
+                            std::uint16_t entry = 0x200,
+                            std::uint16_t base = 0x200) {
+  rom_analysis r;
+  r.entry = entry;
+  r.base = base;
+  r.limit = limit;
+  for (auto& k : r.kind) k = byte_kind::unknown;
+
+  auto fetch = [&](std::uint16_t a) -> std::uint16_t {
+    return (memory[a] << 8) | memory[a+1];
+  };
+  auto fits = [&](std::uint16_t a) { return a >= base && a + 1 < limit; };
+
+  // Pass 1: find every reachable instruction and every block leader.
+  std::set<std::uint16_t> leaders;
+  std::vector<bool> seen(4096, false);
+  std::vector<std::uint16_t> work;
+  std::set<std::uint16_t> functions{entry};
+  leaders.insert(entry);
+  work.push_back(entry);
+
+  while (!work.empty()) {
+    std::uint16_t a = work.back();
+    work.pop_back();
+    while (fits(a) && !seen[a]) {
+      seen[a] = true;
+      std::uint16_t opcode = fetch(a);
+      std::uint16_t nnn = opcode & 0x0FFF;
+      if ((opcode & 0xF000) == 0x1000) {
+        leaders.insert(nnn);
+        work.push_back(nnn);
+        break;
+      }
+      if ((opcode & 0xF000) == 0x2000) {
+        functions.insert(nnn);
+        leaders.insert(nnn);
+        work.push_back(nnn);
+        leaders.insert(a + 2);
+        a += 2;
+        continue;
+      }
+      if ((opcode & 0xFFFF) == 0x00EE || (opcode & 0xF000) == 0xB000) {
+        break;
+      }
+      if (is_skip(opcode)) {
+        leaders.insert(a + 2);
+        leaders.insert(a + 4);
+        work.push_back(a + 4);
+      }
+      if ((opcode & 0xF0FF) == 0xF00A) {
+        // a block of its own, as it loops to itself until a key is down
+        leaders.insert(a);
+        leaders.insert(a + 2);
+      }
+      a += 2;
+    }
+  }
+
+  // Pass 2: cut the reachable instructions into blocks.
+  for (std::uint16_t leader : leaders) {
+    if (!fits(leader) || !seen[leader] || r.blocks.count(leader)) continue;
+    basic_block b{leader, leader, exit_kind::fallthrough, {}, 0};
+    std::uint16_t a = leader;
+    while (true) {
+      if (!fits(a)) {
+        b.exit = exit_kind::end;
+        break;
+      }
+      std::uint16_t opcode = fetch(a);
+      a += 2;
+      if (is_terminator(opcode)) {
+        std::uint16_t nnn = opcode & 0x0FFF;
+        if ((opcode & 0xF000) == 0x1000) {
+          b.exit = exit_kind::jump;
+          b.successors.push_back(nnn);
+        } else if ((opcode & 0xF000) == 0x2000) {
+          b.exit = exit_kind::call;
+          b.callee = nnn;
+          b.successors.push_back(a);
+        } else if ((opcode & 0xF000) == 0xB000) {
+          b.exit = exit_kind::indirect;
+          r.indirect_jumps.push_back(a - 2);
+        } else if ((opcode & 0xFFFF) == 0x00EE) {
+          b.exit = exit_kind::ret;
+        } else if ((opcode & 0xF0FF) == 0xF00A) {
+          b.exit = exit_kind::key_wait;
+          b.successors.push_back(a - 2);
+          b.successors.push_back(a);
+        } else {
+          b.exit = exit_kind::skip;
+          b.successors.push_back(a);
+          b.successors.push_back(a + 2);
+        }
+        break;
+      }
+      if (leaders.count(a)) {
+        b.successors.push_back(a);
+        break;
+      }
+    }
+    b.end = a;
+    for (std::uint16_t i = b.start; i < b.end && i < 4096; i++) {
+      r.kind[i] = byte_kind::code;
+    }
+    r.blocks[leader] = b;
+  }
+
+  // Pass 3: call graph. Each subroutine owns the blocks reachable from
+  // its entry without entering a callee.
+  for (std::uint16_t f : functions) {
+    std::set<std::uint16_t>& callees = r.call_graph[f];
+    std::set<std::uint16_t> visited;
+    std::vector<std::uint16_t> stack{f};
+    while (!stack.empty()) {
+      std::uint16_t s = stack.back();
+      stack.pop_back();
+      auto it = r.blocks.find(s);
+      if (it == r.blocks.end() || !visited.insert(s).second) continue;
+      if (it->second.exit == exit_kind::call) callees.insert(it->second.callee);
+      for (std::uint16_t succ : it->second.successors) stack.push_back(succ);
+    }
+  }
+
+  // Pass 4: propagate constant values of I between blocks so that DXYN,
+  // FX33, FX55 and FX65 operands can be classified as sprite or data.
+  // -1 means not yet known, -2 means I differs between predecessors.
+  std::map<std::uint16_t, int> i_in;
+  for (auto& b : r.blocks) i_in[b.first] = -1;
+  i_in[entry] = -2;
+  for (std::uint16_t f : functions) i_in[f] = -2;
+  auto mark = [&](int i, int n, byte_kind k) {
+    for (int j = 0; j < n; j++) {
+      if (i + j < 4096 && r.kind[i+j] != byte_kind::code) r.kind[i+j] = k;
+    }
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto& entry_block : r.blocks) {
+      const basic_block& b = entry_block.second;
+      int i = i_in[b.start];
+      if (i == -1) continue;
+      for (std::uint16_t a = b.start; a < b.end; a += 2) {
+        std::uint16_t opcode = fetch(a);
+        std::uint16_t x = (opcode & 0x0F00) >> 8;
+        if ((opcode & 0xF000) == 0xA000) {
+          i = opcode & 0x0FFF;
+        } else if ((opcode & 0xF0FF) == 0xF01E ||
+                   (opcode & 0xF0FF) == 0xF029) {
+          i = -2;
+        } else if (i >= 0) {
+          if ((opcode & 0xF000) == 0xD000) {
+            mark(i, opcode & 0x000F, byte_kind::sprite);
+          } else if ((opcode & 0xF0FF) == 0xF033) {
+            mark(i, 3, byte_kind::data);
+          } else if ((opcode & 0xF0FF) == 0xF055 ||
+                     (opcode & 0xF0FF) == 0xF065) {
+            mark(i, x + 1, byte_kind::data);
+          }
+        }
+      }
+      // The callee may change I, so the return site sees an unknown I.
+      if (b.exit == exit_kind::call) i = -2;
+      for (std::uint16_t succ : b.successors) {
+        auto it = i_in.find(succ);
+        if (it == i_in.end() || it->second == -2) continue;
+        int merged = (it->second == -1 || it->second == i) ? i : -2;
+        if (merged != it->second) {
+          it->second = merged;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  std::sort(r.indirect_jumps.begin(), r.indirect_jumps.end());
+  return r;
+}
+
+inline rom_analysis analyze(const emulator& emu, std::uint16_t limit,
+                            std::uint16_t entry = 0x200,
+                            std::uint16_t base = 0x200) {
+  if (limit > address_space) limit = address_space;
+  return analyze(emu.memory, limit, entry, base);
+}
+
+inline std::string rom_analysis::to_dot() const {
+  std::string out = "digraph chip8 {\n  node [shape=box fontname=monospace];\n";
+  char buf[128];
+  for (auto& entry_block : blocks) {
+    const basic_block& b = entry_block.second;
+    std::snprintf(buf, sizeof(buf),
+                  "  b%03x [label=\"0x%03x-0x%03x\\n%s\"];\n",
+                  b.start, b.start, b.last(), to_string(b.exit));
+    out += buf;
+    for (std::uint16_t s : b.successors) {
+      std::snprintf(buf, sizeof(buf), "  b%03x -> b%03x;\n", b.start, s);
+      out += buf;
+    }
+    if (b.exit == exit_kind::call) {
+      std::snprintf(buf, sizeof(buf),
+                    "  b%03x -> b%03x [style=dashed label=call];\n",
+                    b.start, b.callee);
+      out += buf;
+    }
+  }
+  out += "}\n";
+  return out;
+}
+
+inline std::string rom_analysis::to_json() const {
+  std::string out = "{\n";
+  char buf[128];
+  std::snprintf(buf, sizeof(buf), "  \"entry\": %u,\n  \"blocks\": [", entry);
+  out += buf;
+  bool first = true;
+  for (auto& entry_block : blocks) {
+    const basic_block& b = entry_block.second;
+    std::snprintf(buf, sizeof(buf),
+                  "%s\n    {\"start\": %u, \"end\": %u, \"exit\": \"%s\", "
+                  "\"successors\": [",
+                  first ? "" : ",", b.start, b.end, to_string(b.exit));
+    out += buf;
+    for (std::size_t i = 0; i < b.successors.size(); i++) {
+      out += (i ? ", " : "") + std::to_string(b.successors[i]);
+    }
+    out += "]";
+    if (b.exit == exit_kind::call) {
+      out += ", \"callee\": " + std::to_string(b.callee);
+    }
+    out += "}";
+    first = false;
+  }
+  out += "\n  ],\n  \"call_graph\": {";
+  first = true;
+  for (auto& f : call_graph) {
+    out += (first ? "\n    \"" : ",\n    \"") + std::to_string(f.first) + "\": [";
+    bool first_callee = true;
+    for (std::uint16_t c : f.second) {
+      out += (first_callee ? "" : ", ") + std::to_string(c);
+      first_callee = false;
+    }
+    out += "]";
+    first = false;
+  }
+  out += "\n  },\n  \"indirect_jumps\": [";
+  for (std::size_t i = 0; i < indirect_jumps.size(); i++) {
+    out += (i ? ", " : "") + std::to_string(indirect_jumps[i]);
+  }
+  // Regions are emitted as runs of equally classified bytes.
+  out += "],\n  \"regions\": [";
+  first = true;
+  for (unsigned a = entry; a < limit; ) {
+    unsigned b = a;
+    while (b < limit && kind[b] == kind[a]) b++;
+    std::snprintf(buf, sizeof(buf),
+                  "%s\n    {\"start\": %u, \"end\": %u, \"kind\": \"%s\"}",
+                  first ? "" : ",", a, b, to_string(kind[a]));
+    out += buf;
+    first = false;
+    a = b;
+  }
+  out += "\n  ]\n}\n";
+  return out;
+}
+
+// Listing of memory[begin, end) that prints reachable code as
+// instructions and everything else as bytes. Sprite rows are drawn so
+// they can be recognised in the listing.
+inline std::string disassemble(const std::uint8_t* memory,
+                               const rom_analysis& r,
+                               std::uint16_t begin, std::uint16_t end) {
+  std::string out;
+  char buf[160];
+  std::uint16_t a = begin;
+  while (a < end) {
+    if (r.blocks.count(a)) {
+      std::snprintf(buf, sizeof(buf), "\nblock_%03x:\n", a);
+      out += buf;
+    }
+    if (r.is_code(a) && a + 1 < end) {
+      std::uint16_t opcode = (memory[a] << 8) | memory[a+1];
+      std::snprintf(buf, sizeof(buf), "  %03x  %04x  %s\n", a, opcode,
+                    OpCode::as_string(opcode).c_str());
+      out += buf;
+      a += 2;
+      continue;
+    }
+    char row[9];
+    for (int j = 0; j < 8; j++) row[j] = (memory[a] >> (7-j)) & 1 ? '#' : '.';
+    row[8] = 0;
+    std::snprintf(buf, sizeof(buf), "  %03x  %02x    DB %-7s %s\n", a,
+                  memory[a], to_string(r.kind[a]),
+                  r.kind[a] == byte_kind::sprite ? row : "");
+    out += buf;
+    a += 1;
+  }
+  return out;
+}
+
+}  // namespace analysis
+}  // namespace chip8
+
+#endif  // ANALYSIS_H_
@@ -0,0 +1,55 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+#include "chip8.h"
+#include "analysis.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8analyze [--dis|--dot|--json] <rom>
+//
+// Prints the control-flow analysis of a ROM loaded at 0x200 as a
+// listing, a Graphviz graph or JSON.
+int main(int argc, char** argv) {
+  const char* format = "--dis";
+  const char* path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      format = argv[i];
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr) {
+    std::cerr << "usage: chip8analyze [--dis|--dot|--json] <rom>" << std::endl;
+    return 1;
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(input), {});
+  if (buffer.size() > 4096 - 0x200) {
+    std::cerr << path << " does not fit into memory" << std::endl;
+    return 1;
+  }
+
+  chip8::emulator emu;
+  emu.initialize();
+  std::memcpy(&emu.memory[0x200], buffer.data(), buffer.size());
+  std::uint16_t limit = 0x200 + buffer.size();
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, limit);
+
+  if (std::strcmp(format, "--dot") == 0) {
+    std::cout << r.to_dot();
+  } else if (std::strcmp(format, "--json") == 0) {
+    std::cout << r.to_json();
+  } else {
+    std::cout << chip8::analysis::disassemble(emu.memory, r, 0x200, limit);
+  }
+  return 0;
+}
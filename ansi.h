@@ -0,0 +1,180 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef ANSI_H_
+#define ANSI_H_
+
+namespace chip8 {
+
+// Draws the screen on a VT100/xterm compatible terminal without curses.
+// Two pixel rows share one character cell through the Unicode half
+// blocks, so the screen takes 64x16 cells. Every frame is compared with
+// the previous one and only changed cells are written, joined by the
+// shortest cursor movement, and the result goes out in a single write().
+class ansi_renderer {
+public:
+  // row and column of the top left cell, starting at 1
+  explicit ansi_renderer(int fd = STDOUT_FILENO, unsigned row = 1,
+                         unsigned column = 1)
+    : fd(fd), top(row), left(column) {}
+
+  // Builds the escape sequence for the frame and writes it. Returns the
+  // number of bytes written.
+  std::size_t render(const emulator& emu) { return render(emu.gfx); }
+
+  std::size_t render(const std::uint8_t (&gfx)[32][64]) {
+    std::size_t n = build(gfx);
+    flush(n);
+    return n;
+  }
+
+  // Builds the output for the frame into the internal buffer without
+  // writing it; data() and the return value describe it.
+  std::size_t build(const emulator& emu) { return build(emu.gfx); }
+
+  std::size_t build(const std::uint8_t (&gfx)[32][64]) {
+    len = 0;
+    if (!drawn) {
+      append("\x1b[?25l\x1b[2J");
+      // unknown position, the first cell gets an absolute move
+      cursor_row = rows;
+    }
+    for (unsigned r = 0; r < rows; r++) {
+      for (unsigned c = 0; c < columns; c++) {
+        std::uint8_t cell = (gfx[2*r][c] ? 1 : 0) | (gfx[2*r+1][c] ? 2 : 0);
+        if (drawn && cell == cells[r][c]) continue;
+        move_to(r, c);
+        append(glyph[cell]);
+        cells[r][c] = cell;
+        cursor_column++;
+      }
+    }
+    drawn = true;
+    bytes += len;
+    frames++;
+    return len;
+  }
+
+  // Moves the cursor below the screen and shows it again.
+  void finish() {
+    len = 0;
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "\x1b[%u;1H\x1b[?25h", top + rows);
+    append(buf);
+    flush(len);
+  }
+
+  // Forces a full redraw with the next frame, e.g. after the terminal
+  // was cleared.
+  void invalidate() { drawn = false; }
+
+  const char* data() const { return buffer; }
+
+  // Totals over all frames built so far.
+  std::uint64_t bytes = 0;
+  std::uint64_t frames = 0;
+
+private:
+  static constexpr unsigned rows = 16;
+  static constexpr unsigned columns = 64;
+  // empty, upper half, lower half and full block, indexed by
+  // top | bottom << 1
+  static constexpr const char* glyph[4] = {
+    " ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88"
+  };
+
+  void append(const char* s) {
+    std::size_t n = std::strlen(s);
+    std::memcpy(buffer + len, s, n);
+    len += n;
+  }
+
+  // Emits the cheapest way to get from the current cursor position to
+  // cell (r, c): an absolute move, or a relative vertical move followed
+  // by a cursor forward/back or by rewriting the cells in between.
+  void move_to(unsigned r, unsigned c) {
+    if (r == cursor_row && c == cursor_column) return;
+    char absolute[32];
+    int best = std::snprintf(absolute, sizeof(absolute), "\x1b[%u;%uH",
+                             top + r, left + c);
+    // After the last column the cursor waits for a wrap, so only an
+    // absolute move is reliable.
+    if (cursor_row < rows && cursor_column < columns) {
+      char vertical[16] = "";
+      int v = 0;
+      if (r > cursor_row) {
+        v = std::snprintf(vertical, sizeof(vertical), "\x1b[%uB", r - cursor_row);
+      } else if (r < cursor_row) {
+        v = std::snprintf(vertical, sizeof(vertical), "\x1b[%uA", cursor_row - r);
+      }
+      char horizontal[16] = "";
+      int h = 0;
+      bool rewrite = false;
+      if (c > cursor_column) {
+        h = std::snprintf(horizontal, sizeof(horizontal), "\x1b[%uC",
+                          c - cursor_column);
+        std::size_t cells_between = 0;
+        for (unsigned i = cursor_column; i < c; i++) {
+          cells_between += std::strlen(glyph[cells[r][i]]);
+        }
+        if (cells_between <= static_cast<std::size_t>(h)) {
+          h = cells_between;
+          rewrite = true;
+        }
+      } else if (c == 0 && left == 1) {
+        h = std::snprintf(horizontal, sizeof(horizontal), "\r");
+      } else if (c + 1 == cursor_column) {
+        h = std::snprintf(horizontal, sizeof(horizontal), "\b");
+      } else if (c < cursor_column) {
+        h = std::snprintf(horizontal, sizeof(horizontal), "\x1b[%uD",
+                          cursor_column - c);
+      }
+      if (v + h < best) {
+        append(vertical);
+        if (rewrite) {
+          for (unsigned i = cursor_column; i < c; i++) append(glyph[cells[r][i]]);
+        } else {
+          append(horizontal);
+        }
+        cursor_row = r;
+        cursor_column = c;
+        return;
+      }
+    }
+    append(absolute);
+    cursor_row = r;
+    cursor_column = c;
+  }
+
+  void flush(std::size_t n) {
+    const char* p = buffer;
+    while (n > 0) {
+      ssize_t w = ::write(fd, p, n);
+      if (w < 0 && errno == EINTR) continue;
+      if (w <= 0) return;
+      p += w;
+      n -= w;
+    }
+  }
+
+  int fd;
+  unsigned top;
+  unsigned left;
+  bool drawn = false;
+  unsigned cursor_row = rows;
+  unsigned cursor_column = 0;
+  std::uint8_t cells[rows][columns] = {};
+  // Worst case is every cell with its own absolute move.
+  char buffer[rows * columns * (3 + 12) + 64];
+  std::size_t len = 0;
+};
+
+}  // namespace chip8
+
+#endif  // ANSI_H_
@@ -0,0 +1,295 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "analysis.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8aot <rom> [-o out.cpp] [--name id]
+//
+// Translates a ROM into a C++ source file. Every basic block recovered by
+// chip8::analysis becomes a function that runs its instructions through
+// emulator::execute with constant opcodes, so the decoder folds away when
+// the file is compiled. Control leaves compiled code through a switch on
+// pc; indirect jumps, code that was never discovered statically and
+// blocks whose bytes were overwritten at run time go through the
+// interpreter instead.
+//
+// The generated file provides
+//
+//   namespace chip8aot_<id> {
+//     struct context;                     // per emulator verification state
+//     void load(chip8::emulator&);        // copy the ROM to 0x200
+//     std::uint64_t run(context&, chip8::emulator&, std::uint64_t cycles,
+//                       bool test = false);
+//   }
+//
+// run leaves the timers to the caller like emulator::run_cycles, so it
+// ends in the same state as run_cycles for the same number of cycles.
+//
+// plus extern "C" wrappers for use as a shared object. Compiled with
+// -DCHIP8AOT_MAIN it also contains a main() that runs the ROM headless.
+
+namespace {
+
+bool is_store(std::uint16_t opcode) {
+  return (opcode & 0xF0FF) == 0xF055 || (opcode & 0xF0FF) == 0xF033;
+}
+
+std::string hex(unsigned v, int digits) {
+  char buf[16];
+  std::snprintf(buf, sizeof(buf), "0x%0*X", digits, v);
+  return buf;
+}
+
+void generate(std::ostream& out, const std::vector<unsigned char>& rom,
+              const std::string& path, const std::string& id) {
+  chip8::emulator emu;
+  emu.initialize();
+  std::memcpy(&emu.memory[0x200], rom.data(), rom.size());
+  std::uint16_t limit = 0x200 + rom.size();
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, limit);
+  // Only blocks inside the ROM image are compiled, unchanged() compares
+  // against it. Code reached outside, e.g. the font area, is interpreted.
+  std::vector<const chip8::analysis::basic_block*> compiled;
+  for (auto& entry : r.blocks) {
+    if (entry.second.start >= 0x200 && entry.second.end <= limit) {
+      compiled.push_back(&entry.second);
+    }
+  }
+
+  std::string ns = "chip8aot_" + id;
+  out << "// Generated by chip8aot from " << path << ". Do not edit.\n"
+      << "#include <cstdint>\n"
+      << "#include <cstring>\n"
+      << "#include \"chip8.h\"\n\n"
+      << "namespace " << ns << " {\n\n"
+      << "constexpr std::uint16_t rom_size = " << rom.size() << ";\n"
+      << "constexpr std::size_t block_count = " << compiled.size() << ";\n\n"
+      << "const std::uint8_t rom_image[" << (rom.empty() ? 1 : rom.size())
+      << "] = {";
+  for (std::size_t i = 0; i < rom.size(); i++) {
+    out << (i % 12 ? " " : "\n  ") << hex(rom[i], 2) << ",";
+  }
+  out << "\n};\n\n"
+      << "// Bytes of a block still match the image it was compiled from.\n"
+      << "inline bool unchanged(const chip8::emulator& e, std::uint16_t from,\n"
+      << "                      std::uint16_t to) {\n"
+      << "  return std::memcmp(&e.memory[from], &rom_image[from - 0x200],\n"
+      << "                     to - from) == 0;\n"
+      << "}\n\n";
+
+  // One function per block. Each returns the number of instructions it
+  // executed, which is short of the block length only if a store
+  // overwrote the rest of the block.
+  for (const chip8::analysis::basic_block* block : compiled) {
+    const chip8::analysis::basic_block& b = *block;
+    out << "// " << hex(b.start, 3) << "-" << hex(b.last(), 3) << " "
+        << chip8::analysis::to_string(b.exit) << "\n"
+        << "int block_" << hex(b.start, 3).substr(2)
+        << "(chip8::emulator& e, bool test) {\n";
+    int n = 0;
+    for (std::uint16_t a = b.start; a < b.end; a += 2) {
+      std::uint16_t opcode = (emu.memory[a] << 8) | emu.memory[a+1];
+      out << "  e.opcode = " << hex(opcode, 4) << ";\n"
+          << "  e.execute(" << hex(opcode, 4) << ", test);  // "
+          << chip8::OpCode::as_string(opcode) << "\n";
+      n++;
+      if (is_store(opcode) && a + 2 < b.end) {
+        out << "  if (!unchanged(e, " << hex(a + 2, 3) << ", "
+            << hex(b.end, 3) << ")) return " << n << ";\n";
+      }
+    }
+    out << "  return " << n << ";\n}\n\n";
+  }
+
+  out << "struct block_info {\n"
+      << "  std::uint16_t start;\n"
+      << "  std::uint16_t end;\n"
+      << "  bool stores;\n"
+      << "  int (*fn)(chip8::emulator&, bool);\n"
+      << "};\n\n"
+      << "const block_info blocks[block_count ? block_count : 1] = {\n";
+  for (const chip8::analysis::basic_block* block : compiled) {
+    const chip8::analysis::basic_block& b = *block;
+    bool stores = false;
+    for (std::uint16_t a = b.start; a < b.end; a += 2) {
+      stores |= is_store((emu.memory[a] << 8) | emu.memory[a+1]);
+    }
+    out << "  { " << hex(b.start, 3) << ", " << hex(b.end, 3) << ", "
+        << (stores ? "true" : "false") << ", &block_"
+        << hex(b.start, 3).substr(2) << " },\n";
+  }
+  if (compiled.empty()) out << "  { 0, 0, false, nullptr },\n";
+  out << "};\n\n"
+      << "// Index into blocks of the block starting at pc, or -1.\n"
+      << "inline int lookup(std::uint16_t pc) {\n"
+      << "  switch (pc) {\n";
+  int index = 0;
+  for (const chip8::analysis::basic_block* b : compiled) {
+    out << "    case " << hex(b->start, 3) << ": return " << index++
+        << ";\n";
+  }
+  out << "    default: return -1;\n"
+      << "  }\n"
+      << "}\n\n";
+
+  out << R"(// Tracks which blocks still match memory. Every store bumps the epoch
+// and a block is compared against the image again before its next run.
+struct context {
+  std::uint32_t epoch = 1;
+  std::uint32_t verified[block_count ? block_count : 1] = {};
+  bool valid[block_count ? block_count : 1] = {};
+  std::uint64_t compiled = 0;
+  std::uint64_t interpreted = 0;
+};
+
+void load(chip8::emulator& e) {
+  std::memcpy(&e.memory[0x200], rom_image, rom_size);
+}
+
+// Runs exactly `cycles` instructions and returns how many ran. Blocks
+// that would overrun the budget are interpreted one instruction at a
+// time so callers can interleave compiled and interpreted execution.
+// Like run_cycles the timers are left alone; tick them once a frame.
+std::uint64_t run(context& ctx, chip8::emulator& e, std::uint64_t cycles,
+                  bool test = false) {
+  std::uint64_t done = 0;
+  while (done < cycles) {
+    int i = lookup(e.pc);
+    if (i >= 0 && ctx.verified[i] != ctx.epoch) {
+      ctx.valid[i] = unchanged(e, blocks[i].start, blocks[i].end);
+      ctx.verified[i] = ctx.epoch;
+    }
+    if (i >= 0 && ctx.valid[i] &&
+        static_cast<std::uint64_t>(blocks[i].end - blocks[i].start) <=
+          2 * (cycles - done)) {
+      int n = blocks[i].fn(e, test);
+      e.cycles += n;
+      done += n;
+      ctx.compiled += n;
+      if (blocks[i].stores) ctx.epoch++;
+      continue;
+    }
+    e.run_cycles(1, test);
+    done++;
+    ctx.interpreted++;
+    if ((e.opcode & 0xF0FF) == 0xF055 || (e.opcode & 0xF0FF) == 0xF033) {
+      ctx.epoch++;
+    }
+  }
+  return done;
+}
+
+}  // namespace )" << ns << R"(
+
+extern "C" {
+
+)" << ns << "::context* " << ns << "_create() {\n"
+      << "  return new " << ns << "::context;\n"
+      << "}\n\n"
+      << "void " << ns << "_destroy(" << ns << "::context* ctx) {\n"
+      << "  delete ctx;\n"
+      << "}\n\n"
+      << "void " << ns << "_load(chip8::emulator* e) {\n"
+      << "  " << ns << "::load(*e);\n"
+      << "}\n\n"
+      << "std::uint64_t " << ns << "_run(" << ns
+      << "::context* ctx, chip8::emulator* e,\n"
+      << "                             std::uint64_t cycles) {\n"
+      << "  return " << ns << "::run(*ctx, *e, cycles);\n"
+      << "}\n\n"
+      << "}  // extern \"C\"\n\n";
+
+  out << R"(#ifdef CHIP8AOT_MAIN
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+class no_key_interface : public chip8::KeyInterface {
+public:
+  std::uint8_t getKey(int) noexcept { return 0xFF; }
+};
+
+// usage: <binary> [cycles], run as frames of cycles_per_frame
+int main(int argc, char** argv) {
+  std::uint64_t cycles = argc > 1 ? std::strtoull(argv[1], nullptr, 0)
+                                  : 1000000;
+  chip8::emulator emu;
+  emu.initialize();
+  emu.set_keyinterface(std::make_unique<no_key_interface>());
+  )" << ns << R"(::load(emu);
+  )" << ns << R"(::context ctx;
+  for (std::uint64_t done = 0; done < cycles; done += emu.cycles_per_frame) {
+    )" << ns << R"(::run(ctx, emu, std::min<std::uint64_t>(cycles - done,
+                                       emu.cycles_per_frame), true);
+    emu.tick_timers();
+  }
+
+  for (int k = 0; k < 32; k++) {
+    for (int m = 0; m < 64; m++) std::cout << (emu.gfx[k][m] ? 'x' : ' ');
+    std::cout << '\n';
+  }
+  std::cout << "compiled " << ctx.compiled << " interpreted "
+            << ctx.interpreted << std::endl;
+  return 0;
+}
+#endif  // CHIP8AOT_MAIN
+)";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  const char* output = nullptr;
+  std::string id = "rom";
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (std::strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+      id = argv[++i];
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr) {
+    std::cerr << "usage: chip8aot <rom> [-o out.cpp] [--name id]" << std::endl;
+    return 1;
+  }
+  for (char c : id) {
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+      std::cerr << "--name must be a C++ identifier" << std::endl;
+      return 1;
+    }
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  std::vector<unsigned char> rom(std::istreambuf_iterator<char>(input), {});
+  if (rom.size() > 4096 - 0x200) {
+    std::cerr << path << " does not fit into memory" << std::endl;
+    return 1;
+  }
+
+  if (output == nullptr) {
+    generate(std::cout, rom, path, id);
+    return 0;
+  }
+  std::ofstream out(output);
+  generate(out, rom, path, id);
+  if (!out) {
+    std::cerr << "cannot write " << output << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include "chip8.h"
+#include "lockstep.h"
+
+// Copyright 2019 Daniel Weber
+
+// <binary> [cycles]
+//
+// Built together with a file generated by chip8aot --name CHIP8AOT_ID.
+// Runs the compiled ROM and emulator::run_cycles side by side for cycles
+// instructions (default 200000) in chunks of 1 to 23, with a key pattern
+// that changes between chunks and a timer tick every frame, and compares
+// the whole machine state after every chunk. Chunks that end inside a
+// block make the compiled code fall back to the interpreter, key changes
+// reach EX9E, EXA1 and FX0A at every point of the program. Prints the
+// first difference and exits with 1 if the two disagree.
+
+#define CHIP8AOT_CAT2(a, b, c) a##b##c
+#define CHIP8AOT_CAT(a, b, c) CHIP8AOT_CAT2(a, b, c)
+#define CHIP8AOT_NAME(suffix) CHIP8AOT_CAT(chip8aot_, CHIP8AOT_ID, suffix)
+
+namespace CHIP8AOT_NAME() {
+struct context;
+}
+
+extern "C" {
+CHIP8AOT_NAME()::context* CHIP8AOT_NAME(_create)();
+void CHIP8AOT_NAME(_destroy)(CHIP8AOT_NAME()::context* ctx);
+void CHIP8AOT_NAME(_load)(chip8::emulator* e);
+std::uint64_t CHIP8AOT_NAME(_run)(CHIP8AOT_NAME()::context* ctx,
+                                  chip8::emulator* e, std::uint64_t cycles);
+}
+
+int main(int argc, char** argv) {
+  const std::uint64_t cycles = argc > 1 ? std::strtoull(argv[1], nullptr, 0)
+                                        : 200000;
+  auto compiled = std::make_unique<chip8::emulator>();
+  auto interpreted = std::make_unique<chip8::emulator>();
+  for (chip8::emulator* e : { compiled.get(), interpreted.get() }) {
+    e->initialize();
+    CHIP8AOT_NAME(_load)(e);
+    e->seed(7);
+  }
+  std::unique_ptr<CHIP8AOT_NAME()::context, void (*)(CHIP8AOT_NAME()::context*)>
+    ctx(CHIP8AOT_NAME(_create)(), CHIP8AOT_NAME(_destroy));
+
+  std::uint32_t r = 1;
+  std::uint64_t done = 0, frame = 0;
+  while (done < cycles) {
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    // No key half of the time, so FX0A waits as well.
+    const std::uint16_t keys = (r & 1) ? static_cast<std::uint16_t>(r >> 8) : 0;
+    const std::uint64_t n = 1 + (r >> 27) % 23;
+    compiled->keys = interpreted->keys = keys;
+    CHIP8AOT_NAME(_run)(ctx.get(), compiled.get(), n);
+    interpreted->run_cycles(n);
+    done += n;
+    if (done / interpreted->cycles_per_frame != frame) {
+      frame = done / interpreted->cycles_per_frame;
+      compiled->tick_timers();
+      interpreted->tick_timers();
+    }
+    std::string diff = chip8::state_diff(*interpreted, *compiled);
+    if (!diff.empty()) {
+      std::printf("compiled code differs from run_cycles after %llu "
+                  "cycles (interpreted, compiled):\n%s",
+                  static_cast<unsigned long long>(done), diff.c_str());
+      return 1;
+    }
+  }
+  std::printf("%llu cycles match\n", static_cast<unsigned long long>(done));
+  return 0;
+}
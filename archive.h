@@ -0,0 +1,319 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+namespace chip8 {
+
+// ROM archive layout, in the host's byte order like save states:
+//
+//   archive_header
+//   archive_entry[count]       sorted by name
+//   archive_hash[count]        sorted by rom_hash
+//   names, ROMs, descriptions and basic block tables
+//
+// Everything is reached through offsets from the start of the file, so a
+// mapped archive is used in place.
+struct archive_header {
+  static constexpr std::uint16_t current_version = 1;
+
+  char magic[4];               // "C8RA"
+  std::uint16_t version;
+  std::uint16_t flags;
+  std::uint32_t count;
+  std::uint32_t entries_offset;
+  std::uint32_t hashes_offset;
+  std::uint32_t file_size;
+  std::uint32_t reserved[2];
+};
+
+struct archive_entry {
+  std::uint32_t name_offset;
+  std::uint32_t name_size;
+  std::uint32_t rom_offset;
+  std::uint32_t rom_size;
+  std::uint32_t rom_hash;          // hash_rom
+  std::uint32_t quirks;            // quirk flags the ROM expects
+  // basic blocks as (start, end) pairs of std::uint16_t, see
+  // analysis::basic_block; block_count 0 if not analyzed
+  std::uint32_t blocks_offset;
+  std::uint32_t block_count;
+  std::uint32_t text_offset;
+  std::uint32_t text_size;
+  std::uint16_t cycles_per_frame;  // recommended speed
+  std::uint16_t reserved;
+  // host key for each CHIP-8 key, e.g. "0123456789abcdef"
+  char keymap[16];
+  std::uint32_t reserved2;
+};
+
+struct archive_hash {
+  std::uint32_t rom_hash;
+  std::uint32_t entry;
+};
+
+static_assert(sizeof(archive_header) == 32, "archive_header is part of the file format");
+static_assert(sizeof(archive_entry) == 64, "archive_entry is part of the file format");
+
+// A ROM and its metadata, for building an archive and as read from one.
+struct archive_rom {
+  std::string name;
+  std::vector<std::uint8_t> data;
+  std::uint16_t cycles_per_frame = 10;
+  std::uint32_t quirks = emulator_quirks;
+  char keymap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
+                      '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+  std::string description;
+  std::vector<std::pair<std::uint16_t, std::uint16_t>> blocks;
+};
+
+// Writes ROMs into an archive. Names must be unique.
+inline std::vector<std::uint8_t> encode_archive(std::vector<archive_rom> roms) {
+  std::sort(roms.begin(), roms.end(),
+            [](const archive_rom& a, const archive_rom& b) { return a.name < b.name; });
+  const std::uint32_t count = roms.size();
+  archive_header header = {};
+  std::memcpy(header.magic, "C8RA", 4);
+  header.version = archive_header::current_version;
+  header.count = count;
+  header.entries_offset = sizeof(archive_header);
+  header.hashes_offset = header.entries_offset + count * sizeof(archive_entry);
+
+  std::vector<archive_entry> entries(count);
+  std::vector<archive_hash> hashes(count);
+  std::vector<std::uint8_t> data;
+  const std::uint32_t data_offset =
+    header.hashes_offset + count * sizeof(archive_hash);
+  auto append = [&data, data_offset](const void* p, std::size_t n,
+                                     std::size_t align) {
+    while (data.size() % align) data.push_back(0);
+    std::uint32_t offset = data_offset + data.size();
+    const std::uint8_t* bytes = static_cast<const std::uint8_t*>(p);
+    data.insert(data.end(), bytes, bytes + n);
+    return offset;
+  };
+  for (std::uint32_t i = 0; i < count; i++) {
+    const archive_rom& r = roms[i];
+    archive_entry& e = entries[i];
+    e.name_offset = append(r.name.data(), r.name.size(), 1);
+    e.name_size = r.name.size();
+    e.rom_offset = append(r.data.data(), r.data.size(), 1);
+    e.rom_size = r.data.size();
+    e.rom_hash = hash_rom(r.data.data(), r.data.size());
+    e.quirks = r.quirks;
+    e.blocks_offset = append(r.blocks.data(), r.blocks.size() * 4, 2);
+    e.block_count = r.blocks.size();
+    e.text_offset = append(r.description.data(), r.description.size(), 1);
+    e.text_size = r.description.size();
+    e.cycles_per_frame = r.cycles_per_frame;
+    std::memcpy(e.keymap, r.keymap, sizeof(e.keymap));
+    hashes[i] = { e.rom_hash, i };
+  }
+  std::sort(hashes.begin(), hashes.end(),
+            [](const archive_hash& a, const archive_hash& b) {
+              return a.rom_hash != b.rom_hash ? a.rom_hash < b.rom_hash
+                                              : a.entry < b.entry;
+            });
+  header.file_size = data_offset + data.size();
+
+  std::vector<std::uint8_t> out(header.file_size);
+  std::memcpy(out.data(), &header, sizeof(header));
+  if (count != 0) {
+    std::memcpy(out.data() + header.entries_offset, entries.data(),
+                count * sizeof(archive_entry));
+    std::memcpy(out.data() + header.hashes_offset, hashes.data(),
+                count * sizeof(archive_hash));
+  }
+  if (!data.empty()) std::memcpy(out.data() + data_offset, data.data(), data.size());
+  return out;
+}
+
+// A mapped archive. Batch tools open one file instead of one per ROM and
+// read ROMs straight from the mapping, shared between processes through
+// the page cache.
+class rom_archive {
+public:
+  rom_archive() = default;
+  rom_archive(const rom_archive&) = delete;
+  rom_archive& operator=(const rom_archive&) = delete;
+  ~rom_archive() { close(); }
+
+  bool open(const std::string& path, std::string& error) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error = "cannot open " + path;
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(archive_header)) {
+      ::close(fd);
+      error = path + " is not a ROM archive";
+      return false;
+    }
+    size = st.st_size;
+    void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map " + path;
+      return false;
+    }
+    mapping = static_cast<const std::uint8_t*>(p);
+    if (!check(error)) {
+      error = path + error;
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (mapping != nullptr) ::munmap(const_cast<std::uint8_t*>(mapping), size);
+    mapping = nullptr;
+    size = 0;
+  }
+
+  std::size_t count() const {
+    return mapping != nullptr ? header().count : 0;
+  }
+
+  const archive_entry& entry(std::size_t i) const { return entries()[i]; }
+
+  std::string_view name(std::size_t i) const {
+    const archive_entry& e = entry(i);
+    return { reinterpret_cast<const char*>(mapping + e.name_offset), e.name_size };
+  }
+
+  const std::uint8_t* rom(std::size_t i) const {
+    return mapping + entry(i).rom_offset;
+  }
+
+  std::string_view description(std::size_t i) const {
+    const archive_entry& e = entry(i);
+    return { reinterpret_cast<const char*>(mapping + e.text_offset), e.text_size };
+  }
+
+  // Start and end address of basic block b of entry i.
+  std::pair<std::uint16_t, std::uint16_t> block(std::size_t i,
+                                                std::size_t b) const {
+    std::uint16_t pair[2];
+    std::memcpy(pair, mapping + entry(i).blocks_offset + b * 4, 4);
+    return { pair[0], pair[1] };
+  }
+
+  // Index of the entry called name, or -1.
+  long find(std::string_view name) const {
+    std::size_t lo = 0, hi = count();
+    while (lo < hi) {
+      std::size_t mid = (lo + hi) / 2;
+      if (this->name(mid) < name) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo < count() && this->name(lo) == name ? static_cast<long>(lo) : -1;
+  }
+
+  // Index of the first entry whose ROM hashes to rom_hash, or -1.
+  long find_hash(std::uint32_t rom_hash) const {
+    const archive_hash* h = hashes();
+    const archive_hash* it = std::lower_bound(
+      h, h + count(), rom_hash,
+      [](const archive_hash& a, std::uint32_t v) { return a.rom_hash < v; });
+    return it != h + count() && it->rom_hash == rom_hash
+             ? static_cast<long>(it->entry) : -1;
+  }
+
+  // Loads entry i into emu with its recommended speed.
+  void load(std::size_t i, emulator& emu) const {
+    emu.load(rom(i), entry(i).rom_size);
+    emu.cycles_per_frame = entry(i).cycles_per_frame;
+  }
+
+  // A copy of entry i, e.g. to build a new archive from.
+  archive_rom get(std::size_t i) const {
+    const archive_entry& e = entry(i);
+    archive_rom r;
+    r.name = std::string(name(i));
+    r.data.assign(rom(i), rom(i) + e.rom_size);
+    r.cycles_per_frame = e.cycles_per_frame;
+    r.quirks = e.quirks;
+    std::memcpy(r.keymap, e.keymap, sizeof(r.keymap));
+    r.description = std::string(description(i));
+    for (std::uint32_t b = 0; b < e.block_count; b++) {
+      r.blocks.push_back(block(i, b));
+    }
+    return r;
+  }
+
+private:
+  const archive_header& header() const {
+    return *reinterpret_cast<const archive_header*>(mapping);
+  }
+  const archive_entry* entries() const {
+    return reinterpret_cast<const archive_entry*>(mapping + header().entries_offset);
+  }
+  const archive_hash* hashes() const {
+    return reinterpret_cast<const archive_hash*>(mapping + header().hashes_offset);
+  }
+
+  bool inside(std::uint64_t offset, std::uint64_t n) const {
+    return offset <= size && n <= size - offset;
+  }
+
+  // Validates every offset once, so accessors need no checks.
+  bool check(std::string& error) const {
+    const archive_header& h = header();
+    if (std::memcmp(h.magic, "C8RA", 4) != 0) {
+      error = " is not a ROM archive";
+      return false;
+    }
+    if (h.version != archive_header::current_version) {
+      error = " has an unsupported version";
+      return false;
+    }
+    if (h.file_size != size ||
+        h.entries_offset % alignof(archive_entry) != 0 ||
+        h.hashes_offset % alignof(archive_hash) != 0 ||
+        !inside(h.entries_offset, std::uint64_t(h.count) * sizeof(archive_entry)) ||
+        !inside(h.hashes_offset, std::uint64_t(h.count) * sizeof(archive_hash))) {
+      error = " is truncated";
+      return false;
+    }
+    for (std::uint32_t i = 0; i < h.count; i++) {
+      const archive_entry& e = entries()[i];
+      if (!inside(e.name_offset, e.name_size) ||
+          !inside(e.rom_offset, e.rom_size) ||
+          e.rom_size > address_space - 0x200 ||
+          !inside(e.blocks_offset, std::uint64_t(e.block_count) * 4) ||
+          !inside(e.text_offset, e.text_size) ||
+          hashes()[i].entry >= h.count) {
+        error = " is corrupt";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const std::uint8_t* mapping = nullptr;
+  std::size_t size = 0;
+};
+
+}  // namespace chip8
+
+#endif  // ARCHIVE_H_
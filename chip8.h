@@ -1,18 +1,27 @@
+#include <cstddef>
 #include <cstdint>
 #include <random>
 #include <memory>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <map>
 #include <string>
 #include <chrono>
+#include <concepts>
 
 // Copyright 2019 Daniel Weber
 
 #ifndef CHIP8_H_
 #define CHIP8_H_
 
+#if defined(__GNUC__)
+#define CHIP8_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define CHIP8_ALWAYS_INLINE
+#endif
+
 namespace chip8 {
 
 class OpCode {
@@ -159,6 +168,7 @@ public:
   KeyInterface() = default;
   KeyInterface(KeyInterface const&) = delete;
   KeyInterface& operator=(KeyInterface const&) = delete;
+  virtual ~KeyInterface() = default;
 
   virtual std::uint8_t getKey(int to) noexcept = 0; 
 };
@@ -182,12 +192,321 @@ constexpr unsigned char fontset[80] = {
 0xF0, 0x80, 0xF0, 0x80, 0x80   // F
 };
 
+// Chip8 addresses 4k of memory. emulator::memory is followed by a guard
+// band large enough for the longest access starting at the last address
+// (FX55/FX65 with X = F), so with pc and I masked to 12 bits once per
+// instruction no access needs its own bounds check. Multi-byte accesses
+// that run past 0xFFF (FX33, FX55, FX65, DXYN) land in the guard band
+// instead of wrapping around to 0x000. This is deliberate: no real program
+// relies on the wrap, and masking every byte would put a mask back into
+// the loops the guard band removes. The guard band is part of the machine
+// state, so save states, reset and state_diff all cover it.
+constexpr std::size_t address_space = 4096;
+constexpr std::size_t memory_guard = 16;
+constexpr std::size_t memory_size = address_space + memory_guard;
+// Granularity of the dirty page tracking used by emulator::reset
+constexpr std::size_t page_size = 256;
+constexpr std::size_t page_count = (memory_size + page_size - 1) / page_size;
+
+// Behaviour where CHIP-8 interpreters disagree. The bits describe what
+// emulator::execute does; save states record them so a state is only
+// resumed by an emulator that runs it the same way.
+enum quirk : std::uint32_t {
+  // 8XY6 and 8XYE shift VX, not VY
+  quirk_shift_vx         = 1u << 0,
+  // FX55 and FX65 leave I unchanged
+  quirk_load_store_keep_i = 1u << 1,
+  // BNNN jumps to NNN + V0
+  quirk_jump_v0          = 1u << 2,
+  // sprites wrap around at the screen edges
+  quirk_wrap_sprites     = 1u << 3,
+  // 8XY1, 8XY2 and 8XY3 leave VF alone
+  quirk_logic_keeps_vf   = 1u << 4
+};
+constexpr std::uint32_t emulator_quirks =
+  quirk_shift_vx | quirk_load_store_keep_i | quirk_jump_v0 |
+  quirk_wrap_sprites | quirk_logic_keeps_vf;
+
+// FNV-1a over a ROM image, to tell recordings and save states of
+// different ROMs apart.
+inline std::uint32_t hash_rom(const std::uint8_t* data, std::size_t size) {
+  std::uint32_t h = 2166136261u;
+  for (std::size_t i = 0; i < size; i++) h = (h ^ data[i]) * 16777619u;
+  return h;
+}
+
+// Memory contents right after initialize(): the font at 0 and zeros
+// elsewhere. Computed at compile time so resets only need to copy it.
+struct memory_image {
+  std::uint8_t bytes[memory_size];
+};
+
+constexpr memory_image make_initial_memory() {
+  memory_image image{};
+  for (int i = 0; i < 80; i++) {
+    image.bytes[i] = fontset[i];
+  }
+  return image;
+}
+
+inline constexpr memory_image initial_memory = make_initial_memory();
+
+// Zobrist keys of the screen pixels. The hash of a screen is the XOR of
+// the keys of its lit pixels, so drawing updates it with one XOR per
+// flipped pixel and a blank screen hashes to 0.
+struct screen_key_table {
+  std::uint64_t keys[32][64];
+};
+
+constexpr screen_key_table make_screen_keys() {
+  screen_key_table table{};
+  std::uint64_t state = 0x9E3779B97F4A7C15ull;
+  for (auto& row : table.keys) {
+    for (auto& key : row) {
+      // splitmix64
+      std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      key = z ^ (z >> 31);
+    }
+  }
+  return table;
+}
+
+inline constexpr screen_key_table screen_keys = make_screen_keys();
+
+// Hash of a whole screen, what emulator::gfx_hash holds for its screen.
+inline std::uint64_t hash_screen(const std::uint8_t (&gfx)[32][64]) noexcept {
+  std::uint64_t h = 0;
+  for (int y = 0; y < 32; y++) {
+    for (int x = 0; x < 64; x++) {
+      if (gfx[y][x]) h ^= screen_keys.keys[y][x];
+    }
+  }
+  return h;
+}
+
+// What happened during emulator::run_cycles or emulator::run_frame.
+struct run_events {
+  // instructions executed
+  std::uint64_t cycles = 0;
+  // DXYN or 00E0 executed
+  bool screen_changed = false;
+  // sound timer became non-zero / reached zero
+  bool sound_started = false;
+  bool sound_stopped = false;
+  // FX0A executed
+  bool key_wait = false;
+  // the attached debugger stopped execution
+  bool breakpoint = false;
+  // cycles of the total spent in recognized wait loops and skipped
+  std::uint64_t idle_cycles = 0;
+  // the run ended in a loop that only input can end
+  bool waiting_for_input = false;
+
+  // Combines the events of consecutive runs.
+  run_events& operator|=(const run_events& other) noexcept {
+    cycles         += other.cycles;
+    screen_changed |= other.screen_changed;
+    sound_started  |= other.sound_started;
+    sound_stopped  |= other.sound_stopped;
+    key_wait       |= other.key_wait;
+    breakpoint     |= other.breakpoint;
+    idle_cycles    += other.idle_cycles;
+    waiting_for_input = other.waiting_for_input;
+    return *this;
+  }
+};
+
+struct emulator;
+
+// Breakpoints and watchpoints consulted by emulateCycle while an instance
+// is attached to emulator::debug. Addresses are kept in bitmaps with one
+// bit per byte of the address space. debugger.h adds conditions and the
+// helpers used by the front-end.
+struct debug_hooks {
+  enum stop_reason : std::uint8_t {
+    none,
+    breakpoint,
+    condition,
+    read_watch,
+    write_watch,
+    register_watch,
+    stepped
+  };
+
+  std::uint8_t exec_bits[512] = {};
+  std::uint8_t read_bits[512] = {};
+  std::uint8_t write_bits[512] = {};
+  // bit n watches V[n], bit 16 watches I
+  std::uint32_t register_mask = 0;
+  // Called before an instruction if pc has a breakpoint or if
+  // always_check is set. Returns the reason to stop or none.
+  stop_reason (*check)(debug_hooks& hooks, const emulator& emu,
+                       bool at_breakpoint) = nullptr;
+  bool always_check = false;
+
+  // Why and where execution stopped. While reason is not none
+  // emulateCycle does nothing.
+  stop_reason reason = none;
+  std::uint16_t address = 0;
+  // Execute the instruction at pc even if it has a breakpoint.
+  bool step_over = false;
+  // Stop again after the next instruction.
+  bool single_step = false;
+
+  static bool test(const std::uint8_t* bits, unsigned addr) noexcept {
+    return (bits[(addr >> 3) & 511] >> (addr & 7)) & 1;
+  }
+  static void set(std::uint8_t* bits, unsigned addr, bool on) noexcept {
+    if (on) {
+      bits[(addr >> 3) & 511] |= 1 << (addr & 7);
+    } else {
+      bits[(addr >> 3) & 511] &= ~(1 << (addr & 7));
+    }
+  }
+
+  void on_access(const std::uint8_t* bits, stop_reason why,
+                 unsigned addr, unsigned n) noexcept {
+    for (unsigned i = 0; i < n; i++) {
+      if (reason == none && test(bits, addr + i)) {
+        reason = why;
+        address = addr + i;
+      }
+    }
+  }
+
+  void resume() noexcept {
+    reason = none;
+    step_over = true;
+    single_step = false;
+  }
+};
+
+// Input policies tell execute which keys are down. They are template
+// parameters, so key opcodes compile to a plain bit test or to nothing
+// instead of a call through KeyInterface.
+//
+//   key_down(key)  key is held, for EX9E and EXA1; key may be above 15
+//   wait_key()     the key FX0A stores, or -1 to run FX0A again
+//   stable         answers do not change during one run_cycles call and
+//                  asking has no side effects, which lets run_cycles skip
+//                  loops that wait for a key
+template <typename T>
+concept input_policy = requires(T& input, std::uint8_t key) {
+  { input.key_down(key) } -> std::convertible_to<bool>;
+  { input.wait_key() } -> std::convertible_to<int>;
+  { T::stable } -> std::convertible_to<bool>;
+};
+
+// The keys bitmap of an emulator, see emulator::key_event.
+struct bitmap_input {
+  static constexpr bool stable = true;
+  const std::uint16_t* keys;
+
+  bool key_down(std::uint8_t key) const noexcept {
+    return key < 16 && ((*keys >> key) & 1);
+  }
+  int wait_key() const noexcept {
+    return *keys != 0 ? __builtin_ctz(*keys) : -1;
+  }
+};
+
+// No key is ever pressed.
+struct null_input {
+  static constexpr bool stable = true;
+
+  bool key_down(std::uint8_t) const noexcept { return false; }
+  int wait_key() const noexcept { return -1; }
+};
+
+// One bitmap of held keys per frame, e.g. a prepared input sequence for
+// batch runs. The caller moves on with next_frame() after every frame;
+// past the end no key is down.
+struct replay_input {
+  static constexpr bool stable = true;
+  const std::uint16_t* frames;
+  std::size_t count;
+  std::size_t frame = 0;
+
+  std::uint16_t held() const noexcept {
+    return frame < count ? frames[frame] : 0;
+  }
+  bool key_down(std::uint8_t key) const noexcept {
+    return key < 16 && ((held() >> key) & 1);
+  }
+  int wait_key() const noexcept {
+    return held() != 0 ? __builtin_ctz(held()) : -1;
+  }
+  void next_frame() noexcept { frame++; }
+};
+
+// Adapter for a virtual KeyInterface.
+struct interface_input {
+  static constexpr bool stable = false;
+  KeyInterface* source;
+
+  bool key_down(std::uint8_t key) noexcept {
+    return key == source->getKey(100);
+  }
+  int wait_key() noexcept { return source->getKey(-1); }
+};
+
+// What the emulator uses unless told otherwise: the key interface if one
+// is set, the keys bitmap otherwise.
+struct dynamic_input {
+  static constexpr bool stable = false;
+  KeyInterface* source;
+  const std::uint16_t* keys;
+
+  bool key_down(std::uint8_t key) noexcept {
+    if (source != nullptr) return key == source->getKey(100);
+    return key < 16 && ((*keys >> key) & 1);
+  }
+  int wait_key() noexcept {
+    if (source != nullptr) return source->getKey(-1);
+    return *keys != 0 ? __builtin_ctz(*keys) : -1;
+  }
+};
+
+// Parts of an emulator only the host side uses: the key interface it
+// owns and the wall clock timepoints of emulateCycle. Allocated on first
+// use, so emulators driven by run_frame and key_event never have one.
+struct host_state {
+  std::unique_ptr<KeyInterface> keyinterface;
+  // Save timepoint of last decrease of delay timer
+  std::chrono::time_point<std::chrono::system_clock> last_delay;
+  // Save timepoint of last decrease of sound timer
+  std::chrono::time_point<std::chrono::system_clock> last_sound;
+};
+
 struct emulator {
 
   void set_keyinterface(std::unique_ptr<KeyInterface> arg) {
-    keyinterface = std::move(arg);
+    keyinterface = arg.get();
+    host_side().keyinterface = std::move(arg);
   };
 
+  host_state& host_side() {
+    if (!host) host = std::make_unique<host_state>();
+    return *host;
+  };
+
+  // Event based input, used when no key interface is set: the host
+  // reports presses and releases, EX9E/EXA1 test the key state and FX0A
+  // waits until a key is down.
+  void key_event(std::uint8_t key, bool down) noexcept {
+    if (down) {
+      keys |= 1u << (key & 0xF);
+    } else {
+      keys &= ~(1u << (key & 0xF));
+    }
+  };
+
+  // Makes CXNN deterministic: with a non-zero seed random numbers come
+  // from a xorshift generator instead of the wall clock.
+  void seed(std::uint32_t value) noexcept { random_state = value; };
+
   constexpr void initialize() noexcept {
     for (auto& x : memory) x = 0;
     for (auto& x : V)      x = 0;
@@ -207,30 +526,341 @@ struct emulator {
     for (int i = 0; i < 80; i++) {
       memory[i] = fontset[i];
     }
+    dirty_pages = 0;
+    dirty_rows  = 0;
+    keys        = 0;
+    gfx_hash    = 0;
+  };
+
+  // Recomputes gfx_hash after the screen was written from outside
+  // execute, e.g. by restoring a save state.
+  void rehash_screen() noexcept { gfx_hash = hash_screen(gfx); };
+
+  // Same result as initialize(), but only restores the memory pages and
+  // screen rows written since the last reset. Memory written by the host
+  // must have gone through load() or mark_dirty() for this to hold;
+  // otherwise use initialize().
+  void reset() noexcept {
+    for (std::uint32_t d = dirty_pages; d != 0; d &= d - 1) {
+      std::size_t p = __builtin_ctz(d);
+      std::size_t from = p * page_size;
+      std::size_t n = from + page_size > memory_size ? memory_size - from
+                                                     : page_size;
+      std::memcpy(&memory[from], &initial_memory.bytes[from], n);
+    }
+    for (std::uint32_t d = dirty_rows; d != 0; d &= d - 1) {
+      std::memset(gfx[__builtin_ctz(d)], 0, sizeof(gfx[0]));
+    }
+    std::memset(V, 0, sizeof(V));
+    std::memset(stack, 0, sizeof(stack));
+    pc          = 0x200;
+    sp          = 0;
+    I           = 0;
+    delay_timer = 0;
+    sound_timer = 0;
+    opcode      = 0;
+    dirty_pages = 0;
+    dirty_rows  = 0;
+    keys        = 0;
+    gfx_hash    = 0;
+  };
+
+  // Copies size bytes to memory[at] and records the pages for reset().
+  void load(const std::uint8_t* data, std::size_t size,
+            std::uint16_t at = 0x200) noexcept {
+    if (at >= memory_size) return;
+    if (size > memory_size - at) size = memory_size - at;
+    std::memcpy(&memory[at], data, size);
+    mark_dirty(at, size);
+  };
+
+  // Records that memory[addr, addr+n) no longer matches initial_memory.
+  void mark_dirty(std::size_t addr, std::size_t n) noexcept {
+    if (n == 0) return;
+    std::size_t last = addr + n - 1;
+    for (std::size_t p = addr / page_size; p <= last / page_size; p++) {
+      dirty_pages |= 1u << (p & 31);
+    }
+  };
+
+  // Copies the machine state of other: memory, registers, stack, timers
+  // and screen. The key interface, debug hooks and timer timepoints stay
+  // as they are, which makes this a cheap reset from a prepared image.
+  void copy_state(const emulator& other) noexcept {
+    std::memcpy(memory, other.memory, sizeof(memory));
+    std::memcpy(V, other.V, sizeof(V));
+    std::memcpy(stack, other.stack, sizeof(stack));
+    std::memcpy(gfx, other.gfx, sizeof(gfx));
+    gfx_hash    = other.gfx_hash;
+    dirty_pages = other.dirty_pages;
+    dirty_rows  = other.dirty_rows;
+    opcode      = other.opcode;
+    pc          = other.pc;
+    sp          = other.sp;
+    I           = other.I;
+    delay_timer = other.delay_timer;
+    sound_timer = other.sound_timer;
+    keys        = other.keys;
+    random_state = other.random_state;
   };
 
   void emulateCycle(bool test = false) noexcept {
-    opcode = memory[pc];
-    opcode = opcode << 8;
-    opcode = opcode | memory[pc+1];
+    if (debug != nullptr) {
+      debugCycle(test);
+      return;
+    }
+
+    opcode = fetch();
 
     //std::cout << opcode << std::endl;
 
+    execute(opcode, test);
+    cycles++;
+    update_timer();
+  };
+
+  // Runs n instructions in a tight loop, without the wall clock timer
+  // updates of emulateCycle, and reports what happened. Stops early only
+  // if the attached debugger stops. Keys come from the key interface if
+  // one is set and from keys otherwise.
+  //
+  // Timers and keys do not change during the call, so a loop that waits
+  // for one of them (see idle_period) repeats until n is used up. Whole
+  // rounds of such a loop are skipped and counted as executed, which
+  // gives the same state and cycle count as running them.
+  run_events run_cycles(std::uint64_t n, bool test = false) noexcept {
+    if (keyinterface != nullptr) {
+      interface_input input{keyinterface};
+      return run_cycles(n, input, test);
+    }
+    bitmap_input input{&keys};
+    return run_cycles(n, input, test);
+  };
+
+  // run_cycles with keys from the given input policy.
+  template <input_policy Input>
+  run_events run_cycles(std::uint64_t n, Input& input,
+                        bool test = false) noexcept {
+    run_events ev;
+    events = 0;
+    if (debug == nullptr) {
+      for (std::uint64_t i = 0; i < n; i++) {
+        opcode = fetch();
+        if ((opcode & 0xF000) == 0x1000 || (opcode & 0xF0FF) == 0xF00A) {
+          std::uint64_t period = idle_period(opcode, input);
+          // At least one instruction is left to run normally so opcode
+          // ends up as if nothing was skipped.
+          std::uint64_t skip = period ? (n - i - 1) / period * period : 0;
+          if (skip != 0) {
+            i += skip - 1;
+            ev.idle_cycles += skip;
+            ev.waiting_for_input = input_wait;
+            if ((opcode & 0xF0FF) == 0xF00A) events |= event_key_wait;
+            continue;
+          }
+        }
+        execute(opcode, input, test);
+      }
+      ev.cycles = n;
+    } else {
+      while (ev.cycles < n && debugStep(input, test)) ev.cycles++;
+      ev.breakpoint = debug->reason != debug_hooks::none;
+    }
+    cycles += ev.cycles;
+    ev.screen_changed = events & event_screen;
+    ev.sound_started  = events & event_sound_start;
+    ev.sound_stopped  = events & event_sound_stop;
+    ev.key_wait       = events & event_key_wait;
+    return ev;
+  };
+
+  // Runs one 60 Hz frame: cycles_per_frame instructions followed by one
+  // tick of the delay and sound timers. Timing depends only on the number
+  // of frames run, not on the wall clock.
+  run_events run_frame(bool test = false) noexcept {
+    run_events ev = run_cycles(cycles_per_frame, test);
+    return end_frame(ev);
+  };
+
+  template <input_policy Input>
+  run_events run_frame(Input& input, bool test = false) noexcept {
+    run_events ev = run_cycles(cycles_per_frame, input, test);
+    return end_frame(ev);
+  };
+
+  run_events end_frame(run_events ev) noexcept {
+    if (ev.breakpoint) return ev;
+    events = 0;
+    tick_timers();
+    ev.sound_stopped |= (events & event_sound_stop) != 0;
+    return ev;
+  };
+
+  // Decrements both timers once, as happens 60 times a second.
+  void tick_timers() noexcept {
+    if (delay_timer != 0) delay_timer--;
+    if (sound_timer != 0) {
+      sound_timer--;
+      if (sound_timer == 0) events |= event_sound_stop;
+    }
+  };
+
+  // Masks pc to the address space and returns the instruction there.
+  std::uint16_t fetch() noexcept {
+    pc &= 0x0FFF;
+    return (memory[pc] << 8) | memory[pc+1];
+  };
+
+  // Length of the loop starting with the instruction at pc if every round
+  // of it leaves the machine as it is until a timer tick or key event,
+  // 0 otherwise. Recognized are jumps to themselves, FX0A with no key
+  // down and jumps back to
+  //
+  //   FX07; 3XNN      V[X] == delay_timer != NN
+  //   EX9E            key V[X] up
+  //   EXA1            key V[X] down
+  //
+  // Sets input_wait if a key event ends the loop. Loops waiting for keys
+  // are only recognized with a stable input policy.
+  template <input_policy Input>
+  unsigned idle_period(std::uint16_t op, Input& input) noexcept {
+    input_wait = false;
+    if ((op & 0xF0FF) == 0xF00A) {
+      input_wait = true;
+      return Input::stable && input.wait_key() < 0 ? 1 : 0;
+    }
+    const std::uint16_t target = op & 0x0FFF;
+    if (target == pc) return 1;
+    if (target + 4 == pc) {
+      std::uint16_t a = (memory[target] << 8) | memory[target+1];
+      std::uint16_t b = (memory[target+2] << 8) | memory[target+3];
+      std::uint8_t x = (a & 0x0F00) >> 8;
+      if ((a & 0xF0FF) == 0xF007 && (b & 0xFF00) == (0x3000 | (x << 8)) &&
+          V[x] == delay_timer && delay_timer != (b & 0x00FF)) {
+        return 3;
+      }
+    }
+    if (target + 2 == pc && Input::stable) {
+      std::uint16_t a = (memory[target] << 8) | memory[target+1];
+      bool down = input.key_down(V[(a & 0x0F00) >> 8]);
+      input_wait = true;
+      if ((a & 0xF0FF) == 0xE09E && !down) return 2;
+      if ((a & 0xF0FF) == 0xE0A1 && down) return 2;
+    }
+    return 0;
+  };
+
+  // Key state for EX9E and EXA1, from the key interface if one is set.
+  bool key_down(std::uint8_t key) noexcept {
+    return dynamic_input{keyinterface, &keys}.key_down(key);
+  };
+
+  // emulateCycle with breakpoints, watchpoints and conditions from debug
+  // applied. Breakpoints and conditions stop before the instruction,
+  // watchpoints after it.
+  void debugCycle(bool test = false) noexcept {
+    if (debugStep(test)) {
+      cycles++;
+      update_timer();
+    }
+  };
+
+  // One instruction of debugCycle without the timer update. Returns false
+  // if nothing was executed because the debugger stopped.
+  bool debugStep(bool test = false) noexcept {
+    dynamic_input input{keyinterface, &keys};
+    return debugStep(input, test);
+  };
+
+  // debugStep with the keys from an input policy.
+  template <input_policy Input>
+  bool debugStep(Input& input, bool test = false) noexcept {
+    if (debug->reason != debug_hooks::none) return false;
+    if (!debug->step_over) {
+      bool at_breakpoint = debug_hooks::test(debug->exec_bits, pc);
+      if (at_breakpoint || debug->always_check) {
+        debug->reason = debug->check != nullptr
+                          ? debug->check(*debug, *this, at_breakpoint)
+                          : debug_hooks::breakpoint;
+        if (debug->reason != debug_hooks::none) {
+          debug->address = pc;
+          return false;
+        }
+      }
+    }
+    debug->step_over = false;
+
+    std::uint8_t old_V[16];
+    for (int i = 0; i < 16; i++) old_V[i] = V[i];
+    std::uint16_t old_I = I;
+
+    opcode = fetch();
+    execute<true>(opcode, input, test);
+
+    if (debug->register_mask != 0 && debug->reason == debug_hooks::none) {
+      for (int i = 0; i < 16; i++) {
+        if (((debug->register_mask >> i) & 1) && old_V[i] != V[i]) {
+          debug->reason = debug_hooks::register_watch;
+          debug->address = i;
+          break;
+        }
+      }
+      if (((debug->register_mask >> 16) & 1) && old_I != I &&
+          debug->reason == debug_hooks::none) {
+        debug->reason = debug_hooks::register_watch;
+        debug->address = 16;
+      }
+    }
+    if (debug->single_step && debug->reason == debug_hooks::none) {
+      debug->reason = debug_hooks::stepped;
+      debug->address = pc;
+    }
+    return true;
+  };
+
+  // Executes one already fetched instruction and advances pc. Called
+  // with a constant opcode the decode chain folds away, which is what
+  // the code generated by chip8aot relies on. Debug adds the watchpoint
+  // checks on memory accesses.
+  template <bool Debug = false>
+  CHIP8_ALWAYS_INLINE
+  void execute(const std::uint16_t opcode, bool test = false) noexcept {
+    dynamic_input input{keyinterface, &keys};
+    execute<Debug>(opcode, input, test);
+  };
+
+  // execute with the keys from an input policy.
+  template <bool Debug = false, input_policy Input>
+  CHIP8_ALWAYS_INLINE
+  void execute(const std::uint16_t opcode, Input& input,
+               bool test = false) noexcept {
+    // I masked to the address space. Memory instructions do not change I,
+    // so this stays valid for the whole instruction.
+    const std::uint16_t addr = I & 0x0FFF;
+
     // DXYN: Draw starting at mem location I, at (Vx, Vy) on
     // screen. Sprites are XORed, if collision with pixel, set
     // VF=1
 
     if ((opcode & 0xF000) == 0xD000) {
+      if constexpr (Debug) {
+        debug->on_access(debug->read_bits, debug_hooks::read_watch,
+                         addr, opcode & 0x000F);
+      }
+      events |= event_screen;
       V[0xF] = 0;
       for (int i = 0; i < (opcode & 0x000F); i++) {
+        dirty_rows |= 1u << ((V[(opcode & 0x00F0) >> 4]+i)%32);
         for (int j = 0; j < 8; j++) {
-          if( ((memory[I+i] >> (7-j)) & 1) == 1 ) {
+          if( ((memory[addr+i] >> (7-j)) & 1) == 1 ) {
+          gfx_hash ^= screen_keys.keys[(V[(opcode & 0x00F0) >> 4]+i)%32]
+                                      [(V[(opcode & 0x0F00) >> 8]+j)%64];
           int t = gfx[(V[(opcode & 0x00F0) >> 4]+i)%32]
                      [(V[(opcode & 0x0F00) >> 8]+j)%64];
 
           gfx[(V[(opcode & 0x00F0) >> 4]+i)%32]
              [(V[(opcode & 0x0F00) >> 8]+j)%64]
-          = (((memory[I+i] >> (7-j)) & 1) != t) ? 1 : 0;
+          = (((memory[addr+i] >> (7-j)) & 1) != t) ? 1 : 0;
 
           if ( t != gfx[(V[(opcode & 0x00F0) >> 4]+i)%32]
                        [(V[(opcode & 0x0F00) >> 8]+j)%64]
@@ -244,29 +874,38 @@ struct emulator {
     
     // EX9E: Skips next instruction if key stored in VX is pressed
     if ((opcode & 0xF0FF) == 0xE09E) {
-      if( V[(opcode & 0x0F00) >> 8] == keyinterface.get()->getKey(100) ) {
+      if( input.key_down(V[(opcode & 0x0F00) >> 8]) ) {
         pc += 2;
       }
     }
     
     // EXA1: Skips next instruction if key stored in VX is pressed
     if ((opcode & 0xF0FF) == 0xE0A1) {
-      if( V[(opcode & 0x0F00) >> 8] != keyinterface.get()->getKey(100) ) {
+      if( !input.key_down(V[(opcode & 0x0F00) >> 8]) ) {
         pc += 2;
       }
     }
 
     // FX55: Store V0 to VX in memory, starting at I.
     if ((opcode & 0xF0FF) == 0xF055) {
+      if constexpr (Debug) {
+        debug->on_access(debug->write_bits, debug_hooks::write_watch,
+                         addr, ((opcode & 0x0F00) >> 8) + 1);
+      }
       for (int i = 0; i <= ( (opcode & 0x0F00) >> 8); i++) {
-        memory[I+i] = V[i];
+        memory[addr+i] = V[i];
       }
+      mark_dirty(addr, ((opcode & 0x0F00) >> 8) + 1);
     }
 
     // FX65: Fill V0 to VX with values starting at I.
     if ((opcode & 0xF0FF) == 0xF065) {
+      if constexpr (Debug) {
+        debug->on_access(debug->read_bits, debug_hooks::read_watch,
+                         addr, ((opcode & 0x0F00) >> 8) + 1);
+      }
       for (int i = 0; i <= ((opcode & 0x0F00) >> 8); i++) {
-        V[i] = memory[I+i];
+        V[i] = memory[addr+i];
       }
     }
 
@@ -298,6 +937,11 @@ struct emulator {
 
       if (test == true) {
         t = 0x55;
+      } else if (random_state != 0) {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 17;
+        random_state ^= random_state << 5;
+        t = random_state >> 24;
       } else {
         unsigned int r = time(NULL);
         t = rand_r(&r) % 255;
@@ -327,7 +971,7 @@ struct emulator {
     //       current pc on the top of the stack.
     //       the pc is then set to nnn.
     if ((opcode & 0xF000) == 0x2000) {
-      sp++;
+      sp = (sp + 1) & 0xF;
       stack[sp] = pc;
       pc = (opcode & 0x0FFF);
       pc -= 2;
@@ -338,8 +982,8 @@ struct emulator {
     //       of the stack, then substracts 1 
     //       from the stack pointer
     if ((opcode & 0xFFFF) == 0x00EE) {
-      pc = stack[sp];
-      sp--;
+      pc = stack[sp & 0xF];
+      sp = (sp - 1) & 0xF;
     }
 
     // 3XNN: Skip next instruction if V[X] == NN
@@ -398,17 +1042,22 @@ struct emulator {
     if ((opcode & 0xF00F) == 0x8004) {
       // set carry
       if (V[(opcode & 0x00F0) >> 4] > (0xFF-V[(opcode & 0x0F00) >> 8])) {
-        V[16] = 1;
+        V[0xF] = 1;
       } else {
-        V[16] = 0;
+        V[0xF] = 0;
       }
       V[(opcode & 0x0F00) >> 8] += V[(opcode & 0x00F0) >> 4 ];
     }
     
     // FX0A: A key press is awaited, then stored in VX (Blocking)
     if ((opcode & 0xF0FF) == 0xF00A) {
-      if( keyinterface.get() ) {
-        V[(opcode & 0x0F00) >> 8] = keyinterface.get()->getKey(-1);
+      events |= event_key_wait;
+      int key = input.wait_key();
+      if (key >= 0) {
+        V[(opcode & 0x0F00) >> 8] = key;
+      } else {
+        // no key down, run FX0A again
+        pc -= 2;
       }
     }
 
@@ -426,10 +1075,10 @@ struct emulator {
     // 8XY7: Vx = Vy-Vx
     if ((opcode & 0xF00F) == 0x8007) {
       // set borrow (inverse logic to carry!!)
-      if (V[(opcode & 0x0FF0) >> 8 ] > (V[(opcode & 0x00F0) >> 4])) {
-        V[16] = 0;
+      if (V[(opcode & 0x0F00) >> 8 ] > (V[(opcode & 0x00F0) >> 4])) {
+        V[0xF] = 0;
       } else {
-        V[16] = 1;
+        V[0xF] = 1;
       }
       V[(opcode & 0x0F00) >> 8] = V[(opcode & 0x00F0) >> 4 ]
                                   - V[(opcode & 0x0F00) >> 8];
@@ -448,6 +1097,11 @@ struct emulator {
 
     // FX18 set sound timer to Vx
     if ((opcode & 0xF0FF) == 0xF018) {
+       if (sound_timer == 0 && V[(opcode & 0x0F00) >> 8] != 0) {
+         events |= event_sound_start;
+       } else if (sound_timer != 0 && V[(opcode & 0x0F00) >> 8] == 0) {
+         events |= event_sound_stop;
+       }
        sound_timer = V[(opcode & 0x0F00)  >> 8 ];
     }
 
@@ -458,9 +1112,14 @@ struct emulator {
 
     // FX33: Store BCD representation of Vx in memory loc I,I+1,I+2
     if ((opcode & 0xF0FF) == 0xF033) {
-      memory[I]   = V[(opcode & 0x0F00) >> 8] / 100; 
-      memory[I+1] = (V[(opcode & 0x0F00) >> 8] - memory[I]*100)/10;
-      memory[I+2] = V[(opcode & 0x0F00) >> 8] - memory[I]*100 - memory[I+1]*10;
+      if constexpr (Debug) {
+        debug->on_access(debug->write_bits, debug_hooks::write_watch, addr, 3);
+      }
+      memory[addr]   = V[(opcode & 0x0F00) >> 8] / 100;
+      memory[addr+1] = (V[(opcode & 0x0F00) >> 8] - memory[addr]*100)/10;
+      memory[addr+2] = V[(opcode & 0x0F00) >> 8] - memory[addr]*100
+                       - memory[addr+1]*10;
+      mark_dirty(addr, 3);
     }
 
     // 00E0: Clear screen
@@ -470,12 +1129,19 @@ struct emulator {
            gfx[i][j] = 0x00;
          }
        }
+       dirty_rows = 0;
+       gfx_hash = 0;
+       events |= event_screen;
     }
     pc += 2;
-    update_timer();
   };
 
   void update_timer() {
+    if (delay_timer == 0 && sound_timer == 0) return;
+    std::chrono::time_point<std::chrono::system_clock>& last_delay =
+      host_side().last_delay;
+    std::chrono::time_point<std::chrono::system_clock>& last_sound =
+      host_side().last_sound;
     std::chrono::system_clock::time_point now = 
                                           std::chrono::system_clock::now();
     if(delay_timer != 0) {
@@ -496,32 +1162,79 @@ struct emulator {
     }
   };
 
-  // opcode
-  std::uint16_t opcode;
-  // Chip8 has 4k of memory
-  std::uint8_t memory[4069];
+  // The layout is meant for many instances per core: the registers every
+  // instruction touches share the first cache line, memory and screen
+  // follow on lines of their own with the screen hash behind them and
+  // state only the host side needs sits behind host. See the
+  // static_asserts below the struct.
+
   // Chip8 has 15 8bit genereal purpose CPU registers. The 16th register
   // holds the carry flag.
-  std::uint8_t V[16];
+  alignas(64) std::uint8_t V[16];
+  std::uint16_t stack[16];
+  // opcode
+  std::uint16_t opcode;
   // Chip8 has a program counter
   std::uint16_t pc;
-  // Chip8 has a stack pointer
-  std::uint8_t sp;
-  std::uint16_t stack[16];
   // Chip8 has a index register
   std::uint16_t I;
+  // Chip8 has a stack pointer
+  std::uint8_t sp;
   // Timer registers
   std::uint8_t delay_timer;
   std::uint8_t sound_timer;
+  // event_* bits collected by execute for run_cycles
+  enum : std::uint8_t {
+    event_screen      = 1,
+    event_sound_start = 2,
+    event_sound_stop  = 4,
+    event_key_wait    = 8
+  };
+  std::uint8_t events = 0;
+  // Keys held down, one bit per key, see key_event
+  std::uint16_t keys = 0;
+  // xorshift state for CXNN, 0 for wall clock based numbers
+  std::uint32_t random_state = 0;
+
+  // Chip8 has 4k of memory
+  alignas(64) std::uint8_t memory[memory_size];
+
+  // Bookkeeping, filling the line the memory guard band ends in.
+  // Instructions executed since construction
+  std::uint64_t cycles = 0;
+  // Breakpoints and watchpoints, nullptr when not debugging
+  debug_hooks* debug = nullptr;
+  // Key source for EX9E, EXA1 and FX0A, owned by host; nullptr for event
+  // based input
+  KeyInterface* keyinterface = nullptr;
+  std::unique_ptr<host_state> host;
+  // Memory pages and screen rows written since the last reset, one bit
+  // each
+  std::uint32_t dirty_pages = 0;
+  std::uint32_t dirty_rows = 0;
+  // Instructions per 60 Hz frame for run_frame
+  unsigned cycles_per_frame = 10;
+  // Set by idle_period for loops waiting for a key
+  bool input_wait = false;
+
   // Chip8 has a grafic screen of black and white pixel
-  std::uint8_t gfx[32][64];
-  std::unique_ptr<KeyInterface> keyinterface;
-  // Save timepoint of last decrease of delay timer
-  std::chrono::time_point<std::chrono::system_clock> last_delay;
-  // Save timepoint of last decrease of sound timer
-  std::chrono::time_point<std::chrono::system_clock> last_sound;
+  alignas(64) std::uint8_t gfx[32][64];
+  // hash_screen(gfx), kept up to date by DXYN and 00E0 so comparing
+  // screens costs one compare
+  std::uint64_t gfx_hash = 0;
 };
 
+static_assert(alignof(emulator) == 64, "emulators start on a cache line");
+static_assert(offsetof(emulator, random_state) + sizeof(std::uint32_t) <= 64,
+              "the registers fit into the first cache line");
+static_assert(offsetof(emulator, memory) == 64 &&
+              offsetof(emulator, gfx) % 64 == 0,
+              "memory and screen start on cache lines of their own");
+static_assert(offsetof(emulator, gfx) == 64 + memory_size + 48,
+              "the bookkeeping fits between memory and screen");
+static_assert(sizeof(emulator) == 99 * 64,
+              "an emulator takes 99 cache lines");
+
 }  // namespace chip8
 
 #endif  // CHIP8_H_
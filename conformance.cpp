@@ -0,0 +1,171 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "conformance.h"
+#include "lockstep.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8conformance [--engine NAME|all] [--threads N] [--print] catalogue...
+//
+// Runs every case of the catalogues (see chip8::parse_catalogue) headless
+// and compares the screen it ends with against the golden hash, with
+// every engine of chip8lockstep or only --engine. Cases run in parallel
+// on --threads threads (default: all cores). Cases written for quirks
+// this build does not have are skipped. The exit code is 1 if any case
+// fails.
+//
+// --print runs the reference engine only and prints the catalogue lines
+// with the hashes it got, to record golden values for new test ROMs:
+//
+//   chip8conformance --print roms/conformance.txt
+
+namespace {
+
+std::string relative(const std::string& path, const std::string& dir) {
+  return path.compare(0, dir.size(), dir) == 0 ? path.substr(dir.size()) : path;
+}
+
+struct job {
+  std::size_t test;
+  const chip8::engine* engine;
+};
+
+std::string format_case(const chip8::conformance_case& c, const std::string& dir,
+                        std::uint32_t hash) {
+  char line[64];
+  std::snprintf(line, sizeof(line), " %lu %08X", c.frames, hash);
+  std::string out = relative(c.rom, dir) + line;
+  out += " cycles=" + std::to_string(c.cycles_per_frame);
+  out += " seed=" + std::to_string(c.seed);
+  if (c.quirks != chip8::emulator_quirks) {
+    std::snprintf(line, sizeof(line), " quirks=0x%X", c.quirks);
+    out += line;
+  }
+  if (!c.replay.empty()) out += " replay=" + relative(c.replay, dir);
+  return out;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string engine_name = "all";
+  unsigned threads = std::thread::hardware_concurrency();
+  bool print = false;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--engine") == 0 && has_value) {
+      engine_name = argv[++i];
+    } else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+      threads = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--print") == 0) {
+      print = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  std::vector<const chip8::engine*> engines;
+  if (print) {
+    engines.push_back(chip8::find_engine("reference"));
+  } else if (engine_name == "all") {
+    for (const chip8::engine& e : chip8::engines) engines.push_back(&e);
+  } else if (const chip8::engine* e = chip8::find_engine(engine_name)) {
+    engines.push_back(e);
+  }
+  if (paths.empty() || engines.empty()) {
+    std::cerr << "usage: chip8conformance [--engine NAME|all] [--threads N] "
+                 "[--print] catalogue...\n"
+                 "engines:";
+    for (const chip8::engine& e : chip8::engines) std::cerr << ' ' << e.name;
+    std::cerr << std::endl;
+    return 1;
+  }
+  if (threads == 0) threads = 1;
+
+  std::vector<chip8::conformance_case> cases;
+  // catalogue directory of each case, for --print
+  std::vector<std::string> dirs;
+  for (const std::string& path : paths) {
+    std::ifstream input(path);
+    if (!input) {
+      std::cerr << "cannot open " << path << std::endl;
+      return 1;
+    }
+    std::string text(std::istreambuf_iterator<char>(input), {});
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::string error;
+    if (!chip8::parse_catalogue(text, dir, cases, error)) {
+      std::cerr << path << ": " << error << std::endl;
+      return 1;
+    }
+    dirs.resize(cases.size(), dir);
+  }
+
+  std::vector<job> jobs;
+  for (std::size_t c = 0; c < cases.size(); c++) {
+    for (const chip8::engine* e : engines) jobs.push_back({c, e});
+  }
+  std::vector<std::uint32_t> hashes(jobs.size());
+  std::vector<std::string> errors(jobs.size());
+  std::vector<char> skipped(jobs.size());
+
+  std::atomic<std::size_t> next{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+      auto emu = std::make_unique<chip8::emulator>();
+      std::size_t i;
+      while ((i = next++) < jobs.size()) {
+        const chip8::conformance_case& c = cases[jobs[i].test];
+        if (c.quirks != chip8::emulator_quirks) {
+          skipped[i] = true;
+          continue;
+        }
+        std::string error;
+        if (!chip8::run_case(c, *jobs[i].engine, *emu, hashes[i], error)) {
+          errors[i] = error.empty() ? "failed" : error;
+        }
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+  std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+
+  unsigned passed = 0, failed = 0, skips = 0;
+  for (std::size_t i = 0; i < jobs.size(); i++) {
+    const chip8::conformance_case& c = cases[jobs[i].test];
+    if (skipped[i]) {
+      skips++;
+    } else if (!errors[i].empty()) {
+      failed++;
+      std::printf("%s:%d: %s\n", c.rom.c_str(), c.line, errors[i].c_str());
+    } else if (print) {
+      std::printf("%s\n", format_case(c, dirs[jobs[i].test], hashes[i]).c_str());
+    } else if (hashes[i] != c.expected) {
+      failed++;
+      std::printf("%s:%d: %s after %lu frames: screen %08X, expected %08X\n",
+                  c.rom.c_str(), c.line, jobs[i].engine->name, c.frames,
+                  hashes[i], c.expected);
+    } else {
+      passed++;
+    }
+  }
+  std::fprintf(stderr, "%zu cases x %zu engines: %u passed, %u failed, "
+               "%u skipped in %.2f s\n", cases.size(), engines.size(),
+               passed, failed, skips, t.count());
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "lockstep.h"
+#include "movie.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef CONFORMANCE_H_
+#define CONFORMANCE_H_
+
+namespace chip8 {
+
+// FNV-1a of the screen, one byte per pixel.
+inline std::uint32_t screen_hash(const emulator& emu) noexcept {
+  return hash_rom(&emu.gfx[0][0], sizeof(emu.gfx));
+}
+
+// One line of a conformance catalogue: a ROM run headless for a number of
+// frames and the screen_hash it has to end with.
+struct conformance_case {
+  std::string rom;
+  unsigned long frames = 0;
+  std::uint32_t expected = 0;
+  unsigned cycles_per_frame = 10;
+  std::uint32_t seed = 1;
+  // quirk flags the ROM is written for, skipped by other builds
+  std::uint32_t quirks = emulator_quirks;
+  // movie with the keys to press, empty for none
+  std::string replay;
+  // where in the catalogue the case is
+  int line = 0;
+};
+
+// Reads a catalogue. Each line is
+//
+//   ROM FRAMES HASH [cycles=N] [seed=S] [quirks=MASK] [replay=MOVIE]
+//
+// with relative paths taken from dir; '#' starts a comment.
+inline bool parse_catalogue(const std::string& text, const std::string& dir,
+                            std::vector<conformance_case>& cases,
+                            std::string& error) {
+  std::istringstream lines(text);
+  std::string line;
+  for (int number = 1; std::getline(lines, line); number++) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    conformance_case c;
+    std::string hash;
+    if (!(words >> c.rom)) continue;
+    c.line = number;
+    std::string frames;
+    if (!(words >> frames >> hash)) {
+      error = "line " + std::to_string(number) + ": expected ROM FRAMES HASH";
+      return false;
+    }
+    c.frames = std::strtoul(frames.c_str(), nullptr, 0);
+    c.expected = std::strtoul(hash.c_str(), nullptr, 16);
+    std::string option;
+    while (words >> option) {
+      std::size_t eq = option.find('=');
+      std::string key = option.substr(0, eq);
+      std::string value = eq == std::string::npos ? "" : option.substr(eq + 1);
+      if (key == "cycles") {
+        c.cycles_per_frame = std::strtoul(value.c_str(), nullptr, 0);
+      } else if (key == "seed") {
+        c.seed = std::strtoul(value.c_str(), nullptr, 0);
+      } else if (key == "quirks") {
+        c.quirks = std::strtoul(value.c_str(), nullptr, 0);
+      } else if (key == "replay") {
+        c.replay = value[0] == '/' ? value : dir + value;
+      } else {
+        error = "line " + std::to_string(number) + ": unknown option " + option;
+        return false;
+      }
+    }
+    if (c.rom[0] != '/') c.rom = dir + c.rom;
+    cases.push_back(c);
+  }
+  return true;
+}
+
+// Runs a case with engine from boot and returns the screen_hash it ends
+// with. Frames are cycles_per_frame instructions and a timer tick, like
+// emulator::run_frame; key events of the movie are applied before the
+// instruction they were recorded at.
+inline bool run_case(const conformance_case& c, const engine& e,
+                     emulator& emu, std::uint32_t& hash, std::string& error) {
+  std::ifstream input(c.rom, std::ios::binary);
+  if (!input) {
+    error = "cannot open " + c.rom;
+    return false;
+  }
+  std::vector<std::uint8_t> rom(std::istreambuf_iterator<char>(input), {});
+  movie m;
+  if (!c.replay.empty() && !m.load(c.replay, error)) {
+    error = c.replay + ": " + error;
+    return false;
+  }
+  emu.initialize();
+  emu.load(rom.data(), rom.size());
+  emu.cycles = 0;
+  emu.cycles_per_frame = c.cycles_per_frame;
+  emu.seed(c.seed);
+  if (!c.replay.empty()) {
+    if (hash_rom(rom.data(), rom.size()) != m.rom_hash) {
+      error = c.replay + " was recorded with a different ROM";
+      return false;
+    }
+    emu.seed(m.seed);
+    emu.cycles_per_frame = m.cycles_per_frame;
+  }
+  std::size_t next = 0;
+  for (unsigned long f = 0; f < c.frames; f++) {
+    const std::uint64_t end = emu.cycles + emu.cycles_per_frame;
+    while (true) {
+      while (next < m.events.size() && m.events[next].cycle <= emu.cycles) {
+        emu.key_event(m.events[next].key, m.events[next].down);
+        next++;
+      }
+      if (emu.cycles >= end) break;
+      std::uint64_t n = end - emu.cycles;
+      if (next < m.events.size() && m.events[next].cycle - emu.cycles < n) {
+        n = m.events[next].cycle - emu.cycles;
+      }
+      e.run(emu, n);
+    }
+    emu.tick_timers();
+  }
+  hash = screen_hash(emu);
+  return true;
+}
+
+}  // namespace chip8
+
+#endif  // CONFORMANCE_H_
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include "chip8.h"
+#include "coroutines.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8coroutines [rom] [--sessions N] [--frames F] [--presses P]
+//
+// Benchmarks sessions per core: runs N sessions (default 10000) of a ROM
+// on one thread for F frames (default 600) with chip8::coroutine_scheduler,
+// pressing a key in P random sessions per frame (default 10) and releasing
+// it the frame after. The same is then run with run_frame on every
+// emulator for comparison. Without a ROM a program that waits for a key
+// with FX0A and draws it is used, like a menu most sessions sit in.
+//
+//   chip8coroutines --sessions 100000 --presses 100
+
+namespace {
+
+// V0 = wait for key, draw its digit, repeat.
+const std::uint8_t key_wait_rom[] = { 0xF0, 0x0A, 0xF0, 0x29, 0xD1, 0x15,
+                                      0x71, 0x05, 0x12, 0x00 };
+
+struct press {
+  std::size_t session;
+  std::uint8_t key;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  std::size_t sessions = 10000;
+  unsigned long frames = 600;
+  std::size_t presses = 10;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--sessions") == 0 && has_value) {
+      sessions = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--frames") == 0 && has_value) {
+      frames = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--presses") == 0 && has_value) {
+      presses = std::strtoul(argv[++i], nullptr, 0);
+    } else if (argv[i][0] == '-') {
+      std::cerr << "usage: chip8coroutines [rom] [--sessions N] [--frames F] "
+                   "[--presses P]" << std::endl;
+      return 1;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (sessions == 0) sessions = 1;
+
+  std::vector<std::uint8_t> rom(std::begin(key_wait_rom), std::end(key_wait_rom));
+  if (path != nullptr) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+      std::cerr << "cannot open " << path << std::endl;
+      return 1;
+    }
+    rom.assign(std::istreambuf_iterator<char>(input), {});
+  }
+
+  // The same key presses for both runs.
+  std::vector<std::vector<press>> script(frames);
+  std::uint32_t r = 1;
+  for (auto& f : script) {
+    for (std::size_t p = 0; p < presses; p++) {
+      r ^= r << 13;
+      r ^= r >> 17;
+      r ^= r << 5;
+      f.push_back({ r % sessions, static_cast<std::uint8_t>(r >> 28) });
+    }
+  }
+
+  chip8::coroutine_scheduler scheduler;
+  for (std::size_t s = 0; s < sessions; s++) {
+    scheduler.add(rom.data(), rom.size(), s + 1);
+  }
+  std::uint64_t waiting = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long f = 0; f < frames; f++) {
+    if (f > 0) {
+      for (const press& p : script[f - 1]) scheduler.key_event(p.session, p.key, false);
+    }
+    for (const press& p : script[f]) scheduler.key_event(p.session, p.key, true);
+    scheduler.run_frame();
+    waiting += scheduler.waiting();
+  }
+  std::chrono::duration<double> coroutines = std::chrono::steady_clock::now() - start;
+
+  std::vector<chip8::emulator> emus(sessions);
+  for (std::size_t s = 0; s < sessions; s++) {
+    emus[s].initialize();
+    emus[s].load(rom.data(), rom.size());
+    emus[s].seed(s + 1);
+  }
+  start = std::chrono::steady_clock::now();
+  for (unsigned long f = 0; f < frames; f++) {
+    if (f > 0) {
+      for (const press& p : script[f - 1]) emus[p.session].key_event(p.key, false);
+    }
+    for (const press& p : script[f]) emus[p.session].key_event(p.key, true);
+    for (chip8::emulator& emu : emus) emu.run_frame();
+  }
+  std::chrono::duration<double> plain = std::chrono::steady_clock::now() - start;
+
+  for (std::size_t s = 0; s < sessions; s++) {
+    const chip8::emulator& a = scheduler.emu(s);
+    if (a.pc != emus[s].pc || std::memcmp(a.V, emus[s].V, sizeof(a.V)) != 0 ||
+        std::memcmp(a.gfx, emus[s].gfx, sizeof(a.gfx)) != 0) {
+      std::cerr << "session " << s << " differs from run_frame" << std::endl;
+      return 1;
+    }
+  }
+
+  const double session_frames = double(sessions) * frames;
+  std::printf("%zu sessions, %lu frames, %.1f%% waiting for a key on average\n"
+              "coroutines: %.3f s, %.1f M session frames/s, %.0f sessions per "
+              "core at 60 Hz\n"
+              "run_frame:  %.3f s, %.1f M session frames/s, %.0f sessions per "
+              "core at 60 Hz\n"
+              "per session: %zu bytes emulator, %zu bytes coroutine frame\n",
+              sessions, frames, 100.0 * waiting / session_frames,
+              coroutines.count(), session_frames / coroutines.count() / 1e6,
+              session_frames / coroutines.count() / 60,
+              plain.count(), session_frames / plain.count() / 1e6,
+              session_frames / plain.count() / 60,
+              sizeof(chip8::emulator),
+              chip8::session_task::promise_type::frame_size);
+  return 0;
+}
@@ -0,0 +1,179 @@
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef COROUTINES_H_
+#define COROUTINES_H_
+
+namespace chip8 {
+
+// Coroutine running one session for a coroutine_scheduler. It starts
+// suspended and is destroyed with the task.
+class session_task {
+public:
+  struct promise_type {
+    session_task get_return_object() {
+      return session_task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    // Remembers the size of the coroutine frames, which is all a session
+    // waiting for a key costs besides its emulator.
+    static void* operator new(std::size_t size) {
+      frame_size = size;
+      return ::operator new(size);
+    }
+    static void operator delete(void* p) noexcept { ::operator delete(p); }
+
+    static inline std::size_t frame_size = 0;
+  };
+
+  session_task() = default;
+  explicit session_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+  session_task(session_task&& other) noexcept
+      : handle(std::exchange(other.handle, nullptr)) {}
+  session_task& operator=(session_task&& other) noexcept {
+    if (handle) handle.destroy();
+    handle = std::exchange(other.handle, nullptr);
+    return *this;
+  }
+  ~session_task() {
+    if (handle) handle.destroy();
+  }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Runs any number of sessions on the calling thread, a frame each per
+// run_frame. Every session is a coroutine that suspends at the end of
+// each frame and, when its program waits in FX0A with no key down, until
+// a key is pressed. A waiting session is not touched at all until then,
+// so it costs its emulator and coroutine frame and nothing per frame.
+//
+// Sessions take keys from key_event only. Everything they compute is
+// exactly what emulator::run_frame once per frame would: when a waiting
+// session resumes, the frames it slept through are accounted for with
+// their cycles and timer ticks, which is all FX0A with no key changes.
+class coroutine_scheduler {
+public:
+  coroutine_scheduler() = default;
+  coroutine_scheduler(const coroutine_scheduler&) = delete;
+  coroutine_scheduler& operator=(const coroutine_scheduler&) = delete;
+
+  // Adds a session booting rom and returns its id. It runs its first
+  // frame in the next run_frame.
+  std::size_t add(const std::uint8_t* rom, std::size_t size,
+                  std::uint32_t seed = 1, unsigned cycles_per_frame = 10) {
+    sessions.push_back(std::make_unique<session>());
+    session& s = *sessions.back();
+    s.emu.initialize();
+    s.emu.load(rom, size);
+    s.emu.seed(seed);
+    s.emu.cycles_per_frame = cycles_per_frame;
+    s.task = run(*this, s);
+    ready.push_back(s.task.handle);
+    return sessions.size() - 1;
+  }
+
+  // Presses or releases a key of a session between frames. A press wakes
+  // the session if it waits for one.
+  void key_event(std::size_t id, std::uint8_t key, bool down) {
+    session& s = *sessions[id];
+    s.emu.key_event(key, down);
+    if (down && s.waiting) {
+      ready.push_back(std::exchange(s.waiting, nullptr));
+      waiting_count--;
+    }
+  }
+
+  // Runs one frame of every session that is not waiting for a key.
+  void run_frame() {
+    frame++;
+    running.swap(ready);
+    ready.clear();
+    for (std::coroutine_handle<> h : running) h.resume();
+    running.clear();
+  }
+
+  const emulator& emu(std::size_t id) const { return sessions[id]->emu; }
+  std::size_t size() const { return sessions.size(); }
+  // sessions suspended in FX0A
+  std::size_t waiting() const { return waiting_count; }
+  // run_frame calls so far
+  std::uint64_t frames() const { return frame; }
+
+private:
+  struct session {
+    emulator emu;
+    session_task task;
+    // set while suspended in FX0A
+    std::coroutine_handle<> waiting;
+  };
+
+  // Suspends until the next run_frame.
+  struct frame_end {
+    coroutine_scheduler& scheduler;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      scheduler.ready.push_back(h);
+    }
+    void await_resume() const noexcept {}
+  };
+
+  // Suspends until key_event presses a key; returns the frame it resumes
+  // in.
+  struct key_press {
+    coroutine_scheduler& scheduler;
+    session& s;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      s.waiting = h;
+      scheduler.waiting_count++;
+    }
+    std::uint64_t await_resume() const noexcept { return scheduler.frame; }
+  };
+
+  // The frame ended in FX0A with no key down, so until a key event every
+  // further frame only repeats it.
+  static bool parked(emulator& emu) noexcept {
+    return emu.keys == 0 && (emu.fetch() & 0xF0FF) == 0xF00A;
+  }
+
+  static session_task run(coroutine_scheduler& scheduler, session& s) {
+    emulator& emu = s.emu;
+    while (true) {
+      emu.run_frame();
+      if (!parked(emu)) {
+        co_await frame_end{scheduler};
+        continue;
+      }
+      const std::uint64_t parked_in = scheduler.frame;
+      const std::uint64_t resumed_in = co_await key_press{scheduler, s};
+      // The frames between ran FX0A over and over.
+      const std::uint64_t slept = resumed_in - parked_in - 1;
+      emu.cycles += slept * emu.cycles_per_frame;
+      for (std::uint64_t f = 0; f < slept && f < 256; f++) emu.tick_timers();
+    }
+  }
+
+  std::vector<std::unique_ptr<session>> sessions;
+  std::vector<std::coroutine_handle<>> ready;
+  std::vector<std::coroutine_handle<>> running;
+  std::size_t waiting_count = 0;
+  std::uint64_t frame = 0;
+};
+
+}  // namespace chip8
+
+#endif  // COROUTINES_H_
@@ -0,0 +1,344 @@
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef DEBUGGER_H_
+#define DEBUGGER_H_
+
+namespace chip8 {
+
+// Condition over the machine state, e.g. "V3 == 0x10 && [I+1] > 2".
+//
+// Operands are numbers (decimal or 0x hex), the registers V0-VF, I, PC,
+// SP, DT and ST, and [expr] for the memory byte at expr. Operators in
+// order of increasing precedence are ||, &&, == !=, < <= > >=, |, ^, &,
+// + -, and the unary ! and -. The text is compiled once into postfix
+// code, so evaluating it on every instruction stays cheap.
+class expression {
+public:
+  // Returns false and describes the problem in error if text does not
+  // parse.
+  bool parse(const std::string& text, std::string& error) {
+    src = text;
+    pos = 0;
+    code.clear();
+    error.clear();
+    if (!parse_binary(0, error)) return false;
+    skip_space();
+    if (pos != src.size()) {
+      error = "unexpected '" + src.substr(pos) + "'";
+      return false;
+    }
+    int depth = 0;
+    for (const op& o : code) {
+      if (o.kind <= reg_st) {
+        depth++;
+      } else if (o.kind > logical_not) {
+        depth--;
+      }
+      if (depth > max_depth) {
+        error = "expression too deep";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int evaluate(const emulator& emu) const noexcept {
+    int stack[max_depth];
+    int sp = 0;
+    for (const op& o : code) {
+      switch (o.kind) {
+        case push:   stack[sp++] = o.value; break;
+        case reg_v:  stack[sp++] = emu.V[o.value]; break;
+        case reg_i:  stack[sp++] = emu.I; break;
+        case reg_pc: stack[sp++] = emu.pc; break;
+        case reg_sp: stack[sp++] = emu.sp; break;
+        case reg_dt: stack[sp++] = emu.delay_timer; break;
+        case reg_st: stack[sp++] = emu.sound_timer; break;
+        case load:
+          stack[sp-1] = emu.memory[stack[sp-1] & 0x0FFF];
+          break;
+        case negate: stack[sp-1] = -stack[sp-1]; break;
+        case logical_not: stack[sp-1] = !stack[sp-1]; break;
+        default: {
+          int b = stack[--sp];
+          int a = stack[sp-1];
+          stack[sp-1] = apply(o.kind, a, b);
+        }
+      }
+    }
+    return sp ? stack[0] : 0;
+  }
+
+  const std::string& text() const { return src; }
+
+private:
+  static constexpr int max_depth = 32;
+
+  enum op_kind : std::uint8_t {
+    push, reg_v, reg_i, reg_pc, reg_sp, reg_dt, reg_st, load, negate,
+    logical_not, lor, land, eq, ne, lt, le, gt, ge, bor, bxor, band, add, sub
+  };
+  struct op {
+    op_kind kind;
+    int value;
+  };
+
+  static int apply(op_kind k, int a, int b) noexcept {
+    switch (k) {
+      case lor:  return a || b;
+      case land: return a && b;
+      case eq:   return a == b;
+      case ne:   return a != b;
+      case lt:   return a < b;
+      case le:   return a <= b;
+      case gt:   return a > b;
+      case ge:   return a >= b;
+      case bor:  return a | b;
+      case bxor: return a ^ b;
+      case band: return a & b;
+      case add:  return a + b;
+      case sub:  return a - b;
+      default:   return 0;
+    }
+  }
+
+  void skip_space() {
+    while (pos < src.size() && std::isspace(static_cast<unsigned char>(src[pos])))
+      pos++;
+  }
+
+  bool accept(const char* token) {
+    skip_space();
+    std::size_t n = std::char_traits<char>::length(token);
+    if (src.compare(pos, n, token) != 0) return false;
+    // "|" and "&" must not match the first half of "||" and "&&".
+    if (n == 1 && (token[0] == '|' || token[0] == '&') &&
+        pos + 1 < src.size() && src[pos+1] == token[0]) {
+      return false;
+    }
+    pos += n;
+    return true;
+  }
+
+  // Precedence climbing over the binary operator levels below.
+  bool parse_binary(int level, std::string& error) {
+    static const struct { const char* token; op_kind k; int level; } ops[] = {
+      {"||", lor, 0}, {"&&", land, 1}, {"==", eq, 2}, {"!=", ne, 2},
+      {"<=", le, 3}, {">=", ge, 3}, {"<", lt, 3}, {">", gt, 3},
+      {"|", bor, 4}, {"^", bxor, 5}, {"&", band, 6}, {"+", add, 7},
+      {"-", sub, 7}
+    };
+    if (level == 8) return parse_unary(error);
+    if (!parse_binary(level + 1, error)) return false;
+    while (true) {
+      bool found = false;
+      for (auto& o : ops) {
+        if (o.level == level && accept(o.token)) {
+          if (!parse_binary(level + 1, error)) return false;
+          code.push_back({o.k, 0});
+          found = true;
+          break;
+        }
+      }
+      if (!found) return true;
+    }
+  }
+
+  bool parse_unary(std::string& error) {
+    if (accept("!")) {
+      if (!parse_unary(error)) return false;
+      code.push_back({logical_not, 0});
+      return true;
+    }
+    if (accept("-")) {
+      if (!parse_unary(error)) return false;
+      code.push_back({negate, 0});
+      return true;
+    }
+    return parse_primary(error);
+  }
+
+  bool parse_primary(std::string& error) {
+    skip_space();
+    if (accept("(")) {
+      if (!parse_binary(0, error)) return false;
+      if (!accept(")")) {
+        error = "missing ')'";
+        return false;
+      }
+      return true;
+    }
+    if (accept("[")) {
+      if (!parse_binary(0, error)) return false;
+      if (!accept("]")) {
+        error = "missing ']'";
+        return false;
+      }
+      code.push_back({load, 0});
+      return true;
+    }
+    if (pos < src.size() && std::isdigit(static_cast<unsigned char>(src[pos]))) {
+      char* end = nullptr;
+      long v = std::strtol(src.c_str() + pos, &end, 0);
+      pos = end - src.c_str();
+      code.push_back({push, static_cast<int>(v)});
+      return true;
+    }
+    std::size_t start = pos;
+    while (pos < src.size() && std::isalnum(static_cast<unsigned char>(src[pos])))
+      pos++;
+    std::string name = src.substr(start, pos - start);
+    for (auto& c : name) c = std::toupper(static_cast<unsigned char>(c));
+    if (name.size() == 2 && name[0] == 'V' && std::isxdigit(static_cast<unsigned char>(name[1]))) {
+      code.push_back({reg_v, std::stoi(name.substr(1), nullptr, 16)});
+    } else if (name == "I") {
+      code.push_back({reg_i, 0});
+    } else if (name == "PC") {
+      code.push_back({reg_pc, 0});
+    } else if (name == "SP") {
+      code.push_back({reg_sp, 0});
+    } else if (name == "DT") {
+      code.push_back({reg_dt, 0});
+    } else if (name == "ST") {
+      code.push_back({reg_st, 0});
+    } else {
+      error = name.empty() ? "expected an operand at '" + src.substr(pos) + "'"
+                           : "unknown register '" + name + "'";
+      return false;
+    }
+    return true;
+  }
+
+  std::string src;
+  std::size_t pos = 0;
+  std::vector<op> code;
+};
+
+// Breakpoints with optional conditions, conditional breaks that are
+// checked on every instruction, and memory and register watchpoints.
+// Attach it to an emulator to make emulateCycle honour them; detach it
+// to get the undebugged fast path back.
+class debugger : public debug_hooks {
+public:
+  debugger() {
+    check = &debugger::evaluate;
+  }
+
+  void attach(emulator& emu) { emu.debug = this; }
+  void detach(emulator& emu) { emu.debug = nullptr; }
+
+  // Breaks before the instruction at addr if condition holds. An empty
+  // condition always breaks.
+  bool add_breakpoint(std::uint16_t addr, const std::string& condition,
+                      std::string& error) {
+    if (!condition.empty()) {
+      expression e;
+      if (!e.parse(condition, error)) return false;
+      conditions[addr & 0xFFF] = e;
+    } else {
+      conditions.erase(addr & 0xFFF);
+    }
+    set(exec_bits, addr, true);
+    return true;
+  }
+  void remove_breakpoint(std::uint16_t addr) {
+    set(exec_bits, addr, false);
+    conditions.erase(addr & 0xFFF);
+  }
+
+  // Breaks before any instruction once condition holds.
+  bool break_when(const std::string& condition, std::string& error) {
+    expression e;
+    if (!e.parse(condition, error)) return false;
+    global.push_back(e);
+    always_check = true;
+    return true;
+  }
+
+  void watch_read(std::uint16_t addr, std::uint16_t len = 1) {
+    for (unsigned i = 0; i < len; i++) set(read_bits, addr + i, true);
+  }
+  void watch_write(std::uint16_t addr, std::uint16_t len = 1) {
+    for (unsigned i = 0; i < len; i++) set(write_bits, addr + i, true);
+  }
+  // reg is 0-15 for V0-VF and 16 for I.
+  bool watch_register(unsigned reg, std::string& error) {
+    if (reg > 16) {
+      error = "no register " + std::to_string(reg);
+      return false;
+    }
+    register_mask |= 1u << reg;
+    return true;
+  }
+
+  void step() {
+    resume();
+    single_step = true;
+  }
+
+  bool stopped() const { return reason != none; }
+
+  // Human readable description of the last stop.
+  std::string describe() const {
+    char buf[64];
+    switch (reason) {
+      case breakpoint:
+        std::snprintf(buf, sizeof(buf), "breakpoint at 0x%03x", address);
+        break;
+      case condition:
+        std::snprintf(buf, sizeof(buf), "condition at 0x%03x", address);
+        break;
+      case read_watch:
+        std::snprintf(buf, sizeof(buf), "read of 0x%03x", address);
+        break;
+      case write_watch:
+        std::snprintf(buf, sizeof(buf), "write to 0x%03x", address);
+        break;
+      case register_watch:
+        if (address == 16) {
+          std::snprintf(buf, sizeof(buf), "I changed");
+        } else {
+          std::snprintf(buf, sizeof(buf), "V%X changed", address);
+        }
+        break;
+      case stepped:
+        std::snprintf(buf, sizeof(buf), "step to 0x%03x", address);
+        break;
+      default:
+        return "running";
+    }
+    return buf;
+  }
+
+private:
+  static stop_reason evaluate(debug_hooks& hooks, const emulator& emu,
+                              bool at_breakpoint) {
+    debugger& self = static_cast<debugger&>(hooks);
+    if (at_breakpoint) {
+      auto it = self.conditions.find(emu.pc & 0xFFF);
+      if (it == self.conditions.end() || it->second.evaluate(emu)) {
+        return breakpoint;
+      }
+    }
+    for (const expression& e : self.global) {
+      if (e.evaluate(emu)) return condition;
+    }
+    return none;
+  }
+
+  std::map<std::uint16_t, expression> conditions;
+  std::vector<expression> global;
+};
+
+}  // namespace chip8
+
+#endif  // DEBUGGER_H_
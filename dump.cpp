@@ -0,0 +1,220 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "framesink.h"
+#include "shm.h"
+#include "movie.h"
+#include "savestate.h"
+#include "fusion.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8dump <rom> [--frames N] [--scale S] [--cycles-per-frame N]
+//           [--y4m FILE|-] [--png PATTERN] [--pbm PATTERN] [--shm SEGMENT]
+//           [--seed S | --replay MOVIE] [--bench [--instances N]]
+//           [--fused | --profile N]
+//           [--load-state FILE] [--save-state FILE [--compress]]
+//
+// Runs a ROM headless for N frames (default 3600, one minute) and hands
+// every frame to the selected sinks, e.g.
+//
+//   chip8dump roms/rom --frames 216000 --y4m - | ffmpeg -i - breakout.mp4
+//   chip8dump roms/rom --frames 600 --png shots/frame%06u.png
+//
+// --shm publishes the state after every frame for chip8view.
+//
+// Without a movie no key is pressed and CXNN uses the given seed (default
+// 1), so runs are reproducible. --replay feeds the keys of a movie
+// recorded with main or chip8term and stops at its end. --bench prints
+// the emulation speed, e.g. as a macro benchmark over a long replay.
+// --instances runs N-1 more copies of the ROM with seeds S+1.. next to
+// it, a frame each in turn, to measure many instances per core.
+//
+// --fused runs with chip8::fused_engine and prints how often each
+// superinstruction was dispatched. --profile steps through every
+// instruction and prints the N most frequent opcode pairs and triples.
+//
+// --load-state starts from a save state instead of from boot and
+// --save-state writes one after the last frame.
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  unsigned long frames = 3600;
+  unsigned scale = 10;
+  unsigned cycles_per_frame = 10;
+  std::vector<std::pair<chip8::frame_sink::format, std::string>> targets;
+  const char* segment = nullptr;
+  const char* replay = nullptr;
+  std::uint32_t seed = 1;
+  bool bench = false;
+  const char* load_state = nullptr;
+  const char* save_state = nullptr;
+  bool compress = false;
+  unsigned instances = 1;
+  bool fused = false;
+  unsigned long profile = 0;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--frames") == 0 && has_value) {
+      frames = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--scale") == 0 && has_value) {
+      scale = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--cycles-per-frame") == 0 && has_value) {
+      cycles_per_frame = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--y4m") == 0 && has_value) {
+      targets.emplace_back(chip8::frame_sink::y4m, argv[++i]);
+    } else if (std::strcmp(argv[i], "--png") == 0 && has_value) {
+      targets.emplace_back(chip8::frame_sink::png, argv[++i]);
+    } else if (std::strcmp(argv[i], "--pbm") == 0 && has_value) {
+      targets.emplace_back(chip8::frame_sink::pbm, argv[++i]);
+    } else if (std::strcmp(argv[i], "--shm") == 0 && has_value) {
+      segment = argv[++i];
+    } else if (std::strcmp(argv[i], "--replay") == 0 && has_value) {
+      replay = argv[++i];
+    } else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+      seed = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--bench") == 0) {
+      bench = true;
+    } else if (std::strcmp(argv[i], "--load-state") == 0 && has_value) {
+      load_state = argv[++i];
+    } else if (std::strcmp(argv[i], "--save-state") == 0 && has_value) {
+      save_state = argv[++i];
+    } else if (std::strcmp(argv[i], "--instances") == 0 && has_value) {
+      instances = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--fused") == 0) {
+      fused = true;
+    } else if (std::strcmp(argv[i], "--profile") == 0 && has_value) {
+      profile = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--compress") == 0) {
+      compress = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr ||
+      (targets.empty() && segment == nullptr && !bench && !save_state &&
+       !fused && !profile)) {
+    std::cerr << "usage: chip8dump <rom> [--frames N] [--scale S] "
+                 "[--cycles-per-frame N]\n"
+                 "                 [--y4m FILE|-] [--png PATTERN] "
+                 "[--pbm PATTERN] [--shm SEGMENT]\n"
+                 "                 [--seed S | --replay MOVIE] "
+                 "[--bench [--instances N]]\n"
+                 "                 [--fused | --profile N]\n"
+                 "                 [--load-state FILE] "
+                 "[--save-state FILE [--compress]]" << std::endl;
+    return 1;
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  std::vector<std::uint8_t> rom(std::istreambuf_iterator<char>(input), {});
+
+  std::vector<std::unique_ptr<chip8::frame_sink>> sinks;
+  for (auto& t : targets) {
+    sinks.push_back(std::make_unique<chip8::frame_sink>());
+    std::string error;
+    if (!sinks.back()->open(t.first, t.second, scale, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+
+  chip8::shm_publisher publisher;
+  if (segment != nullptr) {
+    std::string error;
+    if (!publisher.open(segment, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom.data(), rom.size());
+  emu.cycles_per_frame = cycles_per_frame;
+  emu.seed(seed);
+  std::uint32_t rom_hash = chip8::hash_rom(rom.data(), rom.size());
+  if (load_state != nullptr) {
+    chip8::state_file state;
+    std::string error;
+    if (!state.open(load_state, error) ||
+        !state.restore(emu, error, rom_hash)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+
+  chip8::movie movie;
+  chip8::movie_player player(movie);
+  if (replay != nullptr) {
+    std::string error;
+    if (!movie.load(replay, error) ||
+        !player.start(emu, rom.data(), rom.size(), error)) {
+      std::cerr << replay << ": " << error << std::endl;
+      return 1;
+    }
+  }
+
+  // Extra instances for --instances, packed next to each other.
+  std::vector<chip8::emulator> others(instances > 1 ? instances - 1 : 0);
+  for (std::size_t i = 0; i < others.size(); i++) {
+    others[i].copy_state(emu);
+    others[i].cycles_per_frame = emu.cycles_per_frame;
+    others[i].seed(seed + i + 1);
+  }
+
+  chip8::fused_engine engine;
+  chip8::sequence_profile sequences;
+
+  auto start = std::chrono::steady_clock::now();
+  unsigned long f = 0;
+  for (; f < frames; f++) {
+    if (replay != nullptr) {
+      if (player.finished(emu)) break;
+      player.run_frame(emu);
+    } else if (profile) {
+      sequences.run_frame(emu);
+    } else if (fused) {
+      engine.run_frame(emu);
+    } else {
+      emu.run_frame();
+    }
+    for (chip8::emulator& other : others) other.run_frame();
+    if (publisher.is_open()) publisher.publish(emu);
+    for (auto& s : sinks) {
+      if (!s->write(emu)) {
+        std::cerr << "write failed after " << f << " frames" << std::endl;
+        return 1;
+      }
+    }
+  }
+  if (save_state != nullptr) {
+    std::string error;
+    if (!chip8::save_state(emu, save_state, rom_hash, compress, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  if (fused) std::cerr << engine.report();
+  if (profile) std::cerr << sequences.report(profile);
+  if (bench) {
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    std::uint64_t cycles = emu.cycles;
+    for (const chip8::emulator& other : others) cycles += other.cycles;
+    std::cerr << f << " frames, " << cycles << " cycles in " << t.count()
+              << " s, " << cycles / t.count() / 1e6 << " M cycles/s"
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,296 @@
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef FRAMESINK_H_
+#define FRAMESINK_H_
+
+namespace chip8 {
+
+// Writes the screen once per 60 Hz frame, scaled up and in grayscale with
+// lit pixels white.
+//
+//   y4m  one raw YUV4MPEG2 stream (mono, 60 fps) to a file or "-" for
+//        stdout, e.g. for piping into ffmpeg -i - out.mp4
+//   png  one file per frame, the target is a printf pattern with a single
+//   pbm  integer conversion for the frame number, e.g. "shot%06u.png";
+//        any other % has to be %%
+//
+// All buffers are sized by open(), write() does not allocate. A frame equal
+// to the previous one is not converted again; gfx_hash rejects most changed
+// frames without a compare, a matching hash is confirmed against a copy of
+// the last screen. The y4m stream repeats the last picture to keep its
+// timing, png and pbm skip the file, so the gaps in the numbering show how
+// long a picture stayed on screen.
+class frame_sink {
+public:
+  enum format { y4m, png, pbm };
+
+  frame_sink() = default;
+  frame_sink(const frame_sink&) = delete;
+  frame_sink& operator=(const frame_sink&) = delete;
+  ~frame_sink() { close(); }
+
+  bool open(format f, const std::string& target, unsigned scale,
+            std::string& error) {
+    close();
+    if (scale == 0 || scale > 64) {
+      error = "scale must be between 1 and 64";
+      return false;
+    }
+    fmt = f;
+    pattern = target;
+    width = 64 * scale;
+    height = 32 * scale;
+    factor = scale;
+    frame = 0;
+    files = 0;
+    have_last = false;
+    pixels.assign(width * height, 0);
+
+    if (fmt == y4m) {
+      out = target == "-" ? stdout : std::fopen(target.c_str(), "wb");
+      if (out == nullptr) {
+        error = "cannot open " + target;
+        return false;
+      }
+      std::fprintf(out, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 Cmono\n",
+                   width, height);
+    } else {
+      if (!frame_pattern(target)) {
+        error = target + " needs exactly one %u, %d, %x or %o for the frame "
+                "number and no other conversion but %%";
+        return false;
+      }
+      name.assign(target.size() + 32, '\0');
+      if (fmt == png) {
+        encoded.assign(png_size(), 0);
+      } else {
+        encoded.assign(pbm_header() + height * ((width + 7) / 8), 0);
+      }
+    }
+    return true;
+  }
+
+  // Called once per frame with the emulator after run_frame.
+  bool write(const emulator& emu) {
+    bool same = have_last && emu.gfx_hash == last_hash &&
+                std::memcmp(last, emu.gfx, sizeof(last)) == 0;
+    if (!same) {
+      std::memcpy(last, emu.gfx, sizeof(last));
+      last_hash = emu.gfx_hash;
+      have_last = true;
+      convert();
+    }
+    bool ok = true;
+    if (fmt == y4m) {
+      ok = out != nullptr && std::fputs("FRAME\n", out) >= 0 &&
+           std::fwrite(pixels.data(), 1, pixels.size(), out) == pixels.size();
+    } else if (!same) {
+      std::size_t n = fmt == png ? encode_png() : encode_pbm();
+      std::snprintf(&name[0], name.size(), pattern.c_str(),
+                    static_cast<unsigned>(frame));
+      std::FILE* f = std::fopen(name.c_str(), "wb");
+      ok = f != nullptr && std::fwrite(encoded.data(), 1, n, f) == n;
+      if (f != nullptr) ok = std::fclose(f) == 0 && ok;
+      files++;
+    }
+    frame++;
+    return ok;
+  }
+
+  void close() {
+    if (out != nullptr && out != stdout) std::fclose(out);
+    if (out == stdout) std::fflush(out);
+    out = nullptr;
+  }
+
+  // Frames passed to write and image files written.
+  std::uint64_t frames() const { return frame; }
+  std::uint64_t files_written() const { return files; }
+
+private:
+  // The pattern is safe to pass to snprintf with one unsigned: a single
+  // integer conversion with flags and at most two digits of width or
+  // precision, and %% otherwise.
+  static bool frame_pattern(const std::string& pattern) {
+    int conversions = 0;
+    for (std::size_t i = 0; i < pattern.size(); i++) {
+      if (pattern[i] != '%') continue;
+      if (++i < pattern.size() && pattern[i] == '%') continue;
+      while (i < pattern.size() && std::strchr("-+ #0", pattern[i])) i++;
+      int digits = 0;
+      while (i < pattern.size() &&
+             (std::isdigit(static_cast<unsigned char>(pattern[i])) ||
+              pattern[i] == '.')) {
+        if (pattern[i] != '.' && ++digits > 2) return false;
+        i++;
+      }
+      if (i == pattern.size() || !std::strchr("udixXo", pattern[i])) {
+        return false;
+      }
+      conversions++;
+    }
+    return conversions == 1;
+  }
+
+  void convert() {
+    for (unsigned y = 0; y < 32; y++) {
+      std::uint8_t* row = &pixels[y * factor * width];
+      for (unsigned x = 0; x < 64; x++) {
+        std::memset(row + x * factor, last[y][x] ? 0xFF : 0x00, factor);
+      }
+      for (unsigned r = 1; r < factor; r++) {
+        std::memcpy(row + r * width, row, width);
+      }
+    }
+  }
+
+  unsigned pbm_header() const {
+    return std::snprintf(nullptr, 0, "P4\n%u %u\n", width, height);
+  }
+
+  std::size_t encode_pbm() {
+    std::size_t n = pbm_header();
+    std::snprintf(reinterpret_cast<char*>(&encoded[0]), n + 1,
+                  "P4\n%u %u\n", width, height);
+    // PBM uses 1 for black.
+    unsigned stride = (width + 7) / 8;
+    for (unsigned y = 0; y < height; y++) {
+      std::uint8_t* dst = &encoded[n + y * stride];
+      std::memset(dst, 0, stride);
+      for (unsigned x = 0; x < width; x++) {
+        if (pixels[y * width + x] == 0) dst[x / 8] |= 0x80 >> (x % 8);
+      }
+    }
+    return n + height * stride;
+  }
+
+  // PNG with the image data in uncompressed deflate blocks, which keeps
+  // the encoder small; the sizes are fixed for a given scale.
+  static constexpr unsigned max_stored = 65535;
+
+  std::size_t raw_size() const { return height * (width + 1); }
+  std::size_t png_size() const {
+    std::size_t raw = raw_size();
+    std::size_t blocks = (raw + max_stored - 1) / max_stored;
+    std::size_t idat = 2 + raw + 5 * blocks + 4;
+    return 8 + (12 + 13) + (12 + idat) + 12;
+  }
+
+  static std::uint32_t crc32(const std::uint8_t* p, std::size_t n,
+                             std::uint32_t crc = 0) {
+    static const auto table = [] {
+      std::vector<std::uint32_t> t(256);
+      for (std::uint32_t i = 0; i < 256; i++) {
+        std::uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        t[i] = c;
+      }
+      return t;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < n; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  static std::uint8_t* put32(std::uint8_t* p, std::uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+  }
+
+  // Writes length, type and data size of a chunk; the caller fills in the
+  // data and end_chunk appends the CRC.
+  static std::uint8_t* begin_chunk(std::uint8_t* p, const char* type,
+                                   std::uint32_t size) {
+    p = put32(p, size);
+    std::memcpy(p, type, 4);
+    return p + 4;
+  }
+  static std::uint8_t* end_chunk(std::uint8_t* type, std::uint8_t* end) {
+    return put32(end, crc32(type, end - type));
+  }
+
+  std::size_t encode_png() {
+    static const std::uint8_t signature[8] = {
+      0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'
+    };
+    std::uint8_t* p = &encoded[0];
+    std::memcpy(p, signature, 8);
+    p += 8;
+
+    std::uint8_t* type = p + 4;
+    p = begin_chunk(p, "IHDR", 13);
+    p = put32(p, width);
+    p = put32(p, height);
+    *p++ = 8;  // bit depth
+    *p++ = 0;  // grayscale
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    p = end_chunk(type, p);
+
+    std::size_t raw = raw_size();
+    std::size_t blocks = (raw + max_stored - 1) / max_stored;
+    type = p + 4;
+    p = begin_chunk(p, "IDAT", 2 + raw + 5 * blocks + 4);
+    *p++ = 0x78;
+    *p++ = 0x01;
+    std::uint32_t a = 1, b = 0;
+    std::size_t left = raw, in_block = 0;
+    for (unsigned y = 0; y < height; y++) {
+      for (unsigned x = 0; x <= width; x++) {
+        if (in_block == 0) {
+          in_block = left < max_stored ? left : max_stored;
+          *p++ = left == in_block ? 1 : 0;
+          *p++ = in_block & 0xFF;
+          *p++ = in_block >> 8;
+          *p++ = ~in_block & 0xFF;
+          *p++ = (~in_block >> 8) & 0xFF;
+        }
+        // every row starts with filter type 0
+        std::uint8_t v = x == 0 ? 0 : pixels[y * width + x - 1];
+        *p++ = v;
+        a = (a + v) % 65521;
+        b = (b + a) % 65521;
+        in_block--;
+        left--;
+      }
+    }
+    p = put32(p, (b << 16) | a);
+    p = end_chunk(type, p);
+
+    type = p + 4;
+    p = begin_chunk(p, "IEND", 0);
+    p = end_chunk(type, p);
+    return p - &encoded[0];
+  }
+
+  format fmt = y4m;
+  std::string pattern;
+  std::string name;
+  unsigned width = 0;
+  unsigned height = 0;
+  unsigned factor = 1;
+  std::uint64_t frame = 0;
+  std::uint64_t files = 0;
+  std::FILE* out = nullptr;
+  bool have_last = false;
+  std::uint8_t last[32][64];
+  std::uint64_t last_hash = 0;
+  std::vector<std::uint8_t> pixels;
+  std::vector<std::uint8_t> encoded;
+};
+
+}  // namespace chip8
+
+#endif  // FRAMESINK_H_
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef FUSION_H_
+#define FUSION_H_
+
+namespace chip8 {
+
+// Opcode family as told apart by OpCode::as_string, e.g. 0x6000 for
+// 6XNN and 0xF007 for FX07.
+inline std::uint16_t opcode_family(std::uint16_t op) noexcept {
+  switch (op & 0xF000) {
+    case 0x0000: return op == 0x00E0 || op == 0x00EE ? op : 0x0000;
+    case 0x8000: return op & 0xF00F;
+    case 0xE000:
+    case 0xF000: return op & 0xF0FF;
+    default:     return op & 0xF000;
+  }
+}
+
+// Counts which opcode families follow each other at run time, to find
+// sequences worth fusing.
+class sequence_profile {
+public:
+  // One frame of emulator::run_frame, stepping instruction by instruction.
+  void run_frame(emulator& emu) {
+    for (unsigned i = 0; i < emu.cycles_per_frame; i++) {
+      emu.opcode = emu.fetch();
+      record(opcode_family(emu.opcode));
+      emu.execute(emu.opcode);
+      emu.cycles++;
+    }
+    emu.tick_timers();
+  }
+
+  void record(std::uint16_t family) {
+    if (seen >= 1) pairs[(std::uint32_t(last[1]) << 16) | family]++;
+    if (seen >= 2) {
+      triples[(std::uint64_t(last[0]) << 32) | (std::uint64_t(last[1]) << 16) |
+              family]++;
+    }
+    last[0] = last[1];
+    last[1] = family;
+    if (seen < 2) seen++;
+    total++;
+  }
+
+  // The count most frequent pairs and triples, one per line with their
+  // share of all instructions.
+  std::string report(std::size_t count) const {
+    std::string out;
+    append(out, pairs, 2, count);
+    append(out, triples, 3, count);
+    return out;
+  }
+
+private:
+  template <typename Map>
+  void append(std::string& out, const Map& counts, unsigned length,
+              std::size_t count) const {
+    std::vector<std::pair<std::uint64_t, typename Map::key_type>> sorted;
+    for (const auto& c : counts) sorted.emplace_back(c.second, c.first);
+    std::sort(sorted.rbegin(), sorted.rend());
+    if (sorted.size() > count) sorted.resize(count);
+    for (const auto& s : sorted) {
+      char line[32];
+      std::snprintf(line, sizeof(line), "%12llu %5.1f%%  ",
+                    static_cast<unsigned long long>(s.first),
+                    total ? 100.0 * s.first / total : 0.0);
+      out += line;
+      for (unsigned i = 0; i < length; i++) {
+        std::uint16_t family = s.second >> (16 * (length - 1 - i));
+        if (i != 0) out += "; ";
+        out += OpCode::as_string(family);
+      }
+      out += "\n";
+    }
+  }
+
+  std::unordered_map<std::uint32_t, std::uint64_t> pairs;
+  std::unordered_map<std::uint64_t, std::uint64_t> triples;
+  std::uint16_t last[2] = {};
+  unsigned seen = 0;
+  std::uint64_t total = 0;
+};
+
+// Superinstructions of fused_engine, found with sequence_profile on
+// Breakout.
+enum fused_kind : std::uint8_t {
+  fuse_set_pair,     // 6XNN; 6YNN
+  fuse_draw,         // ANNN; DXYN
+  fuse_count_loop,   // 7XNN; 3YNN; 1NNN
+  fuse_timer_wait,   // FX07; 3XNN; 1NNN
+  fused_kinds
+};
+
+constexpr const char* fused_names[fused_kinds] = {
+  "6XNN; 6YNN", "ANNN; DXYN", "7XNN; 3YNN; 1NNN", "FX07; 3XNN; 1NNN"
+};
+
+struct fusion_stats {
+  // instructions dispatched one at a time
+  std::uint64_t unfused = 0;
+  // superinstructions dispatched, by fused_kind
+  std::uint64_t fused[fused_kinds] = {};
+  // instructions run as part of a superinstruction
+  std::uint64_t fused_cycles = 0;
+};
+
+// run_cycles with common sequences executed by one handler each instead
+// of one pass through emulator::execute per instruction. Sequences are
+// matched against memory at every dispatch, nothing is cached, so code
+// that modifies itself runs the same as in the interpreter. None of the
+// fused instructions write memory, so a sequence cannot change itself
+// halfway through.
+class fused_engine {
+public:
+  run_events run_cycles(emulator& emu, std::uint64_t n, bool test = false) {
+    if (emu.keyinterface != nullptr) {
+      interface_input input{emu.keyinterface};
+      return run_cycles(emu, n, input, test);
+    }
+    bitmap_input input{&emu.keys};
+    return run_cycles(emu, n, input, test);
+  }
+
+  template <input_policy Input>
+  run_events run_cycles(emulator& emu, std::uint64_t n, Input& input,
+                        bool test = false) {
+    if (emu.debug != nullptr) return emu.run_cycles(n, input, test);
+    run_events ev;
+    emu.events = 0;
+    std::uint64_t i = 0;
+    while (i < n) {
+      const std::uint16_t op = emu.fetch();
+      const std::uint16_t pc = emu.pc;
+      const std::uint64_t left = n - i;
+      std::uint64_t done = 0;
+      if (left >= 3 && std::size_t(pc) + 6 <= address_space) {
+        done = fuse3(emu, op, n - i);
+      }
+      if (done == 0 && left >= 2 && std::size_t(pc) + 4 <= address_space) {
+        done = fuse2(emu, op, input, test);
+      }
+      if (done != 0) {
+        i += done;
+        continue;
+      }
+
+      // As in emulator::run_cycles
+      if ((op & 0xF000) == 0x1000 || (op & 0xF0FF) == 0xF00A) {
+        std::uint64_t period = emu.idle_period(op, input);
+        std::uint64_t skip = period ? (left - 1) / period * period : 0;
+        if (skip != 0) {
+          emu.opcode = op;
+          i += skip;
+          ev.idle_cycles += skip;
+          ev.waiting_for_input = emu.input_wait;
+          if ((op & 0xF0FF) == 0xF00A) emu.events |= emulator::event_key_wait;
+          continue;
+        }
+      }
+      emu.opcode = op;
+      emu.execute(op, input, test);
+      stats.unfused++;
+      i++;
+    }
+    ev.idle_cycles += idle;
+    idle = 0;
+    ev.cycles = n;
+    emu.cycles += n;
+    ev.screen_changed = emu.events & emulator::event_screen;
+    ev.sound_started  = emu.events & emulator::event_sound_start;
+    ev.sound_stopped  = emu.events & emulator::event_sound_stop;
+    ev.key_wait       = emu.events & emulator::event_key_wait;
+    return ev;
+  }
+
+  run_events run_frame(emulator& emu, bool test = false) {
+    return emu.end_frame(run_cycles(emu, emu.cycles_per_frame, test));
+  }
+
+  // Dispatch counts, one line per kind.
+  std::string report() const {
+    std::string out;
+    char line[64];
+    std::snprintf(line, sizeof(line), "%-18s %12llu\n", "unfused",
+                  static_cast<unsigned long long>(stats.unfused));
+    out += line;
+    for (int k = 0; k < fused_kinds; k++) {
+      std::snprintf(line, sizeof(line), "%-18s %12llu\n", fused_names[k],
+                    static_cast<unsigned long long>(stats.fused[k]));
+      out += line;
+    }
+    return out;
+  }
+
+  fusion_stats stats;
+
+private:
+  static std::uint16_t at(const emulator& emu, unsigned addr) {
+    return (emu.memory[addr] << 8) | emu.memory[addr + 1];
+  }
+
+  // Pairs; returns the number of instructions run, 0 if op starts none.
+  template <input_policy Input>
+  std::uint64_t fuse2(emulator& emu, std::uint16_t op, Input& input,
+                      bool test) {
+    const std::uint16_t next = at(emu, emu.pc + 2);
+    if ((op & 0xF000) == 0x6000 && (next & 0xF000) == 0x6000) {
+      emu.V[(op & 0x0F00) >> 8] = op & 0x00FF;
+      emu.V[(next & 0x0F00) >> 8] = next & 0x00FF;
+      emu.pc += 4;
+      emu.opcode = next;
+      return count(fuse_set_pair, 2);
+    }
+    if ((op & 0xF000) == 0xA000 && (next & 0xF000) == 0xD000) {
+      emu.I = op & 0x0FFF;
+      emu.pc += 2;
+      emu.opcode = next;
+      emu.execute(next, input, test);
+      return count(fuse_draw, 2);
+    }
+    return 0;
+  }
+
+  // Loops ending in a jump. If the skip is taken the jump does not run
+  // and two instructions are counted.
+  std::uint64_t fuse3(emulator& emu, std::uint16_t op, std::uint64_t left) {
+    if ((op & 0xF000) != 0x7000 && (op & 0xF0FF) != 0xF007) return 0;
+    const std::uint16_t start = emu.pc;
+    const std::uint16_t cond = at(emu, start + 2);
+    const std::uint16_t jump = at(emu, start + 4);
+    if ((cond & 0xF000) != 0x3000 || (jump & 0xF000) != 0x1000) return 0;
+    const std::uint8_t x = (op & 0x0F00) >> 8;
+    const std::uint8_t y = (cond & 0x0F00) >> 8;
+    fused_kind kind;
+    if ((op & 0xF000) == 0x7000) {
+      emu.V[x] += op & 0x00FF;
+      kind = fuse_count_loop;
+    } else {
+      if (x != y) return 0;
+      emu.V[x] = emu.delay_timer;
+      kind = fuse_timer_wait;
+    }
+    if (emu.V[y] == (cond & 0x00FF)) {
+      emu.pc = start + 6;
+      emu.opcode = cond;
+      return count(kind, 2);
+    }
+    emu.pc = jump & 0x0FFF;
+    emu.opcode = jump;
+    count(kind, 3);
+    // A timer wait jumping to itself repeats unchanged until the next
+    // tick; whole rounds of it are skipped like emulator::run_cycles does.
+    if (kind == fuse_timer_wait && emu.pc == start) {
+      std::uint64_t skip = (left - 3) / 3 * 3;
+      idle += skip;
+      return 3 + skip;
+    }
+    return 3;
+  }
+
+  std::uint64_t count(fused_kind kind, std::uint64_t cycles) {
+    stats.fused[kind]++;
+    stats.fused_cycles += cycles;
+    return cycles;
+  }
+
+  // idle cycles skipped by fuse3 during the current run_cycles
+  std::uint64_t idle = 0;
+};
+
+}  // namespace chip8
+
+#endif  // FUSION_H_
@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "chip8.h"
+#include "lockstep.h"
+
+// Copyright 2019 Daniel Weber
+
+// Fuzzing entry point for chip8::emulator.
+//
+// The input is loaded as a ROM at 0x200 and run for up to CHIP8_FUZZ_CYCLES
+// instructions (default 1000). pc, I and sp are masked by the interpreter,
+// so rather than bounds the harness checks properties that a wrong
+// interpreter breaks, and aborts with a description if one does not hold:
+//
+//   - reset() and load() give the state initialize() and load() do
+//   - gfx_hash matches the screen after the run
+//   - every engine of lockstep.h ends in the state of the reference
+//     engine, with timer ticks every 16 instructions
+//
+// Built with clang and -DCHIP8_FUZZ_LIBFUZZER=ON this is a libFuzzer
+// target. Compiled with afl-clang-fast it runs in AFL++ persistent mode.
+// Otherwise it is a standalone driver:
+//
+//   chip8fuzz <file>...        run the given inputs, e.g. to replay crashes
+//   chip8fuzz --bench N <file> run file N times and report execs/s
+//   chip8fuzz < input          run stdin
+
+namespace {
+
+// Input policy answering every key query with the next key in turn, so
+// all key paths are reached without a call through KeyInterface.
+struct stub_input {
+  static constexpr bool stable = false;
+  unsigned next = 0;
+
+  bool key_down(std::uint8_t key) noexcept {
+    return key == ((next++) & 0xF);
+  }
+  int wait_key() noexcept { return (next++) & 0xF; }
+};
+
+unsigned max_cycles() {
+  static unsigned n = [] {
+    const char* env = std::getenv("CHIP8_FUZZ_CYCLES");
+    return env ? static_cast<unsigned>(std::strtoul(env, nullptr, 0)) : 1000u;
+  }();
+  return n;
+}
+
+[[noreturn]] void violation(const char* what, const std::string& details) {
+  std::fprintf(stderr, "chip8fuzz: %s\n%s", what, details.c_str());
+  std::abort();
+}
+
+void check_screen_hash(const chip8::emulator& emu, const char* engine) {
+  if (emu.gfx_hash != chip8::hash_screen(emu.gfx)) {
+    violation("screen hash does not match the screen", engine);
+  }
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data,
+                                      std::size_t size) {
+  constexpr std::size_t engine_count = std::size(chip8::engines);
+  static chip8::emulator emu;
+  static chip8::emulator runs[engine_count];
+  static bool initialized = false;
+  if (!initialized) {
+    emu.initialize();
+    initialized = true;
+  }
+
+  // Only the pages and rows the previous input wrote are restored, which
+  // has to be the same as starting over.
+  emu.reset();
+  emu.load(data, size);
+  chip8::emulator& fresh = runs[0];
+  fresh.initialize();
+  fresh.load(data, size);
+  fresh.cycles = emu.cycles;
+  fresh.random_state = emu.random_state;
+  std::string diff = chip8::state_diff(fresh, emu);
+  if (!diff.empty()) violation("reset() differs from initialize()", diff);
+
+  // Every key path with stub_input. Timers tick every 16 instructions
+  // instead of by wall clock so runs are reproducible; CXNN runs in test
+  // mode for the same reason.
+  stub_input keys;
+  const unsigned cycles = max_cycles();
+  for (unsigned i = 0; i < cycles; i++) {
+    emu.opcode = emu.fetch();
+    emu.execute(emu.opcode, keys, true);
+    if ((i & 15) == 15) {
+      if (emu.delay_timer) emu.delay_timer--;
+      if (emu.sound_timer) emu.sound_timer--;
+    }
+  }
+  check_screen_hash(emu, "stub input");
+
+  // The engines from the same start, with a seeded CXNN and no key down.
+  fresh.cycles = 0;
+  fresh.seed(1);
+  for (std::size_t e = 1; e < engine_count; e++) runs[e].copy_state(fresh);
+  for (std::size_t e = 0; e < engine_count; e++) {
+    runs[e].cycles = 0;
+    for (unsigned done = 0; done < cycles; done += 16) {
+      chip8::engines[e].run(runs[e], std::min(16u, cycles - done));
+      runs[e].tick_timers();
+    }
+    check_screen_hash(runs[e], chip8::engines[e].name);
+  }
+  for (std::size_t e = 1; e < engine_count; e++) {
+    diff = chip8::state_diff(runs[0], runs[e]);
+    if (!diff.empty()) {
+      violation((std::string(chip8::engines[e].name) +
+                 " differs from the reference engine").c_str(), diff);
+    }
+  }
+  return 0;
+}
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+
+__AFL_FUZZ_INIT();
+
+int main() {
+  __AFL_INIT();
+  unsigned char* buf = __AFL_FUZZ_TESTCASE_BUF;
+  while (__AFL_LOOP(100000)) {
+    LLVMFuzzerTestOneInput(buf, __AFL_FUZZ_TESTCASE_LEN);
+  }
+  return 0;
+}
+
+#elif defined(CHIP8_FUZZ_MAIN)
+
+int main(int argc, char** argv) {
+  if (argc == 4 && std::strcmp(argv[1], "--bench") == 0) {
+    unsigned long runs = std::strtoul(argv[2], nullptr, 0);
+    std::ifstream in(argv[3], std::ios::binary);
+    if (!in) {
+      std::cerr << "cannot open " << argv[3] << std::endl;
+      return 1;
+    }
+    std::vector<std::uint8_t> input(std::istreambuf_iterator<char>(in), {});
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long r = 0; r < runs; r++) {
+      LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    std::cout << runs << " execs of " << max_cycles() << " cycles in "
+              << t.count() << " s, " << runs / t.count() << " execs/s"
+              << std::endl;
+    return 0;
+  }
+
+  if (argc == 1) {
+    std::vector<std::uint8_t> input(std::istreambuf_iterator<char>(std::cin), {});
+    return LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+  for (int i = 1; i < argc; i++) {
+    std::ifstream in(argv[i], std::ios::binary);
+    if (!in) {
+      std::cerr << "cannot open " << argv[i] << std::endl;
+      return 1;
+    }
+    std::vector<std::uint8_t> input(std::istreambuf_iterator<char>(in), {});
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+  }
+  return 0;
+}
+
+#endif
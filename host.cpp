@@ -0,0 +1,87 @@
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "chip8.h"
+#include "host.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8host --socket PATH [--threads N] [--unpaced]
+//
+// Hosts any number of sessions in one process. Every session runs one
+// frame per 60 Hz tick on a work stealing thread pool; with --unpaced
+// frames run back to back as fast as the pool allows. Sessions are
+// controlled through the Unix domain socket, one command per line, see
+// chip8::session_manager::command:
+//
+//   $ nc -U /tmp/chip8.sock
+//   create roms/rom
+//   ok 1
+//   key 1 4 down
+//   ok
+//   stats 1
+//   ok frames=312 cycles=3120 cpu_us=95
+
+namespace {
+
+volatile std::sig_atomic_t quit = 0;
+
+void on_signal(int) { quit = 1; }
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* socket_path = nullptr;
+  unsigned threads = std::thread::hardware_concurrency();
+  bool paced = true;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--unpaced") == 0) {
+      paced = false;
+    } else {
+      socket_path = nullptr;
+      break;
+    }
+  }
+  if (socket_path == nullptr) {
+    std::cerr << "usage: chip8host --socket PATH [--threads N] [--unpaced]"
+              << std::endl;
+    return 1;
+  }
+
+  chip8::session_manager manager(threads);
+  chip8::control_server server(manager);
+  std::string error;
+  if (!server.listen(socket_path, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::signal(SIGINT, on_signal);
+  std::signal(SIGTERM, on_signal);
+
+  auto next_frame = std::chrono::steady_clock::now();
+  while (!quit) {
+    manager.run_frame();
+    if (!paced) {
+      server.poll(0);
+      continue;
+    }
+    next_frame += std::chrono::microseconds(16667);
+    auto now = std::chrono::steady_clock::now();
+    if (next_frame < now) next_frame = now;
+    // answer requests while waiting for the next tick
+    do {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        next_frame - std::chrono::steady_clock::now());
+      server.poll(left.count() > 0 ? left.count() : 0);
+    } while (!quit && std::chrono::steady_clock::now() < next_frame);
+  }
+  return 0;
+}
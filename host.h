@@ -0,0 +1,442 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "savestate.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef HOST_H_
+#define HOST_H_
+
+namespace chip8 {
+
+// Fixed set of threads with one task deque each. A worker takes tasks
+// from the back of its own deque and steals from the front of the others
+// once it runs dry, so sessions with expensive frames do not hold up the
+// queue they happened to land in.
+class work_stealing_pool {
+public:
+  explicit work_stealing_pool(unsigned threads) {
+    if (threads == 0) threads = 1;
+    for (unsigned i = 0; i < threads; i++) {
+      queues.push_back(std::make_unique<queue>());
+    }
+    for (unsigned i = 0; i < threads; i++) {
+      workers.emplace_back([this, i] { run(i); });
+    }
+  }
+
+  ~work_stealing_pool() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : workers) t.join();
+  }
+
+  void submit(std::function<void()> task) {
+    queue& q = *queues[next++ % queues.size()];
+    {
+      std::lock_guard<std::mutex> guard(q.lock);
+      q.tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      queued++;
+      pending++;
+    }
+    wake.notify_one();
+  }
+
+  // Blocks until every submitted task has finished.
+  void wait_idle() {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return pending == 0; });
+  }
+
+  unsigned size() const { return workers.size(); }
+
+private:
+  struct queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  bool take(unsigned self, std::function<void()>& task) {
+    {
+      queue& own = *queues[self];
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        return true;
+      }
+    }
+    for (std::size_t i = 1; i < queues.size(); i++) {
+      queue& other = *queues[(self + i) % queues.size()];
+      std::lock_guard<std::mutex> guard(other.lock);
+      if (!other.tasks.empty()) {
+        task = std::move(other.tasks.front());
+        other.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void run(unsigned self) {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping) return;
+        // claimed here, taken from some deque below
+        queued--;
+      }
+      std::function<void()> task;
+      while (!take(self, task)) std::this_thread::yield();
+      task();
+      std::lock_guard<std::mutex> guard(lock);
+      if (--pending == 0) idle.notify_all();
+    }
+  }
+
+  std::vector<std::unique_ptr<queue>> queues;
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::size_t queued = 0;
+  std::size_t pending = 0;
+  std::atomic<unsigned> next{0};
+  bool stopping = false;
+};
+
+// Screen packed to one bit per pixel, row by row, then run length
+// encoded like compressed save states.
+inline std::vector<std::uint8_t> encode_frame(const std::uint8_t (&gfx)[32][64]) {
+  std::uint8_t packed[32 * 8] = {};
+  for (int y = 0; y < 32; y++) {
+    for (int x = 0; x < 64; x++) {
+      if (gfx[y][x]) packed[y * 8 + x / 8] |= 0x80 >> (x % 8);
+    }
+  }
+  return detail::rle_encode(packed, sizeof(packed));
+}
+
+inline bool decode_frame(const std::uint8_t* data, std::size_t size,
+                         std::uint8_t (&gfx)[32][64]) {
+  std::uint8_t packed[32 * 8];
+  if (!detail::rle_decode(data, size, packed, sizeof(packed))) return false;
+  for (int y = 0; y < 32; y++) {
+    for (int x = 0; x < 64; x++) {
+      gfx[y][x] = (packed[y * 8 + x / 8] >> (7 - x % 8)) & 1;
+    }
+  }
+  return true;
+}
+
+struct session_stats {
+  std::uint64_t frames = 0;
+  std::uint64_t cycles = 0;
+  // thread CPU time spent in the session's frames
+  std::uint64_t cpu_ns = 0;
+};
+
+// Independent emulators run one frame at a time on a work stealing pool.
+// All members are safe to call from any thread; requests for a session
+// wait while its frame runs.
+class session_manager {
+public:
+  explicit session_manager(unsigned threads) : pool(threads) {}
+
+  std::uint32_t create(const std::vector<std::uint8_t>& rom) {
+    auto s = std::make_shared<session>();
+    s->emu.initialize();
+    s->emu.load(rom.data(), rom.size());
+    std::lock_guard<std::mutex> guard(lock);
+    s->id = next_id++;
+    s->emu.seed(s->id);
+    sessions[s->id] = s;
+    return s->id;
+  }
+
+  bool destroy(std::uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    return sessions.erase(id) != 0;
+  }
+
+  bool key_event(std::uint32_t id, std::uint8_t key, bool down) {
+    auto s = find(id);
+    if (!s) return false;
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->emu.key_event(key, down);
+    return true;
+  }
+
+  // Current screen of a session, see encode_frame.
+  bool frame(std::uint32_t id, std::vector<std::uint8_t>& out,
+             std::uint64_t& number) {
+    auto s = find(id);
+    if (!s) return false;
+    std::lock_guard<std::mutex> guard(s->lock);
+    out = encode_frame(s->emu.gfx);
+    number = s->stats.frames;
+    return true;
+  }
+
+  bool stats(std::uint32_t id, session_stats& out) {
+    auto s = find(id);
+    if (!s) return false;
+    std::lock_guard<std::mutex> guard(s->lock);
+    out = s->stats;
+    out.cycles = s->emu.cycles;
+    return true;
+  }
+
+  std::vector<std::uint32_t> ids() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::uint32_t> out;
+    for (auto& entry : sessions) out.push_back(entry.first);
+    return out;
+  }
+
+  // Runs one frame of every session on the pool and waits for all of
+  // them. Sessions created or destroyed meanwhile take part from the
+  // next call on.
+  void run_frame() {
+    std::vector<std::shared_ptr<session>> all;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      all.reserve(sessions.size());
+      for (auto& entry : sessions) all.push_back(entry.second);
+    }
+    for (auto& s : all) {
+      pool.submit([s] {
+        std::lock_guard<std::mutex> guard(s->lock);
+        std::uint64_t start = thread_cpu_ns();
+        s->emu.run_frame();
+        s->stats.cpu_ns += thread_cpu_ns() - start;
+        s->stats.frames++;
+      });
+    }
+    pool.wait_idle();
+  }
+
+  // Executes one line of the control protocol and returns the reply
+  // line. frame replies are followed by payload.
+  //
+  //   create <rom path>        ok <id>
+  //   destroy <id>             ok
+  //   key <id> <0-f> up|down   ok
+  //   frame <id>               ok <frame> <bytes>, then the encoded frame
+  //   stats <id>               ok frames=<n> cycles=<n> cpu_us=<n>
+  //   list                     ok <id>...
+  //
+  // Errors reply "error <reason>".
+  std::string command(const std::string& line,
+                      std::vector<std::uint8_t>& payload) {
+    std::istringstream in(line);
+    std::string verb;
+    in >> verb;
+    payload.clear();
+    std::uint32_t id = 0;
+    if (verb == "create") {
+      std::string path;
+      std::getline(in >> std::ws, path);
+      std::ifstream rom(path, std::ios::binary);
+      if (!rom) return "error cannot open " + path;
+      std::vector<std::uint8_t> data(std::istreambuf_iterator<char>(rom), {});
+      return "ok " + std::to_string(create(data));
+    }
+    if (verb == "list") {
+      std::string reply = "ok";
+      for (std::uint32_t i : ids()) reply += " " + std::to_string(i);
+      return reply;
+    }
+    if (!(in >> id)) return "error missing session id";
+    if (verb == "destroy") {
+      return destroy(id) ? "ok" : "error no session " + std::to_string(id);
+    }
+    if (verb == "key") {
+      std::string key, state;
+      in >> key >> state;
+      char* end = nullptr;
+      unsigned long k = std::strtoul(key.c_str(), &end, 16);
+      if (key.empty() || *end != '\0' || k > 0xF ||
+          (state != "up" && state != "down")) {
+        return "error usage: key <id> <0-f> up|down";
+      }
+      return key_event(id, k, state == "down")
+        ? "ok" : "error no session " + std::to_string(id);
+    }
+    if (verb == "frame") {
+      std::uint64_t number = 0;
+      if (!frame(id, payload, number)) {
+        return "error no session " + std::to_string(id);
+      }
+      return "ok " + std::to_string(number) + " " +
+             std::to_string(payload.size());
+    }
+    if (verb == "stats") {
+      session_stats s;
+      if (!stats(id, s)) return "error no session " + std::to_string(id);
+      return "ok frames=" + std::to_string(s.frames) +
+             " cycles=" + std::to_string(s.cycles) +
+             " cpu_us=" + std::to_string(s.cpu_ns / 1000);
+    }
+    return "error unknown command " + verb;
+  }
+
+private:
+  struct session {
+    std::uint32_t id = 0;
+    std::mutex lock;
+    emulator emu;
+    session_stats stats;
+  };
+
+  static std::uint64_t thread_cpu_ns() {
+    timespec ts;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+  }
+
+  std::shared_ptr<session> find(std::uint32_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = sessions.find(id);
+    return it == sessions.end() ? nullptr : it->second;
+  }
+
+  std::mutex lock;
+  std::map<std::uint32_t, std::shared_ptr<session>> sessions;
+  std::uint32_t next_id = 1;
+  work_stealing_pool pool;
+};
+
+// Serves the session_manager protocol on a Unix domain socket, one
+// request per line.
+class control_server {
+public:
+  explicit control_server(session_manager& manager) : manager(manager) {}
+  control_server(const control_server&) = delete;
+  control_server& operator=(const control_server&) = delete;
+  ~control_server() {
+    for (auto& c : clients) ::close(c.fd);
+    if (listener >= 0) {
+      ::close(listener);
+      ::unlink(path.c_str());
+    }
+  }
+
+  bool listen(const std::string& socket_path, std::string& error) {
+    sockaddr_un addr = {};
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+      error = "socket path too long";
+      return false;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path.c_str());
+    listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socket_path.c_str());
+    if (listener < 0 ||
+        ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(listener, 16) != 0) {
+      error = "cannot listen on " + socket_path;
+      return false;
+    }
+    path = socket_path;
+    return true;
+  }
+
+  // Accepts connections and answers complete requests until timeout_ms
+  // passed without activity.
+  void poll(int timeout_ms) {
+    std::vector<pollfd> fds;
+    fds.push_back({listener, POLLIN, 0});
+    for (auto& c : clients) fds.push_back({c.fd, POLLIN, 0});
+    if (::poll(fds.data(), fds.size(), timeout_ms) <= 0) return;
+
+    for (std::size_t i = 1; i < fds.size(); i++) {
+      if (fds[i].revents == 0) continue;
+      client& c = clients[i - 1];
+      char buf[4096];
+      ssize_t n = ::read(c.fd, buf, sizeof(buf));
+      if (n <= 0) {
+        ::close(c.fd);
+        c.fd = -1;
+        continue;
+      }
+      c.input.append(buf, n);
+      std::size_t end;
+      while ((end = c.input.find('\n')) != std::string::npos) {
+        std::string line = c.input.substr(0, end);
+        c.input.erase(0, end + 1);
+        std::vector<std::uint8_t> payload;
+        std::string reply = manager.command(line, payload) + "\n";
+        if (!write_all(c.fd, reply.data(), reply.size()) ||
+            !write_all(c.fd, payload.data(), payload.size())) {
+          ::close(c.fd);
+          c.fd = -1;
+          break;
+        }
+      }
+    }
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [](const client& c) { return c.fd < 0; }),
+                  clients.end());
+    if (fds[0].revents & POLLIN) {
+      int fd = ::accept(listener, nullptr, nullptr);
+      if (fd >= 0) clients.push_back({fd, ""});
+    }
+  }
+
+private:
+  struct client {
+    int fd;
+    std::string input;
+  };
+
+  static bool write_all(int fd, const void* data, std::size_t n) {
+    const char* p = static_cast<const char*>(data);
+    while (n > 0) {
+      // a client that went away must not kill the host with SIGPIPE
+      ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+      if (w <= 0) return false;
+      p += w;
+      n -= w;
+    }
+    return true;
+  }
+
+  session_manager& manager;
+  int listener = -1;
+  std::string path;
+  std::vector<client> clients;
+};
+
+}  // namespace chip8
+
+#endif  // HOST_H_
@@ -0,0 +1,78 @@
+#include <concepts>
+#include <cstdint>
+#include "chip8.h"
+#include "movie.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef KEYS_H_
+#define KEYS_H_
+
+namespace chip8 {
+
+// Where terminal_keys reads from: read() returns the next pending
+// character or -1 if there is none, wait() blocks until there is one.
+template <typename T>
+concept key_source = requires(T& s) {
+  { s.read() } -> std::same_as<int>;
+  s.wait();
+};
+
+// Polls a terminal once per frame and turns key presses into key events
+// for emu, through the recorder if one is given. Keys 0-9 and a-f are the
+// keypad, q quits; without emu only q is handled. Terminals do not report
+// key releases, so a key counts as held for hold_frames frames.
+template <key_source Source>
+class terminal_keys {
+public:
+  static constexpr unsigned hold_frames = 6;
+
+  Source source;
+
+  // Returns false once q was pressed.
+  bool poll(emulator* emu, movie_recorder* recorder) {
+    frame++;
+    for (std::uint8_t k = 0; k < 16; k++) {
+      if (held_until[k] == frame) send(emu, recorder, k, false);
+    }
+    for (int c = source.read(); c >= 0; c = source.read()) {
+      if (c == 'q') return false;
+      int k = -1;
+      if (c >= '0' && c <= '9') k = c - '0';
+      if (c >= 'a' && c <= 'f') k = c - 'a' + 10;
+      if (k < 0) continue;
+      if (held_until[k] <= frame) send(emu, recorder, k, true);
+      held_until[k] = frame + hold_frames;
+    }
+    return true;
+  }
+
+  // A key is held and will be released by a later poll.
+  bool holding() const {
+    for (std::uint64_t until : held_until) {
+      if (until > frame) return true;
+    }
+    return false;
+  }
+
+  // Blocks until there is input.
+  void wait() { source.wait(); }
+
+private:
+  static void send(emulator* emu, movie_recorder* recorder,
+                   std::uint8_t key, bool down) {
+    if (emu == nullptr) return;
+    if (recorder != nullptr) {
+      recorder->key_event(*emu, key, down);
+    } else {
+      emu->key_event(key, down);
+    }
+  }
+
+  std::uint64_t frame = 0;
+  std::uint64_t held_until[16] = {};
+};
+
+}  // namespace chip8
+
+#endif  // KEYS_H_
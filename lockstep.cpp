@@ -0,0 +1,194 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "archive.h"
+#include "chip8.h"
+#include "lockstep.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8lockstep [--candidate NAME] [--reference NAME] [--block N]
+//               [--cycles N] [--seeds N] [--random N] [--seed S]
+//               [--threads N] [rom...]
+//
+// Checks that a candidate engine (default run_cycles) computes exactly
+// what the reference engine does. Every ROM is run with --seeds different
+// random seeds and key inputs, and --random programs of random
+// instructions are run on top, each for --cycles instructions. Jobs are
+// spread over --threads threads (default: all cores). A ROM archive
+// (.c8ra, see chip8pack) adds every ROM in it, at its recommended speed.
+//
+// Machines are compared after every --block instructions (default 1).
+// The first divergence is narrowed down to a single instruction and
+// printed with a diff of the two machine states; the exit code is 1 then.
+//
+//   chip8lockstep --block 64 --random 100000 --cycles 100000 roms/*
+
+namespace {
+
+struct rom_image {
+  std::string name;
+  const std::uint8_t* data;
+  std::size_t size;
+  // 0 for the emulator's default
+  unsigned cycles_per_frame;
+};
+
+struct job {
+  // index into roms, or -1 for a random program
+  int rom;
+  std::uint32_t seed;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string reference_name = "reference";
+  std::string candidate_name = "run_cycles";
+  unsigned block = 1;
+  unsigned long long cycles = 1000000;
+  unsigned seeds = 16;
+  unsigned long random = 0;
+  std::uint32_t first_seed = 1;
+  unsigned threads = std::thread::hardware_concurrency();
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--candidate") == 0 && has_value) {
+      candidate_name = argv[++i];
+    } else if (std::strcmp(argv[i], "--reference") == 0 && has_value) {
+      reference_name = argv[++i];
+    } else if (std::strcmp(argv[i], "--block") == 0 && has_value) {
+      block = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--cycles") == 0 && has_value) {
+      cycles = std::strtoull(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--seeds") == 0 && has_value) {
+      seeds = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--random") == 0 && has_value) {
+      random = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+      first_seed = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+      threads = std::strtoul(argv[++i], nullptr, 0);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  const chip8::engine* reference = chip8::find_engine(reference_name);
+  const chip8::engine* candidate = chip8::find_engine(candidate_name);
+  if (reference == nullptr || candidate == nullptr ||
+      (paths.empty() && random == 0)) {
+    std::cerr << "usage: chip8lockstep [--candidate NAME] [--reference NAME] "
+                 "[--block N]\n"
+                 "                     [--cycles N] [--seeds N] [--random N] "
+                 "[--seed S]\n"
+                 "                     [--threads N] [rom...]\n"
+                 "engines:";
+    for (const chip8::engine& e : chip8::engines) std::cerr << ' ' << e.name;
+    std::cerr << std::endl;
+    return 1;
+  }
+  if (threads == 0) threads = 1;
+
+  std::vector<std::vector<std::uint8_t>> files;
+  std::vector<std::unique_ptr<chip8::rom_archive>> archives;
+  std::vector<rom_image> roms;
+  for (const std::string& path : paths) {
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".c8ra") == 0) {
+      archives.push_back(std::make_unique<chip8::rom_archive>());
+      const chip8::rom_archive& a = *archives.back();
+      std::string error;
+      if (!archives.back()->open(path, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+      }
+      for (std::size_t i = 0; i < a.count(); i++) {
+        roms.push_back({ path + ":" + std::string(a.name(i)), a.rom(i),
+                         a.entry(i).rom_size, a.entry(i).cycles_per_frame });
+      }
+      continue;
+    }
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+      std::cerr << "cannot open " << path << std::endl;
+      return 1;
+    }
+    files.emplace_back(std::istreambuf_iterator<char>(input),
+                       std::istreambuf_iterator<char>());
+  }
+  // Loose files are read first so the vector no longer moves.
+  std::size_t file = 0;
+  for (const std::string& path : paths) {
+    if (path.size() > 5 && path.compare(path.size() - 5, 5, ".c8ra") == 0) continue;
+    roms.push_back({ path, files[file].data(), files[file].size(), 0 });
+    file++;
+  }
+
+  std::vector<job> jobs;
+  for (std::size_t r = 0; r < roms.size(); r++) {
+    for (unsigned s = 0; s < seeds; s++) {
+      jobs.push_back({static_cast<int>(r), first_seed + s});
+    }
+  }
+  for (unsigned long s = 0; s < random; s++) {
+    jobs.push_back({-1, static_cast<std::uint32_t>(first_seed + s)});
+  }
+
+  std::atomic<std::size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::atomic<std::uint64_t> checked{0};
+  std::mutex report;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+      chip8::lockstep check(*reference, *candidate);
+      check.block = block;
+      auto emu = std::make_unique<chip8::emulator>();
+      const unsigned default_cycles_per_frame = emu->cycles_per_frame;
+      std::size_t i;
+      while (!failed && (i = next++) < jobs.size()) {
+        const job& j = jobs[i];
+        emu->initialize();
+        emu->seed(j.seed);
+        emu->cycles_per_frame = default_cycles_per_frame;
+        if (j.rom >= 0) {
+          const rom_image& r = roms[j.rom];
+          emu->load(r.data, r.size);
+          if (r.cycles_per_frame != 0) emu->cycles_per_frame = r.cycles_per_frame;
+        } else {
+          chip8::random_program(*emu, j.seed);
+        }
+        if (check.run(*emu, cycles, j.seed)) continue;
+
+        std::lock_guard<std::mutex> guard(report);
+        if (failed.exchange(true)) break;
+        const chip8::divergence& d = check.failure();
+        std::printf("%s diverges from %s on %s seed %u\n"
+                    "after %llu instructions at pc 0x%03X, opcode %04X %s\n%s",
+                    candidate->name, reference->name,
+                    j.rom >= 0 ? roms[j.rom].name.c_str() : "random program",
+                    j.seed, static_cast<unsigned long long>(d.cycle), d.pc,
+                    d.opcode, chip8::OpCode::as_string(d.opcode).c_str(),
+                    d.diff.c_str());
+      }
+      checked += check.checked;
+    });
+  }
+  for (auto& w : workers) w.join();
+
+  std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+  std::fprintf(stderr, "%llu instructions checked in %.2f s, %.1f M/s\n",
+               static_cast<unsigned long long>(checked.load()), t.count(),
+               checked / t.count() / 1e6);
+  return failed ? 1 : 0;
+}
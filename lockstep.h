@@ -0,0 +1,263 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "chip8.h"
+#include "fusion.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+
+namespace chip8 {
+
+// A way of running instructions. Every engine has to leave an emulator in
+// exactly the state the reference engine does after the same number of
+// instructions, which is what lockstep checks.
+struct engine {
+  const char* name;
+  void (*run)(emulator& emu, std::uint64_t n);
+};
+
+// fetch and execute one instruction at a time, the semantics of
+// emulateCycle without its wall clock timers.
+inline void run_reference(emulator& emu, std::uint64_t n) {
+  for (std::uint64_t i = 0; i < n; i++) {
+    emu.opcode = emu.fetch();
+    emu.execute(emu.opcode);
+    emu.cycles++;
+  }
+}
+
+inline void run_batched(emulator& emu, std::uint64_t n) {
+  emu.run_cycles(n);
+}
+
+inline void run_fused(emulator& emu, std::uint64_t n) {
+  thread_local fused_engine fused;
+  fused.run_cycles(emu, n);
+}
+
+constexpr engine engines[] = {
+  { "reference", run_reference },
+  // run_cycles, including the idle loop skipping
+  { "run_cycles", run_batched },
+  // fused_engine superinstructions
+  { "fused", run_fused },
+};
+
+inline const engine* find_engine(const std::string& name) {
+  for (const engine& e : engines) {
+    if (name == e.name) return &e;
+  }
+  return nullptr;
+}
+
+// Lists every difference in machine state between a and b, one per line,
+// or returns an empty string if there is none.
+inline std::string state_diff(const emulator& a, const emulator& b) {
+  std::string out;
+  char line[96];
+  auto field = [&](const char* name, unsigned x, unsigned y) {
+    if (x == y) return;
+    std::snprintf(line, sizeof(line), "%s: 0x%X != 0x%X\n", name, x, y);
+    out += line;
+  };
+  field("pc", a.pc, b.pc);
+  field("I", a.I, b.I);
+  field("sp", a.sp, b.sp);
+  field("opcode", a.opcode, b.opcode);
+  field("delay_timer", a.delay_timer, b.delay_timer);
+  field("sound_timer", a.sound_timer, b.sound_timer);
+  field("random_state", a.random_state, b.random_state);
+  field("keys", a.keys, b.keys);
+  field("dirty_pages", a.dirty_pages, b.dirty_pages);
+  field("dirty_rows", a.dirty_rows, b.dirty_rows);
+  if (a.cycles != b.cycles) {
+    std::snprintf(line, sizeof(line), "cycles: %llu != %llu\n",
+                  static_cast<unsigned long long>(a.cycles),
+                  static_cast<unsigned long long>(b.cycles));
+    out += line;
+  }
+  for (int i = 0; i < 16; i++) {
+    char name[16];
+    std::snprintf(name, sizeof(name), "V%X", i);
+    field(name, a.V[i], b.V[i]);
+  }
+  for (int i = 0; i < 16; i++) {
+    char name[16];
+    std::snprintf(name, sizeof(name), "stack[%d]", i);
+    field(name, a.stack[i], b.stack[i]);
+  }
+  // Memory and screen differences are reported as ranges.
+  for (std::size_t i = 0; i < memory_size; i++) {
+    if (a.memory[i] == b.memory[i]) continue;
+    std::size_t end = i;
+    while (end < memory_size && a.memory[end] != b.memory[end]) end++;
+    std::snprintf(line, sizeof(line), "memory[0x%03zX..0x%03zX]: %02X.. != %02X..\n",
+                  i, end - 1, a.memory[i], b.memory[i]);
+    out += line;
+    i = end;
+  }
+  for (int y = 0; y < 32; y++) {
+    if (std::memcmp(a.gfx[y], b.gfx[y], sizeof(a.gfx[y])) == 0) continue;
+    std::snprintf(line, sizeof(line), "gfx row %d differs\n", y);
+    out += line;
+  }
+  if (a.gfx_hash != b.gfx_hash) {
+    std::snprintf(line, sizeof(line), "gfx_hash: %016llX != %016llX\n",
+                  static_cast<unsigned long long>(a.gfx_hash),
+                  static_cast<unsigned long long>(b.gfx_hash));
+    out += line;
+  }
+  return out;
+}
+
+// Where a candidate engine first left the reference.
+struct divergence {
+  // instructions run before the one that diverged
+  std::uint64_t cycle = 0;
+  std::uint16_t pc = 0;
+  std::uint16_t opcode = 0;
+  // state_diff of reference and candidate after it
+  std::string diff;
+};
+
+// Runs a reference and a candidate engine side by side from the same
+// state, compares the machines after every block of instructions and
+// narrows a mismatch down to the first instruction that differs.
+//
+// Runs are split into frames of cycles_per_frame instructions with a
+// timer tick after each, like run_frame. Key presses and releases come
+// from input_seed at frame boundaries, so loops waiting for keys and
+// timers are exercised as well.
+class lockstep {
+public:
+  lockstep(const engine& reference, const engine& candidate)
+      : reference(reference), candidate(candidate),
+        ref(std::make_unique<emulator>()), cand(std::make_unique<emulator>()),
+        before(std::make_unique<emulator>()) {}
+
+  // Instructions between comparisons. 1 checks every instruction, larger
+  // blocks let a candidate use what it does across instructions, e.g. the
+  // idle loop skipping of run_cycles.
+  unsigned block = 1;
+
+  // Runs n instructions on both engines starting from start. Returns
+  // false and fills failure() at the first difference.
+  bool run(const emulator& start, std::uint64_t n, std::uint32_t input_seed) {
+    copy(*ref, start);
+    copy(*cand, start);
+    // CXNN from the wall clock would differ between the two.
+    if (start.random_state == 0) {
+      ref->seed(1);
+      cand->seed(1);
+    }
+    std::uint32_t input = input_seed ? input_seed : 1;
+    const std::uint64_t per_frame =
+      start.cycles_per_frame ? start.cycles_per_frame : 1;
+    std::uint64_t done = 0;
+    while (done < n) {
+      input ^= input << 13;
+      input ^= input >> 17;
+      input ^= input << 5;
+      if ((input & 3) == 0) {
+        std::uint8_t key = (input >> 8) & 0xF;
+        bool down = ((ref->keys >> key) & 1) == 0;
+        ref->key_event(key, down);
+        cand->key_event(key, down);
+      }
+      std::uint64_t frame_end = done + per_frame < n ? done + per_frame : n;
+      while (done < frame_end) {
+        std::uint64_t len = frame_end - done < block ? frame_end - done : block;
+        if (len == 0) len = 1;
+        copy(*before, *ref);
+        reference.run(*ref, len);
+        candidate.run(*cand, len);
+        checked += len;
+        if (!same(*ref, *cand)) {
+          narrow(len);
+          return false;
+        }
+        done += len;
+      }
+      ref->tick_timers();
+      cand->tick_timers();
+    }
+    return true;
+  }
+
+  const divergence& failure() const { return found; }
+
+  // Instructions compared so far, over all runs.
+  std::uint64_t checked = 0;
+
+private:
+  static void copy(emulator& to, const emulator& from) {
+    to.copy_state(from);
+    to.cycles = from.cycles;
+    to.cycles_per_frame = from.cycles_per_frame;
+  }
+
+  static bool same(const emulator& a, const emulator& b) {
+    return a.pc == b.pc && a.I == b.I && a.sp == b.sp &&
+           a.opcode == b.opcode && a.cycles == b.cycles &&
+           a.delay_timer == b.delay_timer && a.sound_timer == b.sound_timer &&
+           a.random_state == b.random_state && a.keys == b.keys &&
+           a.dirty_pages == b.dirty_pages && a.dirty_rows == b.dirty_rows &&
+           std::memcmp(a.V, b.V, sizeof(a.V)) == 0 &&
+           std::memcmp(a.stack, b.stack, sizeof(a.stack)) == 0 &&
+           std::memcmp(a.memory, b.memory, sizeof(a.memory)) == 0 &&
+           std::memcmp(a.gfx, b.gfx, sizeof(a.gfx)) == 0 &&
+           a.gfx_hash == b.gfx_hash;
+  }
+
+  // The block starting at before diverged somewhere in its first len
+  // instructions. Finds the shortest prefix the engines disagree on.
+  void narrow(std::uint64_t len) {
+    std::uint64_t k = 1;
+    for (; k < len; k++) {
+      copy(*ref, *before);
+      copy(*cand, *before);
+      reference.run(*ref, k);
+      candidate.run(*cand, k);
+      if (!same(*ref, *cand)) break;
+    }
+    copy(*ref, *before);
+    reference.run(*ref, k - 1);
+    found.cycle = ref->cycles;
+    found.pc = ref->pc & 0x0FFF;
+    found.opcode = ref->fetch();
+    reference.run(*ref, 1);
+    copy(*cand, *before);
+    candidate.run(*cand, k);
+    found.diff = state_diff(*ref, *cand);
+  }
+
+  const engine& reference;
+  const engine& candidate;
+  std::unique_ptr<emulator> ref;
+  std::unique_ptr<emulator> cand;
+  std::unique_ptr<emulator> before;
+  divergence found;
+};
+
+// Fills the address space from 0x200 with random instructions, for
+// programs no ROM would contain.
+inline void random_program(emulator& emu, std::uint32_t seed) {
+  std::uint32_t r = seed ? seed : 1;
+  std::uint8_t code[address_space - 0x200];
+  for (std::size_t i = 0; i < sizeof(code); i++) {
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    code[i] = r >> 24;
+  }
+  emu.load(code, sizeof(code));
+}
+
+}  // namespace chip8
+
+#endif  // LOCKSTEP_H_
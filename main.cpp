@@ -1,4 +1,11 @@
 #include "chip8.h"
+#include "analysis.h"
+#include "debugger.h"
+#include "shm.h"
+#include "movie.h"
+#include "keys.h"
+#include "runahead.h"
+#include "trace.h"
 #include <iostream>
 #include <memory>
 #include <chrono>
@@ -7,39 +14,117 @@
 #include <iostream>
 #include <fstream>
 #include <bitset>
+#include <cctype>
+#include <cstdlib>
+#include <string>
 
-class curses_key_interface : public chip8::KeyInterface {
-public:
-  curses_key_interface() { };
-  std::uint8_t getKey(int to) noexcept {
-    timeout(to);
-    switch(getch()){
-	  case 49: return 1;
-	  case 50: return 2;
-	  case 51: return 3;
-	  case 52: return 4;
-	  case 53: return 5;
-	  case 54: return 6;
-	  case 55: return 7;
-	  case 56: return 8;
-	  case 57: return 9;
-	  case 48: return 0;
-	  case 97: return 0xA;
-	  case 98: return 0xB;
-	  case 99: return 0xC;
-	  case 100: return 0xD;
-	  case 101: return 0xE;
-	  case 102: return 0xF;
+// terminal_keys reading from curses.
+struct curses_source {
+  int read() {
+    timeout(0);
+    int c = getch();
+    return c == ERR ? -1 : c;
   }
+  void wait() {
+    timeout(-1);
+    int c = getch();
+    if (c != ERR) ungetch(c);
   }
 };
 
-int main() {
+// Parses ADDR or ADDR:REST where ADDR is decimal or 0x hex.
+static std::uint16_t parse_address(const std::string& spec, std::string& rest) {
+  std::size_t colon = spec.find(':');
+  rest = colon == std::string::npos ? "" : spec.substr(colon + 1);
+  return std::strtoul(spec.substr(0, colon).c_str(), nullptr, 0);
+}
+
+// usage: main [--break ADDR[:COND]] [--break-when COND]
+//             [--watch-read ADDR[:LEN]] [--watch-write ADDR[:LEN]]
+//             [--watch-reg V0..VF|I] [--shm SEGMENT]
+//             [--record MOVIE | --replay MOVIE] [--run-ahead N]
+//             [--trace FILE] [rom]
+//
+// When a break or watch triggers, press s to step or c to continue.
+// --shm publishes the state after every frame for chip8view. --record
+// saves the key presses into a movie when q quits, --replay plays one
+// back instead of reading the keyboard. --run-ahead shows the screen N
+// frames ahead of the emulation to hide input latency, see
+// chip8::run_ahead; its cost per frame is shown and printed on exit.
+// --trace writes the input, emulate, render and sleep phases of every
+// frame as Chrome trace JSON for ui.perfetto.dev and prints frame time
+// and jitter histograms on exit.
+int main(int argc, char** argv) {
+  std::string rom = "../roms/rom";
+  chip8::debugger dbg;
+  bool debugging = false;
+  chip8::shm_publisher publisher;
+  std::string record;
+  std::string replay;
+  chip8::run_ahead ahead(0);
+  std::string trace_path;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string rest;
+    std::string error;
+    bool ok = true;
+    if (arg == "--shm" && i + 1 < argc) {
+      if (!publisher.open(argv[++i], error)) {
+        std::cerr << error << std::endl;
+        return 1;
+      }
+      continue;
+    } else if (arg == "--record" && i + 1 < argc) {
+      record = argv[++i];
+      continue;
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay = argv[++i];
+      continue;
+    } else if (arg == "--run-ahead" && i + 1 < argc) {
+      ahead.frames = std::strtoul(argv[++i], nullptr, 0);
+      continue;
+    } else if (arg == "--trace" && i + 1 < argc) {
+      trace_path = argv[++i];
+      continue;
+    } else if (arg == "--break" && i + 1 < argc) {
+      std::uint16_t addr = parse_address(argv[++i], rest);
+      ok = dbg.add_breakpoint(addr, rest, error);
+    } else if (arg == "--break-when" && i + 1 < argc) {
+      ok = dbg.break_when(argv[++i], error);
+    } else if (arg == "--watch-read" && i + 1 < argc) {
+      std::uint16_t addr = parse_address(argv[++i], rest);
+      dbg.watch_read(addr, rest.empty() ? 1 : std::atoi(rest.c_str()));
+    } else if (arg == "--watch-write" && i + 1 < argc) {
+      std::uint16_t addr = parse_address(argv[++i], rest);
+      dbg.watch_write(addr, rest.empty() ? 1 : std::atoi(rest.c_str()));
+    } else if (arg == "--watch-reg" && i + 1 < argc) {
+      std::string reg = argv[++i];
+      if (reg == "I" || reg == "i") {
+        ok = dbg.watch_register(16, error);
+      } else if (reg.size() == 2 && (reg[0] == 'V' || reg[0] == 'v') &&
+                 std::isxdigit(static_cast<unsigned char>(reg[1]))) {
+        ok = dbg.watch_register(std::strtoul(reg.c_str() + 1, nullptr, 16),
+                                error);
+      } else {
+        ok = false;
+        error = "unknown register " + reg;
+      }
+    } else {
+      rom = arg;
+      continue;
+    }
+    if (!ok) {
+      std::cerr << arg << ": " << error << std::endl;
+      return 1;
+    }
+    debugging = true;
+  }
+
   chip8::emulator emu;
-  emu.set_keyinterface(std::make_unique<curses_key_interface>());
   emu.initialize();
+  if (debugging) dbg.attach(emu);
 
-  std::ifstream input( "../roms/rom", std::ios::binary );
+  std::ifstream input( rom, std::ios::binary );
   std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(input), {});
   std::ofstream output( "output", std::ios::binary );
   
@@ -49,6 +134,34 @@ int main() {
   }
   output.close();
 
+  chip8::movie movie;
+  chip8::movie_player player(movie);
+  chip8::movie_recorder recorder;
+  if (!replay.empty()) {
+    std::string error;
+    if (!movie.load(replay, error) ||
+        !player.start(emu, buffer.data(), buffer.size(), error)) {
+      std::cerr << replay << ": " << error << std::endl;
+      return 1;
+    }
+  } else if (!record.empty()) {
+    recorder.start(emu, buffer.data(), buffer.size(),
+                   std::chrono::system_clock::now().time_since_epoch().count());
+  }
+  chip8::terminal_keys<curses_source> keys;
+
+  std::unique_ptr<chip8::tracer> tracer;
+  chip8::frame_stats frame_stats;
+  if (!trace_path.empty()) {
+    tracer = std::make_unique<chip8::tracer>();
+    tracer->name_thread("main");
+  }
+  chip8::tracer* trace = tracer.get();
+
+  // Used by the program window to tell code from sprite data.
+  chip8::analysis::rom_analysis analysis =
+    chip8::analysis::analyze(emu, 0x200 + buffer.size());
+
   int height  {32};
   int width   {64};
   int start_y {0};
@@ -68,53 +181,142 @@ int main() {
   refresh();
 
 
-  while(1) {
-    emu.emulateCycle();
-    for( int k = 0; k < 32; k++) {
-      for( int m = 0; m < 64; m++ ) {
-          if( emu.gfx[k][m] )
+  // One iteration per 60 Hz frame. The screen is only redrawn when the
+  // frame drew something.
+  bool redraw = true;
+  auto next_frame = std::chrono::steady_clock::now();
+  while(true) {
+    if (trace != nullptr) frame_stats.frame(chip8::tracer::now_ns());
+    chip8::trace_scope frame_scope(trace, "frame");
+    bool running;
+    {
+      chip8::trace_scope scope(trace, "input");
+      // When replaying the keyboard only quits, the keys come from the movie.
+      running = keys.poll(replay.empty() ? &emu : nullptr,
+                          record.empty() ? nullptr : &recorder);
+    }
+    if (!running) break;
+    chip8::run_events ev;
+    {
+      chip8::trace_scope scope(trace, "emulate");
+      if (!replay.empty()) {
+        ev = player.run_frame(emu);
+      } else {
+        ev = emu.run_frame();
+      }
+    }
+    if( publisher.is_open() ) {
+      chip8::trace_scope scope(trace, "publish");
+      publisher.publish(emu);
+    }
+    bool changed;
+    {
+      chip8::trace_scope scope(trace, "run-ahead");
+      changed = ahead.update(emu, ev);
+    }
+    chip8::trace_scope render_scope(trace, "render");
+    if( changed || redraw ) {
+      const chip8::emulator& shown = ahead.screen();
+      for( int k = 0; k < 32; k++) {
+        for( int m = 0; m < 64; m++ ) {
+          if( shown.gfx[k][m] )
             mvwprintw(main_window, k, m, "%c", 'x');
-	  else
+          else
             mvwprintw(main_window, k, m, "%c", ' ');
+        }
       }
-      box(program_window, 0, 0);
+      redraw = false;
+    }
+    box(program_window, 0, 0);
 
-      for( int l = 0; l < 16; l++ ) {
-        mvwprintw(memory_window, l+1, 1, "V[0x%x] = 0x%02x", l, emu.V[l]);
-        mvwprintw(memory_window, l+1, 40, "stack[0x%x] = 0x%02x", l, emu.stack[l]);
-      }
+    for( int l = 0; l < 16; l++ ) {
+      mvwprintw(memory_window, l+1, 1, "V[0x%x] = 0x%02x", l, emu.V[l]);
+      mvwprintw(memory_window, l+1, 40, "stack[0x%x] = 0x%02x", l, emu.stack[l]);
+    }
 
-      mvwprintw(memory_window, 1, 20, "I  = 0x%02x", emu.I);
-      mvwprintw(memory_window, 2, 20, "pc = 0x%02x", emu.pc);
-      mvwprintw(memory_window, 4, 20, "delay_timer = 0x%02x", emu.delay_timer);
-      mvwprintw(memory_window, 5, 20, "sound_timer = 0x%02x", emu.sound_timer);
-
-      for( int l = -28; l < 29; l += 2 ) {
-        if( l != 0 )
-          mvwprintw(program_window, l/2+1+14, 1, "%03d | 0x%02x%02x      %40s", l/2, 
-                    emu.memory[emu.pc+l], emu.memory[emu.pc+l+1], 
-		    chip8::OpCode::as_string( 
-			    (emu.memory[emu.pc+l] << 8 )+emu.memory[emu.pc+l+1] ).c_str() );
-        else 
-          mvwprintw(program_window, l/2+1+14, 1, "%03d | 0x%02x%02x <--- %40s", l/2, 
-                    emu.memory[emu.pc+l], emu.memory[emu.pc+l+1],
-		    chip8::OpCode::as_string( 
-			    (emu.memory[emu.pc+l] << 8 )+emu.memory[emu.pc+l+1] ).c_str() );
-      }
+    mvwprintw(memory_window, 1, 20, "I  = 0x%02x", emu.I);
+    mvwprintw(memory_window, 2, 20, "pc = 0x%02x", emu.pc);
+    mvwprintw(memory_window, 4, 20, "delay_timer = 0x%02x", emu.delay_timer);
+    mvwprintw(memory_window, 5, 20, "sound_timer = 0x%02x", emu.sound_timer);
+    if (ahead.frames != 0) {
+      mvwprintw(memory_window, 1, 70, "%s", ahead.report().c_str());
+    }
+
+    for( int l = -28; l < 29; l += 2 ) {
+      if( !analysis.is_code((emu.pc+l) & 0x0FFF) )
+        mvwprintw(program_window, l/2+1+14, 1, "%03d | 0x%02x%02x %s %40s", l/2,
+                  emu.memory[(emu.pc+l) & 0x0FFF], emu.memory[(emu.pc+l+1) & 0x0FFF],
+                  l != 0 ? "    " : "<---",
+                  chip8::analysis::to_string(analysis.kind[(emu.pc+l) & 0x0FFF]) );
+      else if( l != 0 )
+        mvwprintw(program_window, l/2+1+14, 1, "%03d | 0x%02x%02x      %40s", l/2,
+                  emu.memory[(emu.pc+l) & 0x0FFF], emu.memory[(emu.pc+l+1) & 0x0FFF],
+                  chip8::OpCode::as_string(
+                    (emu.memory[(emu.pc+l) & 0x0FFF] << 8 )+emu.memory[(emu.pc+l+1) & 0x0FFF] ).c_str() );
+      else
+        mvwprintw(program_window, l/2+1+14, 1, "%03d | 0x%02x%02x <--- %40s", l/2,
+                  emu.memory[(emu.pc+l) & 0x0FFF], emu.memory[(emu.pc+l+1) & 0x0FFF],
+                  chip8::OpCode::as_string(
+                    (emu.memory[(emu.pc+l) & 0x0FFF] << 8 )+emu.memory[(emu.pc+l+1) & 0x0FFF] ).c_str() );
+    }
 
+    if (ev.breakpoint) {
+      mvwprintw(memory_window, 7, 20, "%-19s", dbg.describe().c_str());
+      mvwprintw(memory_window, 8, 20, "s: step c: continue");
     }
-    
     wrefresh(main_window);
     wrefresh(program_window);
     wrefresh(memory_window);
     refresh();
-    timeout(-1);
-    //int test = getch();
-    //mvwprintw(memory_window, 10, 10, "getch = %d", test);
-    flushinp();
-    std::this_thread::sleep_for(std::chrono::milliseconds(13));
+    render_scope.end();
+    if (ev.breakpoint) {
+      chip8::trace_scope scope(trace, "debugger");
+      timeout(-1);
+      int c;
+      do {
+        c = getch();
+      } while (c != 's' && c != 'c');
+      if (c == 's') {
+        dbg.step();
+      } else {
+        dbg.resume();
+      }
+      mvwprintw(memory_window, 7, 20, "%-19s", "");
+      mvwprintw(memory_window, 8, 20, "%-19s", "");
+      frame_stats.pause();
+      next_frame = std::chrono::steady_clock::now();
+    }
+    // Nothing changes before the next key press, so sleep until then.
+    if (replay.empty() && ev.waiting_for_input && !ev.breakpoint &&
+        emu.delay_timer == 0 && emu.sound_timer == 0 && !keys.holding()) {
+      chip8::trace_scope scope(trace, "input wait");
+      keys.wait();
+      frame_stats.pause();
+      next_frame = std::chrono::steady_clock::now();
+    }
+    next_frame += std::chrono::microseconds(16667);
+    auto now = std::chrono::steady_clock::now();
+    if (next_frame < now) next_frame = now;
+    chip8::trace_scope scope(trace, "sleep");
+    std::this_thread::sleep_until(next_frame);
   }
 
-  int a = 0;
   endwin();
+  if (ahead.frames != 0) std::cerr << ahead.report() << std::endl;
+  if (tracer) {
+    std::string error;
+    if (!tracer->write(trace_path, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    std::cerr << frame_stats.report();
+  }
+  if (!record.empty()) {
+    std::string error;
+    if (!recorder.finish(emu).save(record, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  return 0;
 }
@@ -0,0 +1,232 @@
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef MOVIE_H_
+#define MOVIE_H_
+
+namespace chip8 {
+
+// A key press or release at a cycle counted from the start of the
+// recording.
+struct movie_event {
+  std::uint64_t cycle;
+  std::uint8_t key;
+  bool down;
+};
+
+// Everything needed to replay a session: the key events, the random
+// seed, the frame length and a hash of the ROM it was recorded with.
+//
+// File format, integers little endian, varints LEB128:
+//
+//   "C8MV" version:u8 seed:u32 cycles_per_frame:u16 rom_hash:u32
+//   length:varint count:varint
+//   count x { cycle delta:varint  key | down << 7 :u8 }
+struct movie {
+  static constexpr std::uint8_t version = 1;
+
+  std::uint32_t seed = 1;
+  std::uint16_t cycles_per_frame = 10;
+  std::uint32_t rom_hash = 0;
+  // cycles covered by the recording
+  std::uint64_t length = 0;
+  std::vector<movie_event> events;
+
+  std::vector<std::uint8_t> encode() const {
+    std::vector<std::uint8_t> out = { 'C', '8', 'M', 'V', version };
+    put(out, seed, 4);
+    put(out, cycles_per_frame, 2);
+    put(out, rom_hash, 4);
+    put_varint(out, length);
+    put_varint(out, events.size());
+    std::uint64_t last = 0;
+    for (const movie_event& e : events) {
+      put_varint(out, e.cycle - last);
+      out.push_back((e.key & 0x0F) | (e.down ? 0x80 : 0));
+      last = e.cycle;
+    }
+    return out;
+  }
+
+  bool decode(const std::uint8_t* data, std::size_t size, std::string& error) {
+    const std::uint8_t* p = data;
+    const std::uint8_t* end = data + size;
+    if (size < 15 || p[0] != 'C' || p[1] != '8' || p[2] != 'M' || p[3] != 'V') {
+      error = "not a movie file";
+      return false;
+    }
+    if (p[4] != version) {
+      error = "unsupported movie version";
+      return false;
+    }
+    p += 5;
+    seed = get(p, 4);
+    cycles_per_frame = get(p, 2);
+    rom_hash = get(p, 4);
+    std::uint64_t count = 0;
+    if (!get_varint(p, end, length) || !get_varint(p, end, count)) {
+      error = "truncated movie";
+      return false;
+    }
+    events.clear();
+    std::uint64_t cycle = 0;
+    for (std::uint64_t i = 0; i < count; i++) {
+      std::uint64_t delta = 0;
+      if (!get_varint(p, end, delta) || p == end) {
+        error = "truncated movie";
+        return false;
+      }
+      cycle += delta;
+      events.push_back({cycle, static_cast<std::uint8_t>(*p & 0x0F),
+                        (*p & 0x80) != 0});
+      p++;
+    }
+    return true;
+  }
+
+  bool save(const std::string& path, std::string& error) const {
+    std::vector<std::uint8_t> data = encode();
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!out) {
+      error = "cannot write " + path;
+      return false;
+    }
+    return true;
+  }
+
+  bool load(const std::string& path, std::string& error) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      error = "cannot open " + path;
+      return false;
+    }
+    std::vector<std::uint8_t> data(std::istreambuf_iterator<char>(in), {});
+    return decode(data.data(), data.size(), error);
+  }
+
+private:
+  static void put(std::vector<std::uint8_t>& out, std::uint32_t v, int n) {
+    for (int i = 0; i < n; i++) out.push_back(v >> (8 * i));
+  }
+  static void put_varint(std::vector<std::uint8_t>& out, std::uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back((v & 0x7F) | 0x80);
+      v >>= 7;
+    }
+    out.push_back(v);
+  }
+  static std::uint32_t get(const std::uint8_t*& p, int n) {
+    std::uint32_t v = 0;
+    for (int i = 0; i < n; i++) v |= static_cast<std::uint32_t>(*p++) << (8 * i);
+    return v;
+  }
+  static bool get_varint(const std::uint8_t*& p, const std::uint8_t* end,
+                         std::uint64_t& v) {
+    v = 0;
+    for (int shift = 0; p != end && shift < 64; shift += 7) {
+      std::uint8_t b = *p++;
+      v |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+      if ((b & 0x80) == 0) return true;
+    }
+    return false;
+  }
+};
+
+// Passes key events on to an emulator and records them. The emulator
+// must not have a key interface set, so that all input goes through here.
+class movie_recorder {
+public:
+  // Seeds the emulator and starts counting cycles from now.
+  void start(emulator& emu, const std::uint8_t* rom, std::size_t size,
+             std::uint32_t seed) {
+    recording = movie();
+    recording.seed = seed ? seed : 1;
+    recording.cycles_per_frame = emu.cycles_per_frame;
+    recording.rom_hash = hash_rom(rom, size);
+    origin = emu.cycles;
+    emu.seed(recording.seed);
+  }
+
+  void key_event(emulator& emu, std::uint8_t key, bool down) {
+    emu.key_event(key, down);
+    recording.events.push_back({emu.cycles - origin, key, down});
+  }
+
+  const movie& finish(const emulator& emu) {
+    recording.length = emu.cycles - origin;
+    return recording;
+  }
+
+private:
+  movie recording;
+  std::uint64_t origin = 0;
+};
+
+// Feeds a movie back into an emulator at the cycles it was recorded at.
+class movie_player {
+public:
+  explicit movie_player(const movie& m) : recording(m) {}
+
+  // Seeds the emulator like the recording was. Call it on an emulator in
+  // the state the recording started from, with the ROM loaded.
+  bool start(emulator& emu, const std::uint8_t* rom, std::size_t size,
+             std::string& error) {
+    if (hash_rom(rom, size) != recording.rom_hash) {
+      error = "movie was recorded with a different ROM";
+      return false;
+    }
+    emu.seed(recording.seed);
+    emu.cycles_per_frame = recording.cycles_per_frame;
+    origin = emu.cycles;
+    next = 0;
+    return true;
+  }
+
+  // emulator::run_frame with the events of the movie applied before the
+  // instruction they were recorded at.
+  run_events run_frame(emulator& emu, bool test = false) {
+    run_events ev;
+    std::uint64_t end = emu.cycles + emu.cycles_per_frame;
+    while (true) {
+      apply(emu);
+      if (emu.cycles >= end) break;
+      std::uint64_t n = end - emu.cycles;
+      if (next < recording.events.size()) {
+        std::uint64_t until = origin + recording.events[next].cycle - emu.cycles;
+        if (until < n) n = until;
+      }
+      ev |= emu.run_cycles(n, test);
+      if (ev.breakpoint) return ev;
+    }
+    return emu.end_frame(ev);
+  }
+
+  // The recording has been played to its end.
+  bool finished(const emulator& emu) const {
+    return emu.cycles - origin >= recording.length;
+  }
+
+private:
+  void apply(emulator& emu) {
+    while (next < recording.events.size() &&
+           origin + recording.events[next].cycle <= emu.cycles) {
+      emu.key_event(recording.events[next].key, recording.events[next].down);
+      next++;
+    }
+  }
+
+  const movie& recording;
+  std::uint64_t origin = 0;
+  std::size_t next = 0;
+};
+
+}  // namespace chip8
+
+#endif  // MOVIE_H_
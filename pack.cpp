@@ -0,0 +1,173 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "analysis.h"
+#include "archive.h"
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8pack -o ARCHIVE [--cycles-per-frame N] [--quirks MASK]
+//           [--keymap KEYS] [--analyze] (rom|directory)...
+// chip8pack --list ARCHIVE
+//
+// Packs ROMs into one archive for chip8::rom_archive. Directories add
+// every file in them but descriptions, movies, save states and archives
+// (.txt, .c8mv, .c8s, .c8ra). An entry is named after its file without the
+// extension; a .txt file of the same name becomes its description.
+// Options apply to the ROMs after them, e.g.
+//
+//   chip8pack -o roms.c8ra --analyze roms --cycles-per-frame 20 fast.ch8
+//
+// --keymap gives the host key of each CHIP-8 key 0-F, --analyze stores
+// the basic blocks found by chip8::analysis. --list prints the entries.
+
+namespace {
+
+namespace fs = std::filesystem;
+
+bool is_rom(const fs::path& path) {
+  const fs::path ext = path.extension();
+  return ext != ".txt" && ext != ".c8mv" && ext != ".c8s" && ext != ".c8ra";
+}
+
+bool read_file(const fs::path& path, std::vector<std::uint8_t>& data) {
+  std::ifstream input(path, std::ios::binary);
+  if (!input) return false;
+  data.assign(std::istreambuf_iterator<char>(input), {});
+  return true;
+}
+
+struct settings {
+  std::uint16_t cycles_per_frame = 10;
+  std::uint32_t quirks = chip8::emulator_quirks;
+  std::string keymap = "0123456789abcdef";
+  bool analyze = false;
+};
+
+bool add_rom(const fs::path& path, const settings& s,
+             std::vector<chip8::archive_rom>& roms, std::string& error) {
+  chip8::archive_rom r;
+  r.name = path.stem().string();
+  if (!read_file(path, r.data)) {
+    error = "cannot open " + path.string();
+    return false;
+  }
+  if (r.data.size() > chip8::address_space - 0x200) {
+    error = path.string() + " is too large for a ROM";
+    return false;
+  }
+  r.cycles_per_frame = s.cycles_per_frame;
+  r.quirks = s.quirks;
+  std::memcpy(r.keymap, s.keymap.data(), sizeof(r.keymap));
+  std::vector<std::uint8_t> text;
+  fs::path description = path;
+  description.replace_extension(".txt");
+  if (description != path && read_file(description, text)) {
+    r.description.assign(text.begin(), text.end());
+  }
+  if (s.analyze) {
+    auto emu = std::make_unique<chip8::emulator>();
+    emu->initialize();
+    emu->load(r.data.data(), r.data.size());
+    chip8::analysis::rom_analysis a =
+      chip8::analysis::analyze(*emu, 0x200 + r.data.size());
+    for (const auto& b : a.blocks) r.blocks.emplace_back(b.second.start, b.second.end);
+  }
+  roms.push_back(std::move(r));
+  return true;
+}
+
+int list(const char* path) {
+  chip8::rom_archive archive;
+  std::string error;
+  if (!archive.open(path, error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  for (std::size_t i = 0; i < archive.count(); i++) {
+    const chip8::archive_entry& e = archive.entry(i);
+    std::printf("%08X %5u bytes %3u cycles/frame quirks %02X keys %.16s "
+                "%4u blocks  %.*s\n",
+                e.rom_hash, e.rom_size, e.cycles_per_frame, e.quirks,
+                e.keymap, e.block_count,
+                static_cast<int>(archive.name(i).size()), archive.name(i).data());
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* output = nullptr;
+  settings s;
+  std::vector<chip8::archive_rom> roms;
+  std::string error;
+  bool usage = argc < 2;
+  for (int i = 1; i < argc && !usage; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--list") == 0 && has_value) {
+      return list(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "-o") == 0 && has_value) {
+      output = argv[++i];
+    } else if (std::strcmp(argv[i], "--cycles-per-frame") == 0 && has_value) {
+      s.cycles_per_frame = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--quirks") == 0 && has_value) {
+      s.quirks = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--keymap") == 0 && has_value) {
+      s.keymap = argv[++i];
+      usage = s.keymap.size() != 16;
+    } else if (std::strcmp(argv[i], "--analyze") == 0) {
+      s.analyze = true;
+    } else if (fs::is_directory(argv[i])) {
+      std::set<fs::path> files;
+      for (const auto& f : fs::directory_iterator(argv[i])) {
+        if (f.is_regular_file() && is_rom(f.path())) {
+          files.insert(f.path());
+        }
+      }
+      for (const fs::path& f : files) {
+        if (!add_rom(f, s, roms, error)) {
+          std::cerr << error << std::endl;
+          return 1;
+        }
+      }
+    } else if (!add_rom(argv[i], s, roms, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  if (usage || output == nullptr) {
+    std::cerr << "usage: chip8pack -o ARCHIVE [--cycles-per-frame N] "
+                 "[--quirks MASK]\n"
+                 "                 [--keymap KEYS] [--analyze] "
+                 "(rom|directory)...\n"
+                 "       chip8pack --list ARCHIVE" << std::endl;
+    return 1;
+  }
+  std::set<std::string> names;
+  for (const chip8::archive_rom& r : roms) {
+    if (!names.insert(r.name).second) {
+      std::cerr << "two ROMs are called " << r.name << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<std::uint8_t> archive = chip8::encode_archive(std::move(roms));
+  std::ofstream out(output, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(archive.data()), archive.size());
+  if (!out.flush()) {
+    std::cerr << "cannot write " << output << std::endl;
+    return 1;
+  }
+  std::fprintf(stderr, "%zu ROMs, %zu bytes\n", names.size(), archive.size());
+  return 0;
+}
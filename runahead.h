@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef RUNAHEAD_H_
+#define RUNAHEAD_H_
+
+namespace chip8 {
+
+// Hides input latency: after every real frame a snapshot of the emulator
+// runs frames frames further with the keys held now, and the front-end
+// shows that screen instead. A key press then shows up on the first frame
+// a game reacts to it instead of frames later. The real emulator is
+// never touched, so restoring after the speculative frames costs nothing.
+class run_ahead {
+public:
+  explicit run_ahead(unsigned frames = 1)
+      : frames(frames), ahead(std::make_unique<emulator>()) {}
+
+  // Frames to run ahead, 0 shows the real screen.
+  unsigned frames;
+
+  // Runs the speculative frames from emu, which has just run a frame
+  // that returned ev. Returns whether the screen to show may have
+  // changed since the last call.
+  bool update(const emulator& emu, const run_events& ev) {
+    if (frames == 0 || emu.debug != nullptr) {
+      shown = &emu;
+      bool result = ev.screen_changed || last_changed;
+      last_changed = false;
+      return result;
+    }
+    auto start = std::chrono::steady_clock::now();
+    ahead->copy_state(emu);
+    ahead->cycles = emu.cycles;
+    ahead->cycles_per_frame = emu.cycles_per_frame;
+    bool changed = false;
+    for (unsigned f = 0; f < frames; f++) {
+      changed |= ahead->run_frame().screen_changed;
+    }
+    std::chrono::nanoseconds t = std::chrono::steady_clock::now() - start;
+    updates++;
+    total_ns += t.count();
+    if (static_cast<std::uint64_t>(t.count()) > max_ns) max_ns = t.count();
+    shown = ahead.get();
+    // The last speculation drew things the new one may not.
+    bool result = ev.screen_changed || changed || last_changed;
+    last_changed = changed;
+    return result;
+  }
+
+  // The emulator whose screen should be displayed.
+  const emulator& screen() const { return *shown; }
+
+  // Cost per frame, e.g. "run-ahead 2: avg 14.2 us max 51.0 us, 0.09% of
+  // a frame".
+  std::string report() const {
+    char line[96];
+    double avg = updates ? total_ns / 1e3 / updates : 0.0;
+    std::snprintf(line, sizeof(line),
+                  "run-ahead %u: avg %.1f us max %.1f us, %.2f%% of a frame",
+                  frames, avg, max_ns / 1e3, avg / 16667.0 * 100);
+    return line;
+  }
+
+  std::uint64_t updates = 0;
+  std::uint64_t total_ns = 0;
+  std::uint64_t max_ns = 0;
+
+private:
+  std::unique_ptr<emulator> ahead;
+  const emulator* shown = nullptr;
+  bool last_changed = true;
+};
+
+}  // namespace chip8
+
+#endif  // RUNAHEAD_H_
@@ -0,0 +1,281 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef SAVESTATE_H_
+#define SAVESTATE_H_
+
+namespace chip8 {
+
+// Save state file layout: a state_header followed by a state_body, both
+// in the host's byte order. A compressed file stores the body run length
+// encoded instead.
+struct state_header {
+  static constexpr std::uint16_t current_version = 1;
+  static constexpr std::uint16_t compressed = 1;
+
+  char magic[4];               // "C8SS"
+  std::uint16_t version;
+  std::uint16_t flags;
+  std::uint32_t quirks;        // emulator_quirks of the writer
+  std::uint32_t rom_hash;      // hash_rom of the ROM, 0 if unknown
+  std::uint32_t body_size;     // sizeof(state_body)
+  std::uint32_t stored_size;   // bytes following the header
+  std::uint32_t cycles_per_frame;
+  std::uint32_t reserved;
+};
+
+struct state_body {
+  std::uint8_t memory[memory_size];
+  std::uint8_t gfx[32][64];
+  std::uint16_t stack[16];
+  std::uint8_t V[16];
+  std::uint64_t cycles;
+  std::uint32_t random_state;
+  std::uint16_t I;
+  std::uint16_t pc;
+  std::uint16_t opcode;
+  std::uint16_t keys;
+  std::uint8_t sp;
+  std::uint8_t delay_timer;
+  std::uint8_t sound_timer;
+  std::uint8_t reserved;
+};
+
+static_assert(sizeof(state_header) == 32, "state_header is part of the file format");
+static_assert(sizeof(state_header) % alignof(state_body) == 0,
+              "state_body must be aligned inside a mapped file");
+
+namespace detail {
+
+// PackBits style: a control byte below 128 is followed by that many plus
+// one literal bytes, a control byte c from 128 repeats the next byte
+// c - 125 times.
+inline std::vector<std::uint8_t> rle_encode(const std::uint8_t* p,
+                                            std::size_t n) {
+  std::vector<std::uint8_t> out;
+  std::size_t i = 0;
+  while (i < n) {
+    std::size_t run = 1;
+    while (i + run < n && run < 130 && p[i + run] == p[i]) run++;
+    if (run >= 3) {
+      out.push_back(run + 125);
+      out.push_back(p[i]);
+      i += run;
+      continue;
+    }
+    std::size_t start = i;
+    while (i < n && i - start < 128 &&
+           !(i + 2 < n && p[i] == p[i+1] && p[i] == p[i+2])) {
+      i++;
+    }
+    out.push_back(i - start - 1);
+    out.insert(out.end(), p + start, p + i);
+  }
+  return out;
+}
+
+inline bool rle_decode(const std::uint8_t* p, std::size_t n,
+                       std::uint8_t* out, std::size_t size) {
+  const std::uint8_t* end = p + n;
+  std::size_t o = 0;
+  while (p < end) {
+    std::uint8_t c = *p++;
+    if (c < 128) {
+      std::size_t len = c + 1;
+      if (end - p < static_cast<std::ptrdiff_t>(len) || o + len > size) {
+        return false;
+      }
+      std::memcpy(out + o, p, len);
+      p += len;
+      o += len;
+    } else {
+      std::size_t len = c - 125;
+      if (p == end || o + len > size) return false;
+      std::memset(out + o, *p++, len);
+      o += len;
+    }
+  }
+  return o == size;
+}
+
+}  // namespace detail
+
+// Copies the machine state of emu into body.
+inline void capture_state(const emulator& emu, state_body& body) noexcept {
+  std::memcpy(body.memory, emu.memory, sizeof(body.memory));
+  std::memcpy(body.gfx, emu.gfx, sizeof(body.gfx));
+  std::memcpy(body.stack, emu.stack, sizeof(body.stack));
+  std::memcpy(body.V, emu.V, sizeof(body.V));
+  body.cycles = emu.cycles;
+  body.random_state = emu.random_state;
+  body.I = emu.I;
+  body.pc = emu.pc;
+  body.opcode = emu.opcode;
+  body.keys = emu.keys;
+  body.sp = emu.sp;
+  body.delay_timer = emu.delay_timer;
+  body.sound_timer = emu.sound_timer;
+  body.reserved = 0;
+}
+
+// Replaces the machine state of emu with body. Nothing is known about
+// what differs from the initial image, so all of it counts as dirty.
+inline void restore_state(const state_body& body, emulator& emu) noexcept {
+  std::memcpy(emu.memory, body.memory, sizeof(emu.memory));
+  std::memcpy(emu.gfx, body.gfx, sizeof(emu.gfx));
+  std::memcpy(emu.stack, body.stack, sizeof(emu.stack));
+  std::memcpy(emu.V, body.V, sizeof(emu.V));
+  emu.cycles = body.cycles;
+  emu.random_state = body.random_state;
+  emu.I = body.I;
+  emu.pc = body.pc;
+  emu.opcode = body.opcode;
+  emu.keys = body.keys;
+  emu.sp = body.sp;
+  emu.delay_timer = body.delay_timer;
+  emu.sound_timer = body.sound_timer;
+  emu.dirty_pages = (1u << page_count) - 1;
+  emu.dirty_rows = 0xFFFFFFFFu;
+  emu.rehash_screen();
+}
+
+// Writes the machine state of emu to path. rom_hash is checked again on
+// restore unless it is 0.
+inline bool save_state(const emulator& emu, const std::string& path,
+                       std::uint32_t rom_hash, bool compress,
+                       std::string& error) {
+  state_body body;
+  capture_state(emu, body);
+
+  const std::uint8_t* raw = reinterpret_cast<const std::uint8_t*>(&body);
+  std::vector<std::uint8_t> packed;
+  if (compress) packed = detail::rle_encode(raw, sizeof(body));
+
+  state_header header = {};
+  std::memcpy(header.magic, "C8SS", 4);
+  header.version = state_header::current_version;
+  header.flags = compress ? state_header::compressed : 0;
+  header.quirks = emulator_quirks;
+  header.rom_hash = rom_hash;
+  header.body_size = sizeof(body);
+  header.stored_size = compress ? packed.size() : sizeof(body);
+  header.cycles_per_frame = emu.cycles_per_frame;
+
+  std::ofstream out(path, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(compress ? packed.data() : raw),
+            header.stored_size);
+  if (!out) {
+    error = "cannot write " + path;
+    return false;
+  }
+  return true;
+}
+
+// A save state mapped from disk. Open it once and restore it into as many
+// emulators as needed; uncompressed bodies are copied straight out of the
+// mapping, so processes restoring the same file share its page cache.
+class state_file {
+public:
+  state_file() = default;
+  state_file(const state_file&) = delete;
+  state_file& operator=(const state_file&) = delete;
+  ~state_file() { close(); }
+
+  bool open(const std::string& path, std::string& error) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      error = "cannot open " + path;
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(state_header)) {
+      ::close(fd);
+      error = path + " is not a save state";
+      return false;
+    }
+    size = st.st_size;
+    void* p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map " + path;
+      return false;
+    }
+    mapping = static_cast<const std::uint8_t*>(p);
+
+    const state_header& h = header();
+    if (std::memcmp(h.magic, "C8SS", 4) != 0) {
+      error = path + " is not a save state";
+    } else if (h.version != state_header::current_version ||
+               h.body_size != sizeof(state_body)) {
+      error = path + " has an unsupported version";
+    } else if (h.quirks != emulator_quirks) {
+      error = path + " was saved by an emulator with different quirks";
+    } else if (sizeof(state_header) + h.stored_size > size) {
+      error = path + " is truncated";
+    } else if (h.flags & state_header::compressed) {
+      unpacked.resize(sizeof(state_body));
+      if (detail::rle_decode(mapping + sizeof(state_header), h.stored_size,
+                             reinterpret_cast<std::uint8_t*>(unpacked.data()),
+                             sizeof(state_body))) {
+        body = unpacked.data();
+        return true;
+      }
+      error = path + " is corrupt";
+    } else if (h.stored_size != sizeof(state_body)) {
+      error = path + " is corrupt";
+    } else {
+      body = reinterpret_cast<const state_body*>(mapping + sizeof(state_header));
+      return true;
+    }
+    close();
+    return false;
+  }
+
+  void close() {
+    if (mapping != nullptr) ::munmap(const_cast<std::uint8_t*>(mapping), size);
+    mapping = nullptr;
+    body = nullptr;
+    unpacked.clear();
+  }
+
+  const state_header& header() const {
+    return *reinterpret_cast<const state_header*>(mapping);
+  }
+
+  // Replaces the machine state of emu. Fails if rom_hash is not 0 and the
+  // state was saved with a different known ROM.
+  bool restore(emulator& emu, std::string& error,
+               std::uint32_t rom_hash = 0) const {
+    const state_header& h = header();
+    if (rom_hash != 0 && h.rom_hash != 0 && rom_hash != h.rom_hash) {
+      error = "save state belongs to a different ROM";
+      return false;
+    }
+    restore_state(*body, emu);
+    emu.cycles_per_frame = h.cycles_per_frame;
+    return true;
+  }
+
+private:
+  const std::uint8_t* mapping = nullptr;
+  std::size_t size = 0;
+  const state_body* body = nullptr;
+  std::vector<state_body> unpacked;
+};
+
+}  // namespace chip8
+
+#endif  // SAVESTATE_H_
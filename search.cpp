@@ -0,0 +1,155 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "debugger.h"
+#include "movie.h"
+#include "search.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8search <rom> --goal EXPR [--score EXPR] [--best-first]
+//             [--hold FRAMES] [--keys KEYS] [--max-states N]
+//             [--max-depth N] [--cycles-per-frame N] [--seed S]
+//             [--threads N] [--movie FILE]
+//
+// Searches for key presses that bring a ROM from boot into a state where
+// the debugger expression --goal is true, e.g.
+//
+//   chip8search roms/rom --goal "V5 >= 3" --keys 46 --hold 8 --movie score3.c8mv
+//   chip8dump roms/rom --replay score3.c8mv --png shots/frame%06u.png
+//
+// Every step holds one of --keys (hex digits, default all) or no key for
+// --hold frames (default 4). States are compared by a hash of memory,
+// registers and screen, so every state is expanded once. The search is
+// breadth-first and finds a shortest sequence of steps; --best-first
+// expands the state with the highest --score first instead. It gives up
+// after --max-states distinct states or --max-depth steps.
+//
+// The steps found are printed and, with --movie, written as a movie.
+
+namespace {
+
+const char* input_name(std::uint8_t input) {
+  static const char* names[] = {
+    "0", "1", "2", "3", "4", "5", "6", "7",
+    "8", "9", "A", "B", "C", "D", "E", "F", "-"
+  };
+  return names[input];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  const char* goal_text = nullptr;
+  const char* score_text = nullptr;
+  const char* movie_path = nullptr;
+  unsigned cycles_per_frame = 10;
+  std::uint32_t seed = 1;
+  chip8::search_options options;
+  options.threads = std::thread::hardware_concurrency();
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--goal") == 0 && has_value) {
+      goal_text = argv[++i];
+    } else if (std::strcmp(argv[i], "--score") == 0 && has_value) {
+      score_text = argv[++i];
+    } else if (std::strcmp(argv[i], "--best-first") == 0) {
+      options.best_first = true;
+    } else if (std::strcmp(argv[i], "--hold") == 0 && has_value) {
+      options.hold = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--keys") == 0 && has_value) {
+      options.keys = 0;
+      for (const char* k = argv[++i]; *k; k++) {
+        char digit[2] = { *k, 0 };
+        char* end;
+        unsigned long key = std::strtoul(digit, &end, 16);
+        if (*end == 0) options.keys |= 1u << key;
+      }
+    } else if (std::strcmp(argv[i], "--max-states") == 0 && has_value) {
+      options.max_states = std::strtoull(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--max-depth") == 0 && has_value) {
+      options.max_depth = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--cycles-per-frame") == 0 && has_value) {
+      cycles_per_frame = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--seed") == 0 && has_value) {
+      seed = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--threads") == 0 && has_value) {
+      options.threads = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--movie") == 0 && has_value) {
+      movie_path = argv[++i];
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == nullptr || goal_text == nullptr || options.hold == 0 ||
+      (options.best_first && score_text == nullptr)) {
+    std::cerr << "usage: chip8search <rom> --goal EXPR [--score EXPR] "
+                 "[--best-first]\n"
+                 "                   [--hold FRAMES] [--keys KEYS] "
+                 "[--max-states N]\n"
+                 "                   [--max-depth N] [--cycles-per-frame N] "
+                 "[--seed S]\n"
+                 "                   [--threads N] [--movie FILE]" << std::endl;
+    return 1;
+  }
+
+  chip8::expression goal, score;
+  std::string error;
+  if (!goal.parse(goal_text, error)) {
+    std::cerr << "--goal: " << error << std::endl;
+    return 1;
+  }
+  if (score_text != nullptr && !score.parse(score_text, error)) {
+    std::cerr << "--score: " << error << std::endl;
+    return 1;
+  }
+
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  std::vector<std::uint8_t> rom(std::istreambuf_iterator<char>(input), {});
+
+  auto emu = std::make_unique<chip8::emulator>();
+  emu->initialize();
+  emu->load(rom.data(), rom.size());
+  emu->cycles_per_frame = cycles_per_frame;
+  emu->seed(seed ? seed : 1);
+
+  chip8::state_search search(goal, score_text ? &score : nullptr, options);
+  chip8::search_result result = search.run(*emu);
+
+  std::fprintf(stderr, "%llu states, %llu duplicates, %llu expanded in "
+               "%.2f s, %.0f states/s\n",
+               static_cast<unsigned long long>(result.states),
+               static_cast<unsigned long long>(result.duplicates),
+               static_cast<unsigned long long>(result.expanded),
+               result.seconds, result.states / result.seconds);
+  if (!result.found) {
+    std::cerr << "goal not reached" << std::endl;
+    return 1;
+  }
+  std::printf("%zu steps of %u frames:", result.path.size(), options.hold);
+  for (std::uint8_t step : result.path) std::printf(" %s", input_name(step));
+  std::printf("\n");
+
+  if (movie_path != nullptr) {
+    chip8::movie m = chip8::search_movie(result.path, options, *emu,
+                                         chip8::hash_rom(rom.data(), rom.size()));
+    if (!m.save(movie_path, error)) {
+      std::cerr << movie_path << ": " << error << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
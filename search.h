@@ -0,0 +1,330 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "chip8.h"
+#include "debugger.h"
+#include "movie.h"
+#include "savestate.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+namespace chip8 {
+
+// 64 bit hash of everything that decides how a machine goes on: memory,
+// registers, stack, timers, random state and screen. The cycle count and
+// the keys held are left out, so the same state reached by different
+// inputs or at a different time counts once.
+inline std::uint64_t state_hash(const emulator& emu) noexcept {
+  std::uint64_t h = 0xCBF29CE484222325ull;
+  auto mix = [&h](const std::uint8_t* p, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      std::uint64_t w;
+      std::memcpy(&w, p + i, 8);
+      h = (h ^ w) * 0x100000001B3ull;
+      h ^= h >> 29;
+    }
+    for (; i < n; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+  };
+  mix(emu.memory, address_space);
+  mix(reinterpret_cast<const std::uint8_t*>(&emu.gfx_hash), sizeof(emu.gfx_hash));
+  mix(emu.V, sizeof(emu.V));
+  mix(reinterpret_cast<const std::uint8_t*>(emu.stack), sizeof(emu.stack));
+  std::uint8_t regs[12] = {
+    static_cast<std::uint8_t>(emu.pc), static_cast<std::uint8_t>(emu.pc >> 8),
+    static_cast<std::uint8_t>(emu.I), static_cast<std::uint8_t>(emu.I >> 8),
+    emu.sp, emu.delay_timer, emu.sound_timer, 0,
+    static_cast<std::uint8_t>(emu.random_state),
+    static_cast<std::uint8_t>(emu.random_state >> 8),
+    static_cast<std::uint8_t>(emu.random_state >> 16),
+    static_cast<std::uint8_t>(emu.random_state >> 24)
+  };
+  mix(regs, sizeof(regs));
+  return h;
+}
+
+// Set of state hashes shared by the search threads, with the smallest
+// depth each state was reached at. Hashes are spread over independently
+// locked shards so threads rarely wait for each other.
+class state_set {
+public:
+  // Returns true if hash was not in the set yet or only at a larger
+  // depth. Threads expand neighbouring depths at the same time, so a
+  // state may be reached by a longer path first.
+  bool insert(std::uint64_t hash, unsigned depth) {
+    shard& s = shards[(hash >> 58) & (shard_count - 1)];
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.hashes.try_emplace(hash, depth);
+    if (it.second) return true;
+    if (it.first->second <= depth) return false;
+    it.first->second = depth;
+    return true;
+  }
+
+  std::size_t size() {
+    std::size_t n = 0;
+    for (shard& s : shards) {
+      std::lock_guard<std::mutex> guard(s.lock);
+      n += s.hashes.size();
+    }
+    return n;
+  }
+
+private:
+  static constexpr std::size_t shard_count = 64;
+  struct shard {
+    std::mutex lock;
+    std::unordered_map<std::uint64_t, unsigned> hashes;
+  };
+  shard shards[shard_count];
+};
+
+// Inputs of one search step: no key, or one key held for the step.
+constexpr std::uint8_t no_key = 16;
+
+struct search_options {
+  // Best-first by score instead of breadth-first by depth.
+  bool best_first = false;
+  // Frames each input is held for.
+  unsigned hold = 4;
+  // Keys tried, one bit per key.
+  std::uint16_t keys = 0xFFFF;
+  // Stop after this many distinct states.
+  std::uint64_t max_states = 100000;
+  unsigned max_depth = 1000;
+  unsigned threads = 1;
+};
+
+struct search_result {
+  bool found = false;
+  // Input of every step from the start to the goal, a key or no_key.
+  std::vector<std::uint8_t> path;
+  std::uint64_t states = 0;
+  std::uint64_t duplicates = 0;
+  std::uint64_t expanded = 0;
+  double seconds = 0;
+};
+
+// Searches the inputs of a ROM for a state where goal holds, starting
+// from start. Every step holds one key, or none, for options.hold frames.
+// Breadth-first search finds a shortest input sequence; best-first
+// expands the state with the highest score first, e.g. a level counter in
+// memory. Threads share a priority queue of run-length-encoded snapshots
+// and a state_set of everything seen.
+class state_search {
+public:
+  state_search(const expression& goal, const expression* score,
+               const search_options& options)
+      : goal(goal), score(score), options(options) {}
+
+  search_result run(const emulator& start) {
+    auto started = std::chrono::steady_clock::now();
+    {
+      auto root = std::make_unique<emulator>();
+      root->copy_state(start);
+      root->cycles = start.cycles;
+      root->cycles_per_frame = start.cycles_per_frame;
+      // CXNN from the wall clock would make the steps unrepeatable.
+      if (root->random_state == 0) root->seed(1);
+      visited.insert(state_hash(*root), 0);
+      if (goal.evaluate(*root)) {
+        finish(nullptr);
+      } else {
+        push(*root, nullptr, 0);
+      }
+    }
+    std::vector<std::thread> workers;
+    unsigned threads = options.threads ? options.threads : 1;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([this, &start] { work(start); });
+    }
+    for (auto& w : workers) w.join();
+
+    result.states = visited.size();
+    result.duplicates = duplicates;
+    result.expanded = expanded;
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - started;
+    result.seconds = t.count();
+    return result;
+  }
+
+private:
+  // Inputs leading to a node, shared between siblings.
+  struct step {
+    std::uint8_t input;
+    std::shared_ptr<const step> parent;
+  };
+
+  struct node {
+    int priority;
+    std::uint64_t order;
+    unsigned depth;
+    std::shared_ptr<const step> path;
+    std::vector<std::uint8_t> packed;
+
+    bool operator<(const node& other) const {
+      if (priority != other.priority) return priority < other.priority;
+      return order > other.order;
+    }
+  };
+
+  void push(const emulator& emu, std::shared_ptr<const step> path,
+            unsigned depth) {
+    auto body = std::make_unique<state_body>();
+    capture_state(emu, *body);
+    node n;
+    n.priority = options.best_first && score != nullptr
+                   ? score->evaluate(emu) : -static_cast<int>(depth);
+    n.depth = depth;
+    n.path = std::move(path);
+    n.packed = detail::rle_encode(reinterpret_cast<const std::uint8_t*>(body.get()),
+                                  sizeof(state_body));
+    std::lock_guard<std::mutex> guard(lock);
+    n.order = pushed++;
+    queue.push(std::move(n));
+    ready.notify_one();
+  }
+
+  // Takes the next node, or returns false when the search is over.
+  bool pop(node& n) {
+    std::unique_lock<std::mutex> guard(lock);
+    // Breadth-first, nodes that cannot lead to a shorter path than the
+    // goal found are dropped. Nodes still being expanded may, so the
+    // search ends when the queue runs dry rather than at the first goal.
+    auto useless = [this] {
+      return result.found && !options.best_first && !queue.empty() &&
+             queue.top().depth + 1 >= result.path.size();
+    };
+    ready.wait(guard, [&] {
+      while (useless()) queue.pop();
+      return stop || !queue.empty() || busy == 0;
+    });
+    if (stop || queue.empty()) {
+      stop = true;
+      ready.notify_all();
+      return false;
+    }
+    n = std::move(const_cast<node&>(queue.top()));
+    queue.pop();
+    busy++;
+    return true;
+  }
+
+  void done() {
+    std::lock_guard<std::mutex> guard(lock);
+    busy--;
+    ready.notify_all();
+  }
+
+  // Threads expand nodes of neighbouring depths at the same time, so the
+  // first goal found is not always the closest. Breadth-first keeps the
+  // shortest path, best-first stops at the first.
+  void finish(std::shared_ptr<const step> path) {
+    std::vector<std::uint8_t> inputs;
+    for (const step* s = path.get(); s != nullptr; s = s->parent.get()) {
+      inputs.insert(inputs.begin(), s->input);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (result.found && (result.path.size() < inputs.size() ||
+                         (result.path.size() == inputs.size() &&
+                          result.path <= inputs))) {
+      return;
+    }
+    result.found = true;
+    result.path = std::move(inputs);
+    if (options.best_first || result.path.empty()) stop = true;
+    ready.notify_all();
+  }
+
+  void work(const emulator& start) {
+    auto emu = std::make_unique<emulator>();
+    auto body = std::make_unique<state_body>();
+    emu->cycles_per_frame = start.cycles_per_frame;
+    node n;
+    while (pop(n)) {
+      expanded++;
+      detail::rle_decode(n.packed.data(), n.packed.size(),
+                         reinterpret_cast<std::uint8_t*>(body.get()),
+                         sizeof(state_body));
+      if (n.depth < options.max_depth) {
+        for (std::uint8_t input = 0; input <= no_key && !stop; input++) {
+          if (input != no_key && !((options.keys >> input) & 1)) continue;
+          restore_state(*body, *emu);
+          emu->keys = input == no_key ? 0 : 1u << input;
+          for (unsigned f = 0; f < options.hold; f++) emu->run_frame();
+          if (!visited.insert(state_hash(*emu), n.depth + 1)) {
+            duplicates++;
+            continue;
+          }
+          auto path = std::make_shared<const step>(step{input, n.path});
+          if (goal.evaluate(*emu)) {
+            finish(std::move(path));
+            break;
+          }
+          if (visited_count++ >= options.max_states) {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+            ready.notify_all();
+            break;
+          }
+          push(*emu, std::move(path), n.depth + 1);
+        }
+      }
+      done();
+    }
+  }
+
+  const expression& goal;
+  const expression* score;
+  const search_options options;
+
+  state_set visited;
+  std::atomic<std::uint64_t> visited_count{0};
+  std::atomic<std::uint64_t> duplicates{0};
+  std::atomic<std::uint64_t> expanded{0};
+
+  std::mutex lock;
+  std::condition_variable ready;
+  std::priority_queue<node> queue;
+  std::uint64_t pushed = 0;
+  unsigned busy = 0;
+  std::atomic<bool> stop{false};
+  search_result result;
+};
+
+// The inputs of a search as a movie for chip8dump --replay and main
+// --replay, recorded from the state search started at.
+inline movie search_movie(const std::vector<std::uint8_t>& path,
+                          const search_options& options,
+                          const emulator& start, std::uint32_t rom_hash) {
+  movie m;
+  m.seed = start.random_state ? start.random_state : 1;
+  m.cycles_per_frame = start.cycles_per_frame;
+  m.rom_hash = rom_hash;
+  const std::uint64_t step_cycles =
+    static_cast<std::uint64_t>(options.hold) * start.cycles_per_frame;
+  std::uint8_t held = no_key;
+  for (std::size_t i = 0; i < path.size(); i++) {
+    if (path[i] == held) continue;
+    if (held != no_key) m.events.push_back({i * step_cycles, held, false});
+    if (path[i] != no_key) m.events.push_back({i * step_cycles, path[i], true});
+    held = path[i];
+  }
+  m.length = path.size() * step_cycles;
+  return m;
+}
+
+}  // namespace chip8
+
+#endif  // SEARCH_H_
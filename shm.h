@@ -0,0 +1,190 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "chip8.h"
+
+// Copyright 2019 Daniel Weber
+
+#ifndef SHM_H_
+#define SHM_H_
+
+namespace chip8 {
+
+// Machine state as published into shared memory.
+struct shared_state {
+  std::uint64_t frame;
+  std::uint64_t cycles;
+  std::uint8_t gfx[32][64];
+  std::uint8_t V[16];
+  std::uint16_t stack[16];
+  std::uint16_t I;
+  std::uint16_t pc;
+  std::uint8_t sp;
+  std::uint8_t delay_timer;
+  std::uint8_t sound_timer;
+};
+
+// Layout of the POSIX shared memory segment. sequence is a seqlock: it is
+// odd while the publisher writes, and a reader retries if it was odd or
+// changed while copying the state.
+struct shared_segment {
+  static constexpr std::uint32_t magic_value = 0x43503853;  // "S8PC"
+  static constexpr std::uint32_t version_value = 1;
+
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::atomic<std::uint32_t> sequence;
+  shared_state state;
+};
+
+// Publishes an emulator's state into a shared memory segment, e.g.
+// "/chip8-worker3". Publishing is a copy of about 2.2 KB and never
+// waits for readers.
+class shm_publisher {
+public:
+  shm_publisher() = default;
+  shm_publisher(const shm_publisher&) = delete;
+  shm_publisher& operator=(const shm_publisher&) = delete;
+  ~shm_publisher() { close(); }
+
+  bool open(const std::string& segment, std::string& error) {
+    close();
+    int fd = ::shm_open(segment.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+      error = "cannot create shared memory " + segment;
+      return false;
+    }
+    if (::ftruncate(fd, sizeof(shared_segment)) != 0) {
+      ::close(fd);
+      error = "cannot size shared memory " + segment;
+      return false;
+    }
+    void* p = ::mmap(nullptr, sizeof(shared_segment), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map shared memory " + segment;
+      return false;
+    }
+    mapped = static_cast<shared_segment*>(p);
+    name = segment;
+    mapped->sequence.store(0, std::memory_order_relaxed);
+    mapped->version = shared_segment::version_value;
+    std::atomic_thread_fence(std::memory_order_release);
+    mapped->magic = shared_segment::magic_value;
+    return true;
+  }
+
+  // Unmaps and, with unlink, removes the segment.
+  void close(bool unlink = true) {
+    if (mapped == nullptr) return;
+    ::munmap(mapped, sizeof(shared_segment));
+    mapped = nullptr;
+    if (unlink) ::shm_unlink(name.c_str());
+  }
+
+  bool is_open() const { return mapped != nullptr; }
+
+  void publish(const emulator& emu) noexcept {
+    std::uint32_t seq = mapped->sequence.load(std::memory_order_relaxed);
+    mapped->sequence.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    shared_state& s = mapped->state;
+    s.frame = frame++;
+    s.cycles = emu.cycles;
+    std::memcpy(s.gfx, emu.gfx, sizeof(s.gfx));
+    std::memcpy(s.V, emu.V, sizeof(s.V));
+    std::memcpy(s.stack, emu.stack, sizeof(s.stack));
+    s.I = emu.I;
+    s.pc = emu.pc;
+    s.sp = emu.sp;
+    s.delay_timer = emu.delay_timer;
+    s.sound_timer = emu.sound_timer;
+
+    mapped->sequence.store(seq + 2, std::memory_order_release);
+  }
+
+private:
+  shared_segment* mapped = nullptr;
+  std::string name;
+  std::uint64_t frame = 0;
+};
+
+// Maps a segment read-only and copies consistent snapshots out of it.
+class shm_reader {
+public:
+  shm_reader() = default;
+  shm_reader(const shm_reader&) = delete;
+  shm_reader& operator=(const shm_reader&) = delete;
+  ~shm_reader() { close(); }
+
+  bool open(const std::string& segment, std::string& error) {
+    close();
+    int fd = ::shm_open(segment.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      error = "no shared memory " + segment;
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < sizeof(shared_segment)) {
+      ::close(fd);
+      error = segment + " is not a chip8 segment";
+      return false;
+    }
+    void* p = ::mmap(nullptr, sizeof(shared_segment), PROT_READ, MAP_SHARED,
+                     fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      error = "cannot map shared memory " + segment;
+      return false;
+    }
+    mapped = static_cast<const shared_segment*>(p);
+    if (mapped->magic != shared_segment::magic_value ||
+        mapped->version != shared_segment::version_value) {
+      close();
+      error = segment + " is not a chip8 segment";
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (mapped == nullptr) return;
+    ::munmap(const_cast<shared_segment*>(mapped), sizeof(shared_segment));
+    mapped = nullptr;
+  }
+
+  // Copies the latest complete state. Returns false if the publisher kept
+  // writing for all attempts.
+  bool read(shared_state& out, int attempts = 1000) const noexcept {
+    for (int i = 0; i < attempts; i++) {
+      std::uint32_t before = mapped->sequence.load(std::memory_order_acquire);
+      if (before & 1) continue;
+      std::memcpy(&out, &mapped->state, sizeof(out));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (mapped->sequence.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Changes every time a new state is published.
+  std::uint32_t generation() const noexcept {
+    return mapped->sequence.load(std::memory_order_acquire) >> 1;
+  }
+
+private:
+  const shared_segment* mapped = nullptr;
+};
+
+}  // namespace chip8
+
+#endif  // SHM_H_
@@ -0,0 +1,186 @@
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ncurses.h>
+#include "chip8.h"
+#include "ansi.h"
+#include "movie.h"
+#include "keys.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8term [--record MOVIE] [rom]
+// chip8term --bench N [rom]
+//
+// Plays a ROM in the terminal through chip8::ansi_renderer instead of
+// curses. Keys 0-9 and a-f are the keypad, q quits. Terminals only report
+// key presses, so a key counts as held for a few frames. --record
+// saves the key presses into a movie for chip8dump --replay.
+//
+// --bench runs N frames headless and reports bytes per frame and CPU time
+// of the ANSI renderer next to the curses drawing of main.cpp writing to
+// a scratch file.
+
+namespace {
+
+// terminal_keys reading stdin, which main puts into raw mode.
+struct stdin_source {
+  int read() {
+    pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    char c;
+    if (::poll(&p, 1, 0) <= 0 || ::read(STDIN_FILENO, &c, 1) != 1) return -1;
+    return static_cast<unsigned char>(c);
+  }
+  void wait() {
+    pollfd p = { STDIN_FILENO, POLLIN, 0 };
+    ::poll(&p, 1, -1);
+  }
+};
+
+double cpu_seconds() {
+  return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+}
+
+int bench(const std::vector<std::uint8_t>& rom, unsigned long frames) {
+  std::FILE* sink = std::tmpfile();
+  std::FILE* in = std::fopen("/dev/null", "r");
+  if (sink == nullptr || in == nullptr) {
+    std::cerr << "cannot open scratch files" << std::endl;
+    return 1;
+  }
+
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom.data(), rom.size());
+  chip8::emulator start;
+  start.copy_state(emu);
+
+  // ANSI renderer into the scratch file
+  chip8::ansi_renderer ansi(fileno(sink));
+  double t = cpu_seconds();
+  for (unsigned long f = 0; f < frames; f++) {
+    emu.run_frame(true);
+    ansi.render(emu);
+  }
+  double ansi_cpu = cpu_seconds() - t;
+
+  // The curses main window, drawn and refreshed every frame like main.cpp
+  emu.copy_state(start);
+  std::fflush(sink);
+  long before = std::ftell(sink);
+  SCREEN* screen = newterm("xterm", sink, in);
+  if (screen == nullptr) {
+    std::cerr << "no terminfo entry for xterm" << std::endl;
+    return 1;
+  }
+  set_term(screen);
+  WINDOW* window = newwin(32, 64, 0, 0);
+  t = cpu_seconds();
+  for (unsigned long f = 0; f < frames; f++) {
+    emu.run_frame(true);
+    for (int k = 0; k < 32; k++) {
+      for (int m = 0; m < 64; m++) {
+        mvwprintw(window, k, m, "%c", emu.gfx[k][m] ? 'x' : ' ');
+      }
+    }
+    wrefresh(window);
+  }
+  double curses_cpu = cpu_seconds() - t;
+  endwin();
+  std::fflush(sink);
+  long curses_bytes = std::ftell(sink) - before;
+  delscreen(screen);
+
+  std::printf("%lu frames\n", frames);
+  std::printf("ansi    %8.1f bytes/frame %8.2f us/frame\n",
+              static_cast<double>(ansi.bytes) / frames, ansi_cpu * 1e6 / frames);
+  std::printf("curses  %8.1f bytes/frame %8.2f us/frame\n",
+              static_cast<double>(curses_bytes) / frames,
+              curses_cpu * 1e6 / frames);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string path = "../roms/rom";
+  unsigned long bench_frames = 0;
+  std::string record;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+      bench_frames = std::strtoul(argv[++i], nullptr, 0);
+    } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record = argv[++i];
+    } else {
+      path = argv[i];
+    }
+  }
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "cannot open " << path << std::endl;
+    return 1;
+  }
+  std::vector<std::uint8_t> rom(std::istreambuf_iterator<char>(input), {});
+  if (bench_frames) return bench(rom, bench_frames);
+
+  termios saved;
+  bool tty = ::tcgetattr(STDIN_FILENO, &saved) == 0;
+  if (tty) {
+    termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    ::tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  }
+
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom.data(), rom.size());
+  chip8::movie_recorder recorder;
+  if (!record.empty()) {
+    recorder.start(emu, rom.data(), rom.size(),
+                   std::chrono::system_clock::now().time_since_epoch().count());
+  }
+  chip8::terminal_keys<stdin_source> keys;
+
+  chip8::ansi_renderer screen;
+  auto next_frame = std::chrono::steady_clock::now();
+  while (keys.poll(&emu, record.empty() ? nullptr : &recorder)) {
+    chip8::run_events ev = emu.run_frame();
+    screen.render(emu);
+    // Nothing changes before the next key press, so sleep until then.
+    if (ev.waiting_for_input && emu.delay_timer == 0 &&
+        emu.sound_timer == 0 && !keys.holding()) {
+      keys.wait();
+      next_frame = std::chrono::steady_clock::now();
+    }
+    next_frame += std::chrono::microseconds(16667);
+    auto now = std::chrono::steady_clock::now();
+    if (next_frame < now) next_frame = now;
+    std::this_thread::sleep_until(next_frame);
+  }
+  screen.finish();
+
+  if (tty) ::tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  if (!record.empty()) {
+    std::string error;
+    if (!recorder.finish(emu).save(record, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+  }
+  std::printf("%llu bytes in %llu frames\n",
+              static_cast<unsigned long long>(screen.bytes),
+              static_cast<unsigned long long>(screen.frames));
+  return 0;
+}
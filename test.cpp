@@ -3,6 +3,22 @@
 #define BOOST_TEST_MODULE chip8test
 #include <iostream>
 #include "./chip8.h"
+#include "./analysis.h"
+#include "./debugger.h"
+#include "./framesink.h"
+#include "./ansi.h"
+#include "./shm.h"
+#include "./movie.h"
+#include "./savestate.h"
+#include "./host.h"
+#include "./lockstep.h"
+#include "./fusion.h"
+#include "./runahead.h"
+#include "./search.h"
+#include "./trace.h"
+#include "./archive.h"
+#include "./conformance.h"
+#include "./coroutines.h"
 #include <boost/test/included/unit_test.hpp>
 BOOST_AUTO_TEST_CASE(test_init) {
   chip8::emulator emu;
@@ -305,7 +321,7 @@ BOOST_AUTO_TEST_CASE(x_plus_y_test) {
   emu.emulateCycle();
 
   BOOST_CHECK(emu.V[0x9] == 0x54);
-  BOOST_CHECK(emu.V[16] == 1);
+  BOOST_CHECK(emu.V[0xF] == 1);
 }
 
 BOOST_AUTO_TEST_CASE(x_minus_y_test) {
@@ -341,7 +357,7 @@ BOOST_AUTO_TEST_CASE(VxisVyminusVx) {
   emu.emulateCycle();
 
   BOOST_CHECK(emu.V[0x9] == 0xFE);
-  BOOST_CHECK(emu.V[16] == 0);
+  BOOST_CHECK(emu.V[0xF] == 0);
 }
 
 BOOST_AUTO_TEST_CASE(test_9XY0) {
@@ -915,3 +931,1250 @@ BOOST_AUTO_TEST_CASE(test_store_bcd) {
   BOOST_CHECK(emu.memory[0x301] == 2);
   BOOST_CHECK(emu.memory[0x302] == 3);
 }
+
+BOOST_AUTO_TEST_CASE(test_analysis_blocks_and_calls) {
+  chip8::emulator emu;
+  emu.initialize();
+  // 200: A300  I = 0x300
+  // 202: D125  draw 5 rows from 0x300
+  // 204: 2210  call 0x210
+  // 206: 3100  skip if V1 == 0
+  // 208: 1200  goto 0x200
+  // 20A: 120A  goto 0x20A
+  // 210: 6105  V1 = 5
+  // 212: 00EE  return
+  std::uint8_t rom[] = { 0xA3, 0x00, 0xD1, 0x25, 0x22, 0x10, 0x31, 0x00,
+                         0x12, 0x00, 0x12, 0x0A, 0x00, 0x00, 0x00, 0x00,
+                         0x61, 0x05, 0x00, 0xEE };
+  for (unsigned i = 0; i < sizeof(rom); i++) emu.memory[0x200+i] = rom[i];
+  for (unsigned i = 0; i < 5; i++) emu.memory[0x300+i] = 0xF0;
+
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, 0x305);
+
+  BOOST_CHECK(r.blocks.size() == 5);
+  BOOST_CHECK(r.blocks.at(0x200).exit == chip8::analysis::exit_kind::call);
+  BOOST_CHECK(r.blocks.at(0x200).callee == 0x210);
+  BOOST_CHECK(r.blocks.at(0x206).exit == chip8::analysis::exit_kind::skip);
+  BOOST_CHECK(r.blocks.at(0x206).successors.size() == 2);
+  BOOST_CHECK(r.blocks.at(0x210).exit == chip8::analysis::exit_kind::ret);
+  BOOST_CHECK(r.call_graph.at(0x200).count(0x210) == 1);
+  BOOST_CHECK(r.call_graph.at(0x210).empty());
+
+  BOOST_CHECK(r.is_code(0x204));
+  BOOST_CHECK(!r.is_code(0x20C));
+  BOOST_CHECK(r.kind[0x300] == chip8::analysis::byte_kind::sprite);
+  BOOST_CHECK(r.kind[0x304] == chip8::analysis::byte_kind::sprite);
+  BOOST_CHECK(r.block_at(0x208)->start == 0x208);
+  BOOST_CHECK(r.block_at(0x20C) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_analysis_indirect_jump) {
+  chip8::emulator emu;
+  emu.initialize();
+  emu.memory[0x200] = 0x60;
+  emu.memory[0x201] = 0x02;
+  emu.memory[0x202] = 0xB3;
+  emu.memory[0x203] = 0x00;
+
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, 0x204);
+
+  BOOST_CHECK(r.indirect_jumps.size() == 1);
+  BOOST_CHECK(r.indirect_jumps[0] == 0x202);
+  BOOST_CHECK(r.blocks.at(0x200).exit == chip8::analysis::exit_kind::indirect);
+  BOOST_CHECK(r.to_json().find("\"indirect_jumps\": [514]") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_analysis_key_wait_ends_block) {
+  // 200: F10A  V1 = wait for key
+  // 202: 6205  V2 = 5
+  // 204: 1204  goto 0x204
+  std::uint8_t rom[] = { 0xF1, 0x0A, 0x62, 0x05, 0x12, 0x04 };
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, 0x206);
+
+  BOOST_REQUIRE(r.blocks.count(0x200) && r.blocks.count(0x202));
+  const chip8::analysis::basic_block& wait = r.blocks.at(0x200);
+  BOOST_CHECK(wait.exit == chip8::analysis::exit_kind::key_wait);
+  BOOST_CHECK(wait.instructions() == 1);
+  BOOST_CHECK(wait.successors.size() == 2);
+  BOOST_CHECK(wait.successors[0] == 0x200 && wait.successors[1] == 0x202);
+
+  // Running whole blocks straight through, as chip8aot does, has to agree
+  // with the interpreter while no key is down.
+  chip8::emulator blocks;
+  blocks.initialize();
+  blocks.load(rom, sizeof(rom));
+  std::uint64_t done = 0;
+  while (done < 10) {
+    const chip8::analysis::basic_block* b = r.block_at(blocks.pc);
+    BOOST_REQUIRE(b != nullptr && b->start == blocks.pc);
+    for (std::uint16_t a = b->start; a < b->end && done < 10; a += 2, done++) {
+      blocks.execute((blocks.memory[a] << 8) | blocks.memory[a + 1]);
+    }
+  }
+  emu.run_cycles(10);
+  BOOST_CHECK(emu.pc == 0x200 && emu.V[2] == 0);
+  BOOST_CHECK(blocks.pc == emu.pc && blocks.V[2] == emu.V[2]);
+}
+
+BOOST_AUTO_TEST_CASE(test_analysis_jump_below_base) {
+  // 200: 6105  V1 = 5
+  // 202: 1000  goto 0x000, into the font
+  std::uint8_t rom[] = { 0x61, 0x05, 0x10, 0x00 };
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+
+  chip8::analysis::rom_analysis r = chip8::analysis::analyze(emu, 0x204);
+
+  BOOST_CHECK(r.blocks.size() == 1);
+  BOOST_CHECK(r.blocks.at(0x200).exit == chip8::analysis::exit_kind::jump);
+  BOOST_CHECK(r.blocks.at(0x200).successors ==
+              std::vector<std::uint16_t>({ 0x000 }));
+  BOOST_CHECK(!r.is_code(0x000));
+  BOOST_CHECK(r.block_at(0x000) == nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(test_debugger_breakpoint) {
+  chip8::emulator emu;
+  emu.initialize();
+  chip8::debugger dbg;
+  std::string error;
+  dbg.attach(emu);
+  // 200: 6105  V1 = 5
+  // 202: 7101  V1 += 1
+  // 204: 1202  goto 0x202
+  emu.memory[0x200] = 0x61;
+  emu.memory[0x201] = 0x05;
+  emu.memory[0x202] = 0x71;
+  emu.memory[0x203] = 0x01;
+  emu.memory[0x204] = 0x12;
+  emu.memory[0x205] = 0x02;
+  BOOST_CHECK(dbg.add_breakpoint(0x202, "V1 >= 7", error));
+
+  for (int i = 0; i < 20 && !dbg.stopped(); i++) emu.emulateCycle();
+  BOOST_CHECK(dbg.reason == chip8::debug_hooks::breakpoint);
+  BOOST_CHECK(emu.pc == 0x202);
+  BOOST_CHECK(emu.V[1] == 7);
+
+  // stopped: further cycles do nothing
+  emu.emulateCycle();
+  BOOST_CHECK(emu.pc == 0x202);
+
+  dbg.step();
+  emu.emulateCycle();
+  BOOST_CHECK(dbg.reason == chip8::debug_hooks::stepped);
+  BOOST_CHECK(emu.V[1] == 8);
+
+  dbg.remove_breakpoint(0x202);
+  dbg.resume();
+  for (int i = 0; i < 4; i++) emu.emulateCycle();
+  BOOST_CHECK(!dbg.stopped());
+  BOOST_CHECK(emu.V[1] == 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_debugger_keeps_input_policy) {
+  std::uint8_t rom[] = { 0x60, 0x05,    // V0 = 5
+                         0xE0, 0x9E,    // skip if key 5 down
+                         0x61, 0x01,    // V1 = 1
+                         0xF2, 0x0A };  // V2 = wait for key
+  chip8::emulator emu;
+  chip8::debugger dbg;
+  dbg.attach(emu);
+
+  // The keys bitmap says key 5 is down, the policy that it is not.
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.key_event(5, true);
+  chip8::null_input none;
+  chip8::run_events ev = emu.run_cycles(6, none);
+  BOOST_CHECK(ev.cycles == 6 && !ev.breakpoint);
+  BOOST_CHECK(emu.V[1] == 1);
+  BOOST_CHECK(emu.pc == 0x206);
+
+  // And the other way round, key 5 held in the replayed frame.
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  const std::uint16_t frames[] = { 1u << 5 };
+  chip8::replay_input replay{frames, 1};
+  emu.run_cycles(3, replay);
+  BOOST_CHECK(emu.V[1] == 0);
+  BOOST_CHECK(emu.V[2] == 5);
+  BOOST_CHECK(emu.pc == 0x208);
+}
+
+BOOST_AUTO_TEST_CASE(test_debugger_watchpoints) {
+  chip8::emulator emu;
+  emu.initialize();
+  chip8::debugger dbg;
+  dbg.attach(emu);
+  emu.I = 0x300;
+  emu.V[0x4] = 123;
+  // 200: F433  BCD of V4 to 0x300..0x302
+  // 202: F265  V0..V2 = memory[0x300..0x302]
+  emu.memory[0x200] = 0xF4;
+  emu.memory[0x201] = 0x33;
+  emu.memory[0x202] = 0xF2;
+  emu.memory[0x203] = 0x65;
+
+  dbg.watch_write(0x302);
+  emu.emulateCycle();
+  BOOST_CHECK(dbg.reason == chip8::debug_hooks::write_watch);
+  BOOST_CHECK(dbg.address == 0x302);
+  BOOST_CHECK(emu.memory[0x302] == 3);
+
+  std::string error;
+  BOOST_CHECK(!dbg.watch_register(17, error));
+  BOOST_CHECK(!dbg.watch_register(40, error));
+  BOOST_CHECK(dbg.register_mask == 0);
+  BOOST_CHECK(dbg.watch_register(1, error));
+  dbg.resume();
+  emu.emulateCycle();
+  BOOST_CHECK(dbg.reason == chip8::debug_hooks::register_watch);
+  BOOST_CHECK(dbg.address == 1);
+  BOOST_CHECK(dbg.describe() == "V1 changed");
+}
+
+BOOST_AUTO_TEST_CASE(test_debugger_expressions) {
+  chip8::emulator emu;
+  emu.initialize();
+  emu.V[0x3] = 0x10;
+  emu.I = 0x300;
+  emu.memory[0x301] = 4;
+  std::string error;
+  chip8::expression e;
+
+  BOOST_CHECK(e.parse("V3 == 0x10 && [I+1] > 2", error));
+  BOOST_CHECK(e.evaluate(emu) == 1);
+  BOOST_CHECK(e.parse("(v3 | 1) - -2", error));
+  BOOST_CHECK(e.evaluate(emu) == 0x13);
+  BOOST_CHECK(e.parse("!(PC != 0x200) || V3 & 0", error));
+  BOOST_CHECK(e.evaluate(emu) == 1);
+  BOOST_CHECK(!e.parse("V3 ==", error));
+  BOOST_CHECK(!e.parse("VX == 1", error));
+  BOOST_CHECK(!e.parse("(V3", error));
+}
+
+BOOST_AUTO_TEST_CASE(test_reset_restores_dirty_state) {
+  chip8::emulator emu;
+  emu.initialize();
+  std::uint8_t rom[] = { 0xA3, 0x00,    // I = 0x300
+                         0xF2, 0x55,    // store V0..V2 at 0x300
+                         0xA0, 0x00,    // I = 0 (font)
+                         0xD0, 0x15 };  // draw 0 at (V0, V1)
+  emu.load(rom, sizeof(rom));
+  emu.V[0] = 0x3;
+  emu.V[1] = 0x4;
+  emu.V[2] = 0x5;
+  for (int i = 0; i < 4; i++) emu.emulateCycle();
+  BOOST_CHECK(emu.memory[0x302] == 0x5);
+  BOOST_CHECK(emu.gfx[4][3] == 1);
+  BOOST_CHECK(emu.dirty_pages == ((1u << 2) | (1u << 3)));
+  BOOST_CHECK(emu.dirty_rows == (0x1Fu << 4));
+
+  emu.reset();
+
+  chip8::emulator fresh;
+  fresh.initialize();
+  BOOST_CHECK(std::memcmp(emu.memory, fresh.memory, sizeof(emu.memory)) == 0);
+  BOOST_CHECK(std::memcmp(emu.gfx, fresh.gfx, sizeof(emu.gfx)) == 0);
+  BOOST_CHECK(std::memcmp(emu.V, fresh.V, sizeof(emu.V)) == 0);
+  BOOST_CHECK(emu.pc == 0x200);
+  BOOST_CHECK(emu.I == 0);
+  BOOST_CHECK(emu.dirty_pages == 0);
+  BOOST_CHECK(emu.dirty_rows == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_access_stays_in_bounds) {
+  chip8::emulator emu;
+  emu.initialize();
+  // FX55 with X = F at the last address writes into the guard band.
+  emu.I = 0xFFF;
+  emu.memory[0x200] = 0xFF;
+  emu.memory[0x201] = 0x55;
+  for (auto& x : emu.V) x = 0xAB;
+  emu.emulateCycle();
+  BOOST_CHECK(emu.memory[0xFFF] == 0xAB);
+  BOOST_CHECK(emu.memory[0xFFF + 15] == 0xAB);
+
+  // I is masked to 12 bits when memory is accessed.
+  emu.I = 0x1300;
+  emu.memory[0x202] = 0xF0;
+  emu.memory[0x203] = 0x55;
+  emu.emulateCycle();
+  BOOST_CHECK(emu.memory[0x300] == 0xAB);
+  BOOST_CHECK(emu.I == 0x1300);
+
+  // pc is masked before the fetch.
+  emu.pc = 0x1204;
+  emu.memory[0x204] = 0x61;
+  emu.memory[0x205] = 0x07;
+  emu.emulateCycle();
+  BOOST_CHECK(emu.V[1] == 0x07);
+  BOOST_CHECK(emu.pc == 0x206);
+}
+
+BOOST_AUTO_TEST_CASE(test_stack_pointer_wraps) {
+  chip8::emulator emu;
+  emu.initialize();
+  // 200: 2200  call 0x200 forever
+  emu.memory[0x200] = 0x22;
+  emu.memory[0x201] = 0x00;
+  for (int i = 0; i < 20; i++) emu.emulateCycle();
+  BOOST_CHECK(emu.sp == 20 % 16);
+
+  // 00EE with an empty stack wraps sp down to 15.
+  emu.initialize();
+  emu.memory[0x200] = 0x00;
+  emu.memory[0x201] = 0xEE;
+  emu.emulateCycle();
+  BOOST_CHECK(emu.sp == 15);
+}
+
+BOOST_AUTO_TEST_CASE(test_run_frame_events) {
+  chip8::emulator emu;
+  emu.initialize();
+  emu.cycles_per_frame = 4;
+  std::uint8_t rom[] = { 0x60, 0x05,    // V0 = 5
+                         0xF0, 0x18,    // sound_timer = V0
+                         0xF0, 0x15,    // delay_timer = V0
+                         0x12, 0x06 };  // goto 0x206
+  emu.load(rom, sizeof(rom));
+
+  chip8::run_events ev = emu.run_frame();
+  BOOST_CHECK(ev.cycles == 4);
+  BOOST_CHECK(ev.sound_started);
+  BOOST_CHECK(!ev.screen_changed);
+  BOOST_CHECK(emu.cycles == 4);
+  // one timer tick per frame
+  BOOST_CHECK(emu.delay_timer == 4);
+  BOOST_CHECK(emu.sound_timer == 4);
+
+  for (int i = 0; i < 3; i++) {
+    ev = emu.run_frame();
+    BOOST_CHECK(!ev.sound_stopped);
+  }
+  ev = emu.run_frame();
+  BOOST_CHECK(ev.sound_stopped);
+  BOOST_CHECK(emu.sound_timer == 0);
+  BOOST_CHECK(emu.cycles == 20);
+
+  emu.memory[0x206] = 0x00;
+  emu.memory[0x207] = 0xE0;
+  ev = emu.run_cycles(1);
+  BOOST_CHECK(ev.screen_changed);
+  BOOST_CHECK(ev.cycles == 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_run_cycles_stops_at_breakpoint) {
+  chip8::emulator emu;
+  emu.initialize();
+  chip8::debugger dbg;
+  std::string error;
+  dbg.attach(emu);
+  dbg.add_breakpoint(0x204, "", error);
+  std::uint8_t rom[] = { 0x60, 0x01, 0x70, 0x01, 0x70, 0x01 };
+  emu.load(rom, sizeof(rom));
+
+  chip8::run_events ev = emu.run_cycles(10);
+  BOOST_CHECK(ev.breakpoint);
+  BOOST_CHECK(ev.cycles == 2);
+  BOOST_CHECK(emu.pc == 0x204);
+  BOOST_CHECK(emu.V[0] == 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_frame_sink_skips_identical_frames) {
+  chip8::emulator emu;
+  emu.initialize();
+  chip8::frame_sink sink;
+  std::string error;
+  BOOST_REQUIRE(sink.open(chip8::frame_sink::pbm, "sink_test%u.pbm", 2, error));
+  emu.gfx[0][0] = 1;
+  emu.rehash_screen();
+  BOOST_CHECK(sink.write(emu));
+  BOOST_CHECK(sink.write(emu));
+  emu.gfx[31][63] = 1;
+  emu.rehash_screen();
+  BOOST_CHECK(sink.write(emu));
+  // A different screen with the same hash, as after a collision.
+  emu.gfx[5][5] = 1;
+  BOOST_CHECK(sink.write(emu));
+  BOOST_CHECK(sink.frames() == 4);
+  BOOST_CHECK(sink.files_written() == 3);
+
+  std::ifstream first("sink_test0.pbm", std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(first)), {});
+  // 128x64 pixels, 16 bytes per row, lit pixels are white
+  BOOST_REQUIRE(data.size() == std::string("P4\n128 64\n").size() + 16 * 64);
+  BOOST_CHECK(data.compare(0, 10, "P4\n128 64\n") == 0);
+  BOOST_CHECK(static_cast<std::uint8_t>(data[10]) == 0x3F);
+  BOOST_CHECK(static_cast<std::uint8_t>(data[11]) == 0xFF);
+  BOOST_CHECK(std::ifstream("sink_test2.pbm").good());
+  BOOST_CHECK(std::ifstream("sink_test3.pbm").good());
+  BOOST_CHECK(!std::ifstream("sink_test1.pbm").good());
+  std::remove("sink_test0.pbm");
+  std::remove("sink_test2.pbm");
+  std::remove("sink_test3.pbm");
+
+  // The pattern goes to snprintf with the frame number only.
+  for (const char* bad : { "shot.pbm", "shot%s.pbm", "shot%n.pbm",
+                           "shot%u_%u.pbm", "shot%u%.pbm", "shot%999u.pbm",
+                           "shot%lu.pbm" }) {
+    BOOST_CHECK(!sink.open(chip8::frame_sink::pbm, bad, 1, error));
+  }
+  BOOST_CHECK(sink.open(chip8::frame_sink::pbm, "100%%_%06u.pbm", 1, error));
+  BOOST_CHECK(sink.open(chip8::frame_sink::png, "shot%x.png", 1, error));
+}
+
+BOOST_AUTO_TEST_CASE(test_ansi_renderer_diffs_frames) {
+  chip8::emulator emu;
+  emu.initialize();
+  chip8::ansi_renderer screen(-1);
+  std::size_t first = screen.build(emu);
+  BOOST_CHECK(first > 64 * 16);
+  BOOST_CHECK(screen.build(emu) == 0);
+
+  // pixels (0,0) and (1,0) share the top left cell
+  emu.gfx[1][0] = 1;
+  std::size_t n = screen.build(emu);
+  BOOST_CHECK(std::string(screen.data(), n) == "\x1b[1;1H\xe2\x96\x84");
+  emu.gfx[0][0] = 1;
+  emu.gfx[0][2] = 1;
+  n = screen.build(emu);
+  // the cursor is behind the first cell: a carriage return moves it back,
+  // and the unchanged cell in between is rewritten instead of moving the
+  // cursor forward
+  BOOST_CHECK(std::string(screen.data(), n) ==
+              "\r\xe2\x96\x88 \xe2\x96\x80");
+  BOOST_CHECK(screen.frames == 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_memory_export) {
+  chip8::emulator emu;
+  emu.initialize();
+  std::string segment = "/chip8test-" + std::to_string(::getpid());
+  std::string error;
+  chip8::shm_publisher publisher;
+  BOOST_REQUIRE(publisher.open(segment, error));
+  chip8::shm_reader reader;
+  BOOST_REQUIRE(reader.open(segment, error));
+  BOOST_CHECK(!reader.open("/chip8test-missing", error));
+  BOOST_REQUIRE(reader.open(segment, error));
+
+  emu.V[3] = 0x42;
+  emu.I = 0x321;
+  emu.gfx[5][7] = 1;
+  emu.cycles = 1234;
+  publisher.publish(emu);
+  publisher.publish(emu);
+  BOOST_CHECK(reader.generation() == 2);
+
+  chip8::shared_state state;
+  BOOST_REQUIRE(reader.read(state));
+  BOOST_CHECK(state.frame == 1);
+  BOOST_CHECK(state.cycles == 1234);
+  BOOST_CHECK(state.V[3] == 0x42);
+  BOOST_CHECK(state.I == 0x321);
+  BOOST_CHECK(state.pc == 0x200);
+  BOOST_CHECK(state.gfx[5][7] == 1);
+  BOOST_CHECK(state.gfx[0][0] == 0);
+  reader.close();
+  publisher.close();
+  BOOST_CHECK(!reader.open(segment, error));
+}
+
+BOOST_AUTO_TEST_CASE(test_key_events) {
+  chip8::emulator emu;
+  emu.initialize();
+  std::uint8_t rom[] = { 0x60, 0x07,    // V0 = 7
+                         0xE0, 0x9E,    // skip if key V0 down
+                         0x61, 0x01,    // V1 = 1
+                         0xF2, 0x0A };  // V2 = wait for key
+  emu.load(rom, sizeof(rom));
+  emu.key_event(7, true);
+  emu.run_cycles(2);
+  BOOST_CHECK(emu.V[1] == 0);
+  BOOST_CHECK(emu.pc == 0x206);
+
+  emu.key_event(7, false);
+  emu.run_cycles(5);
+  // FX0A keeps waiting while no key is down
+  BOOST_CHECK(emu.pc == 0x206);
+  emu.key_event(0xC, true);
+  emu.run_cycles(1);
+  BOOST_CHECK(emu.pc == 0x208);
+  BOOST_CHECK(emu.V[2] == 0xC);
+}
+
+BOOST_AUTO_TEST_CASE(test_movie_replay) {
+  // Counts frames with key 5 down in V1 and stores random bytes.
+  std::uint8_t rom[] = { 0x60, 0x05,    // 200: V0 = 5
+                         0xC2, 0xFF,    // 202: V2 = rand
+                         0x73, 0x01,    // 204: V3 += 1
+                         0xE0, 0xA1,    // 206: skip if key V0 up
+                         0x71, 0x01,    // 208: V1 += 1
+                         0x12, 0x02 };  // 20A: goto 202
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.cycles_per_frame = 7;
+  chip8::movie_recorder recorder;
+  recorder.start(emu, rom, sizeof(rom), 1234);
+  for (int f = 0; f < 30; f++) {
+    if (f == 3) recorder.key_event(emu, 5, true);
+    if (f == 9) recorder.key_event(emu, 5, false);
+    if (f == 20) {
+      // an event in the middle of a frame
+      emu.run_cycles(3);
+      recorder.key_event(emu, 5, true);
+      emu.run_cycles(4);
+      emu.tick_timers();
+    } else {
+      emu.run_frame();
+    }
+  }
+  chip8::movie recorded = recorder.finish(emu);
+  BOOST_CHECK(recorded.events.size() == 3);
+  BOOST_CHECK(emu.V[1] > 0);
+
+  std::vector<std::uint8_t> data = recorded.encode();
+  chip8::movie loaded;
+  std::string error;
+  BOOST_REQUIRE(loaded.decode(data.data(), data.size(), error));
+  BOOST_CHECK(loaded.length == recorded.length);
+  BOOST_CHECK(loaded.seed == 1234);
+  BOOST_CHECK(!loaded.decode(data.data(), 4, error));
+
+  chip8::emulator replay;
+  replay.initialize();
+  replay.load(rom, sizeof(rom));
+  chip8::movie_player player(loaded);
+  std::uint8_t other[] = { 0x00, 0xE0 };
+  BOOST_CHECK(!player.start(replay, other, sizeof(other), error));
+  BOOST_REQUIRE(player.start(replay, rom, sizeof(rom), error));
+  while (!player.finished(replay)) player.run_frame(replay);
+  BOOST_CHECK(replay.cycles == emu.cycles);
+  BOOST_CHECK(std::memcmp(replay.V, emu.V, sizeof(emu.V)) == 0);
+  BOOST_CHECK(replay.keys == emu.keys);
+}
+
+BOOST_AUTO_TEST_CASE(test_save_state_roundtrip) {
+  chip8::emulator emu;
+  emu.initialize();
+  std::uint8_t rom[] = { 0x60, 0x05, 0xA3, 0x00, 0xF0, 0x55, 0xD0, 0x05 };
+  emu.load(rom, sizeof(rom));
+  emu.seed(77);
+  emu.run_cycles(4);
+  emu.delay_timer = 9;
+  std::uint32_t hash = chip8::hash_rom(rom, sizeof(rom));
+
+  for (bool compress : { false, true }) {
+    std::string error;
+    BOOST_REQUIRE(chip8::save_state(emu, "state_test.c8s", hash, compress, error));
+    chip8::state_file state;
+    BOOST_REQUIRE(state.open("state_test.c8s", error));
+    BOOST_CHECK((state.header().flags & chip8::state_header::compressed) ==
+                (compress ? chip8::state_header::compressed : 0));
+    BOOST_CHECK(!state.restore(emu, error, hash + 1));
+
+    chip8::emulator copy;
+    copy.initialize();
+    BOOST_REQUIRE(state.restore(copy, error, hash));
+    BOOST_CHECK(std::memcmp(copy.memory, emu.memory, sizeof(emu.memory)) == 0);
+    BOOST_CHECK(std::memcmp(copy.gfx, emu.gfx, sizeof(emu.gfx)) == 0);
+    BOOST_CHECK(std::memcmp(copy.V, emu.V, sizeof(emu.V)) == 0);
+    BOOST_CHECK(copy.pc == emu.pc);
+    BOOST_CHECK(copy.I == 0x300);
+    BOOST_CHECK(copy.delay_timer == 9);
+    BOOST_CHECK(copy.cycles == 4);
+    BOOST_CHECK(copy.random_state == emu.random_state);
+    // reset() from a restored state goes back to boot
+    copy.reset();
+    BOOST_CHECK(std::memcmp(copy.memory, chip8::initial_memory.bytes,
+                            sizeof(copy.memory)) == 0);
+  }
+  std::ofstream("state_test.c8s") << "C8SS garbage";
+  chip8::state_file state;
+  std::string error;
+  BOOST_CHECK(!state.open("state_test.c8s", error));
+  std::remove("state_test.c8s");
+}
+
+BOOST_AUTO_TEST_CASE(test_idle_loops_are_skipped_exactly) {
+  std::uint8_t rom[] = { 0x6A, 0x1E,    // 200: VA = 30
+                         0xFA, 0x15,    // 202: DT = VA
+                         0xF1, 0x07,    // 204: V1 = DT
+                         0x31, 0x00,    // 206: skip if V1 == 0
+                         0x12, 0x04,    // 208: goto 204
+                         0x62, 0x03,    // 20A: V2 = 3
+                         0xE2, 0x9E,    // 20C: skip if key V2 down
+                         0x12, 0x0C,    // 20E: goto 20C
+                         0x7B, 0x01,    // 210: VB += 1
+                         0x12, 0x12 };  // 212: goto 212
+  chip8::emulator fast, slow;
+  for (chip8::emulator* e : { &fast, &slow }) {
+    e->initialize();
+    e->load(rom, sizeof(rom));
+    e->cycles_per_frame = 50;
+  }
+
+  std::uint64_t idle = 0;
+  for (int frame = 0; frame < 60; frame++) {
+    if (frame == 45) {
+      fast.key_event(3, true);
+      slow.key_event(3, true);
+    }
+    chip8::run_events ev = fast.run_frame(true);
+    idle += ev.idle_cycles;
+    if (frame == 40) BOOST_CHECK(ev.waiting_for_input);
+    if (frame == 10) BOOST_CHECK(!ev.waiting_for_input);
+    for (unsigned c = 0; c < slow.cycles_per_frame; c++) {
+      slow.opcode = slow.fetch();
+      slow.execute(slow.opcode, true);
+      slow.cycles++;
+    }
+    slow.tick_timers();
+    BOOST_REQUIRE(fast.pc == slow.pc);
+    BOOST_REQUIRE(fast.opcode == slow.opcode);
+    BOOST_REQUIRE(std::memcmp(fast.V, slow.V, sizeof(fast.V)) == 0);
+    BOOST_REQUIRE(fast.delay_timer == slow.delay_timer);
+  }
+  BOOST_CHECK(fast.cycles == slow.cycles);
+  BOOST_CHECK(fast.V[0xB] == 1);
+  BOOST_CHECK(fast.pc == 0x212);
+  // most of the 3000 cycles were spent waiting
+  BOOST_CHECK(idle > 2500);
+}
+
+BOOST_AUTO_TEST_CASE(test_work_stealing_pool_runs_everything) {
+  chip8::work_stealing_pool pool(4);
+  std::atomic<int> done{0};
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 1000; i++) {
+      pool.submit([&done, i] {
+        // uneven tasks so that workers run dry and steal
+        if (i % 97 == 0) std::this_thread::sleep_for(std::chrono::microseconds(200));
+        done++;
+      });
+    }
+    pool.wait_idle();
+    BOOST_CHECK(done == 1000 * (round + 1));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_session_manager) {
+  chip8::session_manager manager(2);
+  // draws the font sprite of V0 unless key 5 is held from the start
+  std::vector<std::uint8_t> rom = { 0x60, 0x05,    // V0 = 5
+                                    0xF0, 0x29,    // I = sprite V0
+                                    0xE0, 0xA1,    // skip if key V0 up
+                                    0x12, 0x04,    // goto 204
+                                    0xD1, 0x15,    // draw
+                                    0x12, 0x0A };  // goto 20A
+  std::uint32_t a = manager.create(rom);
+  std::uint32_t b = manager.create(rom);
+  BOOST_CHECK(a != b);
+  BOOST_CHECK(manager.key_event(a, 5, true));
+  for (int i = 0; i < 10; i++) manager.run_frame();
+
+  chip8::session_stats stats;
+  BOOST_REQUIRE(manager.stats(a, stats));
+  BOOST_CHECK(stats.frames == 10);
+  BOOST_CHECK(stats.cycles == 100);
+
+  std::vector<std::uint8_t> encoded;
+  std::uint64_t number = 0;
+  std::uint8_t gfx[32][64];
+  BOOST_REQUIRE(manager.frame(b, encoded, number));
+  BOOST_REQUIRE(chip8::decode_frame(encoded.data(), encoded.size(), gfx));
+  BOOST_CHECK(number == 10);
+  BOOST_CHECK(gfx[0][0] == 1);  // top row of the "5"
+  BOOST_REQUIRE(manager.frame(a, encoded, number));
+  BOOST_REQUIRE(chip8::decode_frame(encoded.data(), encoded.size(), gfx));
+  BOOST_CHECK(gfx[0][0] == 0);  // key held, nothing drawn
+
+  std::vector<std::uint8_t> payload;
+  BOOST_CHECK(manager.command("key " + std::to_string(b) + " 5 down", payload) == "ok");
+  BOOST_CHECK(manager.command("key " + std::to_string(b) + " 10 down", payload)
+              .compare(0, 5, "error") == 0);
+  std::string reply = manager.command("frame " + std::to_string(b), payload);
+  BOOST_CHECK(reply == "ok 10 " + std::to_string(payload.size()));
+  BOOST_CHECK(manager.command("destroy " + std::to_string(a), payload) == "ok");
+  BOOST_CHECK(manager.command("list", payload) == "ok " + std::to_string(b));
+  BOOST_CHECK(manager.command("stats 999", payload) == "error no session 999");
+
+  // the same over the control socket
+  chip8::control_server server(manager);
+  std::string socket_path = "host_test.sock";
+  std::string error;
+  BOOST_REQUIRE(server.listen(socket_path, error));
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::strcpy(addr.sun_path, socket_path.c_str());
+  BOOST_REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+  server.poll(100);
+  std::string request = "list\n";
+  BOOST_REQUIRE(::write(fd, request.data(), request.size()) == 5);
+  server.poll(100);
+  char line[64] = {};
+  BOOST_CHECK(::read(fd, line, sizeof(line) - 1) > 0);
+  BOOST_CHECK(std::string(line) == "ok " + std::to_string(b) + "\n");
+  ::close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(test_lockstep_run_cycles_matches_reference) {
+  auto emu = std::make_unique<chip8::emulator>();
+  emu->initialize();
+  chip8::random_program(*emu, 7);
+  emu->seed(7);
+
+  chip8::lockstep check(*chip8::find_engine("reference"),
+                        *chip8::find_engine("run_cycles"));
+  check.block = 100;
+  BOOST_CHECK(check.run(*emu, 50000, 3));
+  BOOST_CHECK(check.checked == 50000);
+}
+
+BOOST_AUTO_TEST_CASE(test_lockstep_finds_first_divergence) {
+  // 8XY4 that forgets the carry
+  chip8::engine broken = { "broken", [](chip8::emulator& emu, std::uint64_t n) {
+    for (std::uint64_t i = 0; i < n; i++) {
+      emu.opcode = emu.fetch();
+      emu.execute(emu.opcode);
+      if ((emu.opcode & 0xF00F) == 0x8004) emu.V[0xF] = 0;
+      emu.cycles++;
+    }
+  }};
+  auto emu = std::make_unique<chip8::emulator>();
+  emu->initialize();
+  std::uint8_t rom[] = { 0x60, 0xF0,    // V0 = F0
+                         0x61, 0x20,    // V1 = 20
+                         0x80, 0x14,    // V0 += V1, carry
+                         0x12, 0x06 };  // goto 206
+  emu->load(rom, sizeof(rom));
+
+  chip8::lockstep check(*chip8::find_engine("reference"), broken);
+  check.block = 10;
+  BOOST_REQUIRE(!check.run(*emu, 100, 1));
+  BOOST_CHECK(check.failure().cycle == 2);
+  BOOST_CHECK(check.failure().pc == 0x204);
+  BOOST_CHECK(check.failure().opcode == 0x8014);
+  BOOST_CHECK(check.failure().diff == "VF: 0x1 != 0x0\n");
+}
+
+BOOST_AUTO_TEST_CASE(test_emulator_pool_layout) {
+  class keytest_interface : public chip8::KeyInterface {
+  public:
+    std::uint8_t getKey(int) noexcept {
+      return 0x5;
+    }
+  };
+  std::vector<chip8::emulator> pool(3);
+  for (chip8::emulator& emu : pool) {
+    BOOST_CHECK(reinterpret_cast<std::uintptr_t>(&emu) % 64 == 0);
+    BOOST_CHECK(emu.host == nullptr);
+    emu.initialize();
+  }
+  BOOST_CHECK(reinterpret_cast<const char*>(&pool[1]) -
+              reinterpret_cast<const char*>(&pool[0]) == 99 * 64);
+
+  // The key interface lives in host_state and survives moving the pool.
+  pool[0].set_keyinterface(std::make_unique<keytest_interface>());
+  pool.emplace_back();
+  std::uint8_t rom[] = { 0x60, 0x05, 0xE0, 0x9E };  // V0 = 5, skip if key 5
+  pool[0].load(rom, sizeof(rom));
+  pool[0].emulateCycle(true);
+  pool[0].emulateCycle(true);
+  BOOST_CHECK(pool[0].pc == 0x206);
+}
+
+static_assert(chip8::input_policy<chip8::bitmap_input> &&
+              chip8::input_policy<chip8::null_input> &&
+              chip8::input_policy<chip8::replay_input> &&
+              chip8::input_policy<chip8::interface_input> &&
+              !chip8::input_policy<int>);
+
+BOOST_AUTO_TEST_CASE(test_input_policies) {
+  std::uint8_t rom[] = { 0xF3, 0x0A,    // V3 = wait for key
+                         0x64, 0x01,    // V4 = 1
+                         0xE3, 0x9E,    // skip if key V3 down
+                         0x64, 0x02,    // V4 = 2
+                         0x12, 0x04 };  // goto 204
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  chip8::emulator start;
+  start.copy_state(emu);
+
+  // Nothing ever pressed: FX0A waits and the wait is skipped as idle.
+  chip8::null_input none;
+  chip8::run_events ev = emu.run_frame(none);
+  BOOST_CHECK(emu.pc == 0x200);
+  BOOST_CHECK(ev.waiting_for_input);
+  BOOST_CHECK(ev.idle_cycles == 9);
+
+  // Key 7 held from the third frame on, released in the fifth.
+  std::uint16_t frames[] = { 0, 0, 1 << 7, 1 << 7, 0 };
+  chip8::replay_input replay{frames, 5};
+  emu.copy_state(start);
+  for (int f = 0; f < 2; f++, replay.next_frame()) emu.run_frame(replay);
+  BOOST_CHECK(emu.pc == 0x200);
+  emu.run_frame(replay);
+  replay.next_frame();
+  BOOST_CHECK(emu.V[3] == 7);
+  BOOST_CHECK(emu.V[4] == 1);
+  emu.run_frame(replay);
+  replay.next_frame();
+  emu.run_frame(replay);
+  BOOST_CHECK(emu.V[4] == 2);
+
+  // The keys bitmap gives the same as the default run_frame.
+  chip8::emulator other;
+  other.copy_state(start);
+  emu.copy_state(start);
+  emu.key_event(9, true);
+  other.key_event(9, true);
+  chip8::bitmap_input bitmap{&emu.keys};
+  emu.run_frame(bitmap);
+  other.run_frame();
+  BOOST_CHECK(emu.V[3] == 9 && other.V[3] == 9);
+  BOOST_CHECK(emu.V[4] == 1 && other.V[4] == 1);
+  BOOST_CHECK(emu.pc == other.pc);
+}
+
+BOOST_AUTO_TEST_CASE(test_fused_engine_self_modifying) {
+  // The first pass fuses two 6XNN pairs and then turns 6300 into 7303,
+  // which the second pass has to run unfused.
+  std::uint8_t rom[] = { 0x62, 0x00,    // V2 = 0
+                         0x63, 0x00,    // V3 = 0
+                         0x60, 0x73,    // V0 = 73
+                         0x61, 0x03,    // V1 = 03
+                         0xA2, 0x02,    // I = 202
+                         0xF1, 0x55,    // store V0, V1 at 202
+                         0x12, 0x00 };  // goto 200
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  chip8::emulator start;
+  start.copy_state(emu);
+
+  chip8::fused_engine fused;
+  fused.run_cycles(emu, 14);
+  BOOST_CHECK(emu.pc == 0x200);
+  BOOST_CHECK(emu.V[3] == 3);
+  BOOST_CHECK(emu.cycles == 14);
+  BOOST_CHECK(fused.stats.fused[chip8::fuse_set_pair] == 3);
+  BOOST_CHECK(fused.stats.unfused == 8);
+  BOOST_CHECK(fused.stats.fused_cycles + fused.stats.unfused == 14);
+
+  chip8::lockstep check(*chip8::find_engine("reference"),
+                        *chip8::find_engine("fused"));
+  BOOST_CHECK(check.run(start, 1000, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_fused_engine_loops) {
+  std::uint8_t rom[] = { 0x60, 0x00,    // V0 = 0
+                         0x70, 0x01,    // V0 += 1
+                         0x30, 0x05,    // skip if V0 == 5
+                         0x12, 0x02,    // goto 202
+                         0xF1, 0x07,    // V1 = delay
+                         0x31, 0x00,    // skip if V1 == 0
+                         0x12, 0x08,    // goto 208
+                         0x12, 0x0E };  // goto 20E
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.delay_timer = 2;
+  // 1 + 4 * 3 + 2 counting, a round of the timer wait, two skipped
+  // rounds and two instructions of the next round
+  emu.cycles_per_frame = 26;
+  chip8::emulator start;
+  start.copy_state(emu);
+
+  chip8::fused_engine fused;
+  chip8::run_events ev = fused.run_frame(emu);
+  BOOST_CHECK(fused.stats.fused[chip8::fuse_count_loop] == 5);
+  BOOST_CHECK(fused.stats.fused[chip8::fuse_timer_wait] == 1);
+  BOOST_CHECK(ev.idle_cycles == 6);
+  BOOST_CHECK(emu.pc == 0x20C);
+  BOOST_CHECK(emu.delay_timer == 1);
+
+  chip8::lockstep check(*chip8::find_engine("reference"),
+                        *chip8::find_engine("fused"));
+  check.block = 26;
+  BOOST_CHECK(check.run(start, 2600, 1));
+}
+
+BOOST_AUTO_TEST_CASE(test_run_ahead_shows_future_frame) {
+  // Draws the sprite of the key held down, after waiting for it.
+  std::uint8_t rom[] = { 0xF0, 0x0A,    // V0 = wait for key
+                         0xF0, 0x29,    // I = sprite V0
+                         0xD1, 0x15,    // draw
+                         0x12, 0x06 };  // goto 206
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.cycles_per_frame = 2;
+
+  chip8::run_ahead ahead(2);
+  chip8::run_events ev = emu.run_frame();
+  BOOST_CHECK(ahead.update(emu, ev));
+  emu.key_event(8, true);
+  ev = emu.run_frame();
+  BOOST_CHECK(!ev.screen_changed);
+  // The real frame only got to FX29, two frames on the sprite is drawn.
+  BOOST_CHECK(ahead.update(emu, ev));
+  BOOST_CHECK(emu.gfx[0][0] == 0);
+  BOOST_CHECK(ahead.screen().gfx[0][0] == 1);
+  BOOST_CHECK(emu.pc == 0x204);
+  BOOST_CHECK(ahead.updates == 2);
+  BOOST_CHECK(ahead.max_ns > 0 && ahead.max_ns < 16667000);
+
+  ahead.frames = 0;
+  ahead.update(emu, ev);
+  BOOST_CHECK(&ahead.screen() == &emu);
+}
+
+BOOST_AUTO_TEST_CASE(test_search_finds_key_sequence) {
+  // A combination lock: key 3, then key 7 sets V2.
+  std::uint8_t rom[] = { 0x60, 0x03,    // V0 = 3
+                         0x61, 0x07,    // V1 = 7
+                         0xE0, 0x9E,    // skip if key V0
+                         0x12, 0x04,    // goto 204
+                         0xE1, 0x9E,    // skip if key V1
+                         0x12, 0x08,    // goto 208
+                         0x62, 0x02,    // V2 = 2
+                         0x12, 0x0E };  // goto 20E
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.seed(5);
+
+  std::string error;
+  chip8::expression goal;
+  BOOST_REQUIRE(goal.parse("V2 == 2", error));
+  chip8::search_options options;
+  options.hold = 1;
+  options.threads = 2;
+  chip8::state_search search(goal, nullptr, options);
+  chip8::search_result result = search.run(emu);
+  BOOST_REQUIRE(result.found);
+  BOOST_CHECK(result.path == std::vector<std::uint8_t>({ 3, 7 }));
+  // Every key but 3 leaves the machine where it was.
+  BOOST_CHECK(result.duplicates >= 15);
+
+  // The steps replay as a movie.
+  chip8::movie m = chip8::search_movie(result.path, options, emu,
+                                       chip8::hash_rom(rom, sizeof(rom)));
+  chip8::movie_player player(m);
+  BOOST_REQUIRE(player.start(emu, rom, sizeof(rom), error));
+  while (!player.finished(emu)) player.run_frame(emu);
+  BOOST_CHECK(emu.V[2] == 2);
+
+  // One step is not enough.
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  options.max_depth = 1;
+  chip8::state_search shallow(goal, nullptr, options);
+  BOOST_CHECK(!shallow.run(emu).found);
+}
+
+BOOST_AUTO_TEST_CASE(test_search_shortest_with_threads) {
+  // Adds each key pressed to V1; a key has to be released before it
+  // counts again. V1 == 10 takes four steps at the least: 3 2 3 2.
+  std::uint8_t rom[] = { 0xF0, 0x0A,    // V0 = wait for key
+                         0x81, 0x04,    // V1 += V0
+                         0xE0, 0xA1,    // skip if key V0 is up
+                         0x12, 0x04,    // goto 204
+                         0x12, 0x00 };  // goto 200
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.seed(1);
+
+  // A state reached again at a smaller depth counts as new.
+  chip8::state_set set;
+  BOOST_CHECK(set.insert(42, 3));
+  BOOST_CHECK(!set.insert(42, 3));
+  BOOST_CHECK(!set.insert(42, 5));
+  BOOST_CHECK(set.insert(42, 2));
+  BOOST_CHECK(set.size() == 1);
+
+  std::string error;
+  chip8::expression goal;
+  BOOST_REQUIRE(goal.parse("V1 == 10", error));
+  chip8::search_options options;
+  options.hold = 1;
+  options.keys = 0x000E;
+  for (unsigned threads : { 1u, 4u, 8u }) {
+    options.threads = threads;
+    for (int run = 0; run < 10; run++) {
+      chip8::state_search search(goal, nullptr, options);
+      chip8::search_result result = search.run(emu);
+      BOOST_REQUIRE(result.found);
+      BOOST_CHECK(result.path.size() == 4);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_tracer_writes_chrome_json) {
+  chip8::tracer tracer(4);
+  tracer.name_thread("main");
+  {
+    chip8::trace_scope frame(&tracer, "frame");
+    chip8::trace_scope emulate(&tracer, "emulate");
+    emulate.end();
+  }
+  std::thread other([&tracer] {
+    for (int i = 0; i < 10; i++) tracer.record("sleep", 1000, 2000);
+  });
+  other.join();
+  // Without a tracer nothing is recorded.
+  { chip8::trace_scope off(nullptr, "render"); }
+
+  BOOST_CHECK(tracer.recorded() == 12);
+  std::string json = tracer.json();
+  BOOST_CHECK(json.find("\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                        "\"tid\":1,\"args\":{\"name\":\"main\"}") !=
+              std::string::npos);
+  BOOST_CHECK(json.find("\"name\":\"emulate\",\"ph\":\"X\",\"pid\":1,"
+                        "\"tid\":1") != std::string::npos);
+  BOOST_CHECK(json.find("\"name\":\"frame\"") != std::string::npos);
+  // The second thread keeps its last 4 events only.
+  std::size_t sleeps = 0;
+  for (std::size_t p = json.find("\"tid\":2"); p != std::string::npos;
+       p = json.find("\"tid\":2", p + 1)) {
+    sleeps++;
+  }
+  BOOST_CHECK(sleeps == 4);
+  BOOST_CHECK(json.find("render") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(test_frame_stats_histograms) {
+  chip8::frame_stats stats;
+  std::uint64_t t = 1000000000;
+  for (int i = 0; i < 10; i++) {
+    stats.frame(t);
+    t += 16667000;
+  }
+  stats.frame(t + 10000000);
+  stats.pause();
+  stats.frame(t + 900000000);
+  BOOST_CHECK(stats.frames == 10);
+  BOOST_CHECK(stats.times[16] == 9);
+  BOOST_CHECK(stats.times[26] == 1);
+  BOOST_CHECK(stats.dropped == 1);
+  BOOST_CHECK(stats.jitters[0] == 9);
+  BOOST_CHECK(stats.jitters[chip8::frame_stats::jitter_bucket(10000000)] == 1);
+  BOOST_CHECK(stats.report().find("frames 10,") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_rom_archive_round_trip) {
+  std::vector<chip8::archive_rom> roms(3);
+  roms[0].name = "pong";
+  roms[0].data = { 0x12, 0x00 };
+  roms[1].name = "brix";
+  roms[1].data = { 0x60, 0x01, 0x12, 0x02 };
+  roms[1].cycles_per_frame = 15;
+  roms[1].quirks = chip8::quirk_shift_vx;
+  std::memcpy(roms[1].keymap, "x123qweasdzc4rfv", 16);
+  roms[1].description = "Breakout clone";
+  roms[1].blocks = { { 0x200, 0x204 } };
+  roms[2].name = "copy";
+  roms[2].data = roms[0].data;
+
+  std::vector<std::uint8_t> bytes = chip8::encode_archive(roms);
+  {
+    std::ofstream out("archive_test.c8ra", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+  chip8::rom_archive archive;
+  std::string error;
+  BOOST_REQUIRE(archive.open("archive_test.c8ra", error));
+  BOOST_CHECK(archive.count() == 3);
+  // Sorted by name.
+  BOOST_CHECK(archive.name(0) == "brix");
+  BOOST_CHECK(archive.find("pong") == 2);
+  BOOST_CHECK(archive.find("tetris") == -1);
+  long brix = archive.find("brix");
+  BOOST_CHECK(archive.entry(brix).cycles_per_frame == 15);
+  BOOST_CHECK(archive.entry(brix).quirks == chip8::quirk_shift_vx);
+  BOOST_CHECK(std::memcmp(archive.entry(brix).keymap, "x123qweasdzc4rfv", 16) == 0);
+  BOOST_CHECK(archive.description(brix) == "Breakout clone");
+  BOOST_CHECK(archive.entry(brix).block_count == 1);
+  BOOST_CHECK(archive.block(brix, 0).first == 0x200);
+  BOOST_CHECK(archive.block(brix, 0).second == 0x204);
+  // Equal ROMs find the first name.
+  BOOST_CHECK(archive.find_hash(chip8::hash_rom(roms[0].data.data(), 2)) ==
+              archive.find("copy"));
+  BOOST_CHECK(archive.find_hash(0) == -1);
+
+  chip8::emulator emu;
+  emu.initialize();
+  archive.load(brix, emu);
+  BOOST_CHECK(emu.memory[0x200] == 0x60 && emu.cycles_per_frame == 15);
+  BOOST_CHECK(archive.get(brix).description == "Breakout clone");
+
+  // A truncated archive is refused.
+  {
+    std::ofstream out("archive_test.c8ra", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size() - 1);
+  }
+  BOOST_CHECK(!archive.open("archive_test.c8ra", error));
+  std::remove("archive_test.c8ra");
+}
+
+BOOST_AUTO_TEST_CASE(test_conformance_catalogue) {
+  std::vector<chip8::conformance_case> cases;
+  std::string error;
+  BOOST_REQUIRE(chip8::parse_catalogue(
+    "# comment\n"
+    "\n"
+    "digits.ch8 2 0xDEADBEEF cycles=3  # trailing comment\n"
+    "/abs/rom 600 12AB seed=9 quirks=0 replay=keys.c8mv\n",
+    "suite/", cases, error));
+  BOOST_REQUIRE(cases.size() == 2);
+  BOOST_CHECK(cases[0].rom == "suite/digits.ch8" && cases[0].line == 3);
+  BOOST_CHECK(cases[0].frames == 2 && cases[0].expected == 0xDEADBEEF);
+  BOOST_CHECK(cases[0].cycles_per_frame == 3 && cases[0].seed == 1);
+  BOOST_CHECK(cases[1].rom == "/abs/rom" && cases[1].replay == "suite/keys.c8mv");
+  BOOST_CHECK(cases[1].seed == 9 && cases[1].quirks == 0);
+  BOOST_CHECK(!chip8::parse_catalogue("rom 10\n", "", cases, error));
+  BOOST_CHECK(!chip8::parse_catalogue("rom 10 0 speed=2\n", "", cases, error));
+
+  // Draws digit 0 to F, one per frame.
+  std::uint8_t rom[] = { 0xF0, 0x29,    // I = sprite V0
+                         0xD1, 0x15,    // draw
+                         0x70, 0x01,    // V0 += 1
+                         0x12, 0x00 };  // goto 200
+  {
+    std::ofstream out("conformance_test.ch8", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(rom), sizeof(rom));
+  }
+  chip8::conformance_case c;
+  c.rom = "conformance_test.ch8";
+  c.frames = 3;
+  c.cycles_per_frame = 4;
+  chip8::emulator emu;
+  std::uint32_t reference = 0, fused = 0;
+  BOOST_REQUIRE(chip8::run_case(c, chip8::engines[0], emu, reference, error));
+  BOOST_CHECK(emu.V[0] == 3);
+  BOOST_REQUIRE(chip8::run_case(c, *chip8::find_engine("fused"), emu, fused, error));
+  BOOST_CHECK(reference == fused);
+  BOOST_CHECK(reference == chip8::screen_hash(emu));
+  c.frames = 2;
+  BOOST_REQUIRE(chip8::run_case(c, chip8::engines[0], emu, fused, error));
+  BOOST_CHECK(reference != fused);
+  std::remove("conformance_test.ch8");
+  c.rom = "missing.ch8";
+  BOOST_CHECK(!chip8::run_case(c, chip8::engines[0], emu, fused, error));
+}
+
+BOOST_AUTO_TEST_CASE(test_coroutine_sessions_match_run_frame) {
+  std::uint8_t rom[] = { 0x61, 0x05,    // V1 = 5
+                         0xF1, 0x15,    // delay = V1
+                         0xF0, 0x0A,    // V0 = wait for key
+                         0xF0, 0x29,    // I = sprite V0
+                         0xD2, 0x35,    // draw at V2, V3
+                         0x72, 0x05,    // V2 += 5
+                         0x12, 0x02 };  // goto 202
+  chip8::coroutine_scheduler scheduler;
+  std::size_t id = scheduler.add(rom, sizeof(rom), 3, 7);
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.seed(3);
+  emu.cycles_per_frame = 7;
+
+  struct { unsigned frame; std::uint8_t key; bool down; } events[] = {
+    { 50, 4, true }, { 52, 4, false }, { 120, 3, true }, { 121, 3, false },
+    { 121, 7, true }, { 125, 7, false }, { 126, 9, true }, { 126, 9, false }
+  };
+  unsigned compared = 0, waited = 0;
+  for (unsigned f = 1; f <= 200; f++) {
+    for (const auto& e : events) {
+      if (e.frame != f) continue;
+      scheduler.key_event(id, e.key, e.down);
+      emu.key_event(e.key, e.down);
+    }
+    scheduler.run_frame();
+    emu.run_frame();
+    if (scheduler.waiting() != 0) {
+      waited++;
+      continue;
+    }
+    const chip8::emulator& c = scheduler.emu(id);
+    BOOST_CHECK(c.cycles == emu.cycles && c.pc == emu.pc && c.I == emu.I);
+    BOOST_CHECK(std::memcmp(c.V, emu.V, sizeof(emu.V)) == 0);
+    BOOST_CHECK(c.delay_timer == emu.delay_timer);
+    BOOST_CHECK(std::memcmp(c.gfx, emu.gfx, sizeof(emu.gfx)) == 0);
+    compared++;
+  }
+  // Running while a key is held in frames 50-51 and 120-124; the press
+  // and release before frame 126 are never seen.
+  BOOST_CHECK(scheduler.emu(id).V[0] == 7);
+  BOOST_CHECK(emu.V[0] == 7);
+  BOOST_CHECK(compared == 7 && waited == 193);
+  BOOST_CHECK(chip8::session_task::promise_type::frame_size > 0);
+
+  // Sessions waiting for a key are not run.
+  chip8::coroutine_scheduler many;
+  for (int i = 0; i < 1000; i++) many.add(rom, sizeof(rom));
+  many.run_frame();
+  BOOST_CHECK(many.waiting() == 1000);
+  many.key_event(10, 1, true);
+  many.run_frame();
+  BOOST_CHECK(many.waiting() == 999);
+  BOOST_CHECK(many.emu(10).V[0] == 1 && many.emu(10).cycles == 20);
+  BOOST_CHECK(many.emu(11).cycles == 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_gfx_hash_follows_screen) {
+  std::uint8_t rom[] = { 0xC1, 0x3F,    // V1 = random x
+                         0xC2, 0x1F,    // V2 = random y
+                         0xC0, 0x0F,    // V0 = random digit
+                         0xF0, 0x29,    // I = sprite V0
+                         0xD1, 0x25,    // draw at V1, V2, wrapping
+                         0xC3, 0x07,    // V3 = random 0-7
+                         0x43, 0x00,    // clear if V3 == 0
+                         0x00, 0xE0,
+                         0x12, 0x00 };  // goto 200
+  chip8::emulator emu;
+  emu.initialize();
+  emu.load(rom, sizeof(rom));
+  emu.seed(5);
+  BOOST_CHECK(emu.gfx_hash == 0);
+  unsigned cleared = 0;
+  for (int f = 0; f < 300; f++) {
+    emu.run_frame();
+    BOOST_CHECK(emu.gfx_hash == chip8::hash_screen(emu.gfx));
+    if (emu.gfx_hash == 0) cleared++;
+  }
+  BOOST_CHECK(cleared > 0 && cleared < 300);
+
+  // Drawing a sprite twice leaves screen and hash as they were.
+  const std::uint64_t before = emu.gfx_hash;
+  emu.V[1] = 62;
+  emu.V[2] = 30;
+  emu.I = 0;
+  emu.execute(0xD125);
+  BOOST_CHECK(emu.gfx_hash != before);
+  emu.execute(0xD125);
+  BOOST_CHECK(emu.gfx_hash == before);
+
+  chip8::emulator copy;
+  copy.initialize();
+  copy.copy_state(emu);
+  BOOST_CHECK(copy.gfx_hash == before);
+  chip8::state_body body;
+  chip8::capture_state(emu, body);
+  copy.initialize();
+  chip8::restore_state(body, copy);
+  BOOST_CHECK(copy.gfx_hash == before);
+  emu.reset();
+  BOOST_CHECK(emu.gfx_hash == 0);
+}
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Copyright 2019 Daniel Weber
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+namespace chip8 {
+
+// Collects timed phases ("emulate", "render", ...) of any number of
+// threads and writes them as Chrome trace JSON, which ui.perfetto.dev and
+// chrome://tracing open. Every thread writes into its own ring buffer
+// without locks; only the first event of a thread takes a lock, to
+// register the buffer. A buffer keeps the latest capacity events.
+class tracer {
+public:
+  // capacity: events kept per thread, rounded up to a power of two.
+  explicit tracer(std::size_t capacity = 1 << 16)
+      : id(next_id()), origin(now_ns()) {
+    mask = 1;
+    while (mask < capacity) mask <<= 1;
+    mask--;
+  }
+
+  static std::uint64_t now_ns() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Records a phase of the calling thread from begin to end, in now_ns().
+  void record(const char* name, std::uint64_t begin, std::uint64_t end) {
+    buffer& b = local();
+    std::uint64_t n = b.count.load(std::memory_order_relaxed);
+    b.events[n & mask] = { name, begin, end };
+    b.count.store(n + 1, std::memory_order_release);
+  }
+
+  // Names the calling thread in the trace.
+  void name_thread(const char* name) { local().name = name; }
+
+  // Events recorded, including ones overwritten since.
+  std::uint64_t recorded() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::uint64_t n = 0;
+    for (const auto& b : buffers) n += b->count.load(std::memory_order_acquire);
+    return n;
+  }
+
+  // The trace as Chrome trace JSON. Call it once the traced threads are
+  // done, an event overwritten while it is read comes out torn.
+  std::string json() const {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    char line[192];
+    bool first = true;
+    for (const auto& b : buffers) {
+      if (b->name != nullptr) {
+        std::snprintf(line, sizeof(line),
+                      "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                      first ? "" : ",", b->tid, b->name);
+        out += line;
+        first = false;
+      }
+      std::uint64_t n = b->count.load(std::memory_order_acquire);
+      std::uint64_t i = n > mask + 1 ? n - (mask + 1) : 0;
+      for (; i < n; i++) {
+        const event& e = b->events[i & mask];
+        std::snprintf(line, sizeof(line),
+                      "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                      "\"ts\":%.3f,\"dur\":%.3f}",
+                      first ? "" : ",", e.name, b->tid,
+                      (e.begin - origin) / 1e3, (e.end - e.begin) / 1e3);
+        out += line;
+        first = false;
+      }
+    }
+    out += "\n]}\n";
+    return out;
+  }
+
+  bool write(const std::string& path, std::string& error) const {
+    std::FILE* f = std::fopen(path.c_str(), "w");
+    if (f == nullptr) {
+      error = "cannot open " + path;
+      return false;
+    }
+    std::string text = json();
+    bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = std::fclose(f) == 0 && ok;
+    if (!ok) error = "cannot write " + path;
+    return ok;
+  }
+
+private:
+  struct event {
+    const char* name;
+    std::uint64_t begin;
+    std::uint64_t end;
+  };
+
+  struct buffer {
+    std::unique_ptr<event[]> events;
+    std::atomic<std::uint64_t> count{0};
+    unsigned tid = 0;
+    const char* name = nullptr;
+  };
+
+  static std::uint64_t next_id() {
+    static std::atomic<std::uint64_t> ids{1};
+    return ids++;
+  }
+
+  // The buffer of the calling thread, registered on first use. A thread
+  // remembers the last tracer it wrote to, so the lookup is a compare.
+  buffer& local() {
+    struct cache {
+      std::uint64_t owner = 0;
+      buffer* b = nullptr;
+    };
+    thread_local cache c;
+    if (c.owner == id) return *c.b;
+    std::lock_guard<std::mutex> guard(lock);
+    buffers.push_back(std::make_unique<buffer>());
+    buffer& b = *buffers.back();
+    b.events = std::make_unique<event[]>(mask + 1);
+    b.tid = buffers.size();
+    c.owner = id;
+    c.b = &b;
+    return b;
+  }
+
+  const std::uint64_t id;
+  const std::uint64_t origin;
+  std::uint64_t mask;
+  mutable std::mutex lock;
+  std::vector<std::unique_ptr<buffer>> buffers;
+};
+
+// Records the lifetime of the scope as a phase. With a null tracer it
+// does nothing and does not read the clock.
+class trace_scope {
+public:
+  trace_scope(tracer* t, const char* name)
+      : t(t), name(name), begin(t != nullptr ? tracer::now_ns() : 0) {}
+  ~trace_scope() { end(); }
+
+  // Ends the phase before the scope does.
+  void end() {
+    if (t != nullptr) t->record(name, begin, tracer::now_ns());
+    t = nullptr;
+  }
+
+  trace_scope(const trace_scope&) = delete;
+  trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+  tracer* t;
+  const char* name;
+  std::uint64_t begin;
+};
+
+// Frame times and their distance from the 60 Hz period as histograms:
+// frame times in 1 ms buckets, jitter in buckets doubling from 32 us.
+class frame_stats {
+public:
+  static constexpr std::uint64_t period_ns = 16667000;
+  static constexpr int time_buckets = 50;
+  static constexpr int jitter_buckets = 16;
+
+  // Call at the start of every frame.
+  void frame(std::uint64_t now) {
+    if (last != 0) add(now - last);
+    last = now;
+  }
+
+  // The next frame starts a new measurement, for gaps that are no frame,
+  // e.g. blocking for a key.
+  void pause() { last = 0; }
+
+  void add(std::uint64_t frame_ns) {
+    std::uint64_t jitter = frame_ns > period_ns ? frame_ns - period_ns
+                                                : period_ns - frame_ns;
+    std::uint64_t t = frame_ns / 1000000;
+    times[t < time_buckets ? t : time_buckets - 1]++;
+    jitters[jitter_bucket(jitter)]++;
+    frames++;
+    total_ns += frame_ns;
+    if (frame_ns > max_ns) max_ns = frame_ns;
+    if (frame_ns > period_ns * 3 / 2) dropped++;
+  }
+
+  // 0 below 32 us, then one per doubling, the last one open ended.
+  static int jitter_bucket(std::uint64_t ns) {
+    int b = 0;
+    for (std::uint64_t limit = 32000; ns >= limit && b < jitter_buckets - 1;
+         limit *= 2) {
+      b++;
+    }
+    return b;
+  }
+
+  // Summary and both histograms, empty buckets left out, e.g.
+  //   frames 3600, mean 16.67 ms, max 24.10 ms, 2 over 25.00 ms
+  //   frame time   <  17.000 ms     3412 ########################################
+  std::string report() const {
+    std::string out;
+    char line[128];
+    std::snprintf(line, sizeof(line),
+                  "frames %llu, mean %.2f ms, max %.2f ms, %llu over %.2f ms\n",
+                  static_cast<unsigned long long>(frames),
+                  frames ? total_ns / 1e6 / frames : 0.0, max_ns / 1e6,
+                  static_cast<unsigned long long>(dropped),
+                  period_ns * 1.5 / 1e6);
+    out += line;
+    double time_limits[time_buckets];
+    for (int b = 0; b < time_buckets; b++) time_limits[b] = b + 1;
+    double jitter_limits[jitter_buckets];
+    for (int b = 0; b < jitter_buckets; b++) {
+      jitter_limits[b] = (32000ull << b) / 1e6;
+    }
+    append(out, "frame time", times, time_limits, time_buckets);
+    append(out, "jitter", jitters, jitter_limits, jitter_buckets);
+    return out;
+  }
+
+  std::uint64_t frames = 0;
+  // frames longer than one and a half periods
+  std::uint64_t dropped = 0;
+  std::uint64_t max_ns = 0;
+  std::uint64_t times[time_buckets] = {};
+  std::uint64_t jitters[jitter_buckets] = {};
+
+private:
+  static void append(std::string& out, const char* title,
+                     const std::uint64_t* counts, const double* limits,
+                     int n) {
+    std::uint64_t most = *std::max_element(counts, counts + n);
+    char line[128];
+    for (int b = 0; b < n; b++) {
+      if (counts[b] == 0) continue;
+      bool last = b == n - 1;
+      int bar = static_cast<int>(40 * counts[b] / most);
+      std::snprintf(line, sizeof(line), "%-12s %s %7.3f ms %8llu %.*s\n",
+                    title, last ? ">=" : "< ",
+                    last ? limits[b - 1] : limits[b],
+                    static_cast<unsigned long long>(counts[b]), bar,
+                    "########################################");
+      out += line;
+    }
+  }
+
+  std::uint64_t last = 0;
+  std::uint64_t total_ns = 0;
+};
+
+}  // namespace chip8
+
+#endif  // TRACE_H_
@@ -0,0 +1,63 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "chip8.h"
+#include "ansi.h"
+#include "shm.h"
+
+// Copyright 2019 Daniel Weber
+
+// chip8view <segment>
+//
+// Shows the screen and registers an emulator publishes with --shm, e.g.
+//
+//   chip8dump roms/rom --frames 10000000 --shm /chip8 &
+//   chip8view /chip8
+//
+// The viewer maps the segment read-only and never blocks the publisher.
+// It exits when the publisher stops publishing for five seconds.
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::cerr << "usage: chip8view <segment>" << std::endl;
+    return 1;
+  }
+  chip8::shm_reader reader;
+  std::string error;
+  if (!reader.open(argv[1], error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+
+  chip8::ansi_renderer screen;
+  chip8::shared_state state;
+  std::uint32_t seen = ~0u;
+  unsigned idle = 0;
+  auto next_frame = std::chrono::steady_clock::now();
+  while (idle < 5 * 60) {
+    std::uint32_t generation = reader.generation();
+    if (generation != seen && reader.read(state)) {
+      seen = generation;
+      idle = 0;
+      screen.render(state.gfx);
+      std::printf("\x1b[18;1Hframe %-10llu cycles %-12llu pc %03X I %03X "
+                  "sp %X DT %02X ST %02X\x1b[K\n",
+                  static_cast<unsigned long long>(state.frame),
+                  static_cast<unsigned long long>(state.cycles),
+                  state.pc, state.I, state.sp, state.delay_timer,
+                  state.sound_timer);
+      for (int i = 0; i < 16; i++) std::printf("V%X=%02X ", i, state.V[i]);
+      std::printf("\x1b[K");
+      std::fflush(stdout);
+    } else {
+      idle++;
+    }
+    next_frame += std::chrono::microseconds(16667);
+    std::this_thread::sleep_until(next_frame);
+  }
+  screen.finish();
+  std::printf("\x1b[20;1H");
+  return 0;
+}